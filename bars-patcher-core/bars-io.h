@@ -0,0 +1,427 @@
+//BARS file input and output for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Where mmap is available, the input BARS file is mapped as a private copy-on-write mapping.
+//Only the pages that are read or patched are loaded, and patching never modifies the input file.
+//Everywhere else, or when the file can't be mapped, the file is read into memory with std::ifstream.
+//
+//The output file is created as a clone or in-kernel copy of the input file where possible,
+//and then only the byte ranges that were changed by patches are written into it.
+
+#pragma once
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fstream>
+
+#if defined BARSPATCHER_VERSION_PC
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#define BARSPATCHER_HAVE_MMAP
+#endif
+
+//Size limit for input files that are read into allocated memory instead of being mapped (64MB)
+#define BARSPATCHER_BARS_ALLOC_LIMIT 64000000
+
+struct barspatcher_bars_input_t {
+    unsigned char* data;
+    uint64_t size;
+    //1 if data is a memory mapping, 0 if data was allocated with malloc
+    bool mapped;
+};
+
+//Frees or unmaps the input data.
+void barspatcher_inputClose(barspatcher_bars_input_t* input) {
+    #if defined BARSPATCHER_HAVE_MMAP
+    if(input->mapped) {
+        munmap(input->data, input->size);
+        input->data = NULL;
+        return;
+    }
+    #endif
+    
+    free(input->data);
+    input->data = NULL;
+}
+
+//Reads the whole file into allocated memory.
+//Returns 0 on success, and barspatcher_run error codes on errors.
+unsigned char barspatcher_inputRead(barspatcher_bars_input_t* input, const char* filename) {
+    std::ifstream ifile;
+    ifile.open(filename, std::ios::in | std::ios::binary | std::ios::ate);
+    
+    if(!ifile.is_open()) {
+        perror(filename);
+        return 255;
+    }
+    
+    input->size = ifile.tellg();
+    input->mapped = 0;
+    
+    //64MB memory allocation limit for file data
+    if(input->size >= BARSPATCHER_BARS_ALLOC_LIMIT) {
+        printf("BARS input files larger than 64MB are not supported on this platform. The input file is %.1fMB.\n", (float)input->size/1000000);
+        
+        ifile.close();
+        
+        return 253;
+    }
+    
+    input->data = (unsigned char*)malloc(input->size);
+    if(input->data == NULL) {
+        printf("Could not allocate memory for BARS data.\n");
+        
+        ifile.close();
+        
+        return 100;
+    }
+    
+    ifile.seekg(0);
+    ifile.read((char*)input->data, input->size);
+    
+    if(!ifile.good()) {
+        perror(filename);
+        free(input->data);
+        input->data = NULL;
+        ifile.close();
+        return 254;
+    }
+    
+    ifile.close();
+    
+    return 0;
+}
+
+//Opens the input BARS file, mapping it when possible.
+//Returns 0 on success, and barspatcher_run error codes on errors.
+unsigned char barspatcher_inputOpen(barspatcher_bars_input_t* input, const char* filename) {
+    input->data = NULL;
+    input->size = 0;
+    input->mapped = 0;
+    
+    #if defined BARSPATCHER_HAVE_MMAP
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        perror(filename);
+        return 255;
+    }
+    
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        perror(filename);
+        close(fd);
+        return 254;
+    }
+    
+    //Empty files can't be mapped
+    if(st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        
+        if(map != MAP_FAILED) {
+            close(fd);
+            
+            input->data = (unsigned char*)map;
+            input->size = st.st_size;
+            input->mapped = 1;
+            
+            return 0;
+        }
+    }
+    
+    close(fd);
+    #endif
+    
+    return barspatcher_inputRead(input, filename);
+}
+
+
+//BARS file output
+
+//Byte range of the output that was changed by a patch
+struct barspatcher_range_t {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct barspatcher_range_list_t {
+    barspatcher_range_t* ranges;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+//Initializes an empty range list.
+void barspatcher_rangesInit(barspatcher_range_list_t* list) {
+    list->ranges = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+//Frees a range list.
+void barspatcher_rangesFree(barspatcher_range_list_t* list) {
+    free(list->ranges);
+    barspatcher_rangesInit(list);
+}
+
+//Removes all ranges from the list, keeping its memory.
+void barspatcher_rangesClear(barspatcher_range_list_t* list) {
+    list->count = 0;
+}
+
+//Adds a changed range to the list.
+//Returns 0 on success, and 1 on memory error.
+bool barspatcher_rangesAdd(barspatcher_range_list_t* list, uint64_t offset, uint64_t length) {
+    if(list->count >= list->capacity) {
+        uint32_t new_capacity = (list->capacity == 0 ? 64 : list->capacity * 2);
+        barspatcher_range_t* new_ranges = (barspatcher_range_t*)realloc(list->ranges, new_capacity * sizeof(barspatcher_range_t));
+        if(new_ranges == NULL) return 1;
+        
+        list->ranges = new_ranges;
+        list->capacity = new_capacity;
+    }
+    
+    list->ranges[list->count].offset = offset;
+    list->ranges[list->count].length = length;
+    list->count++;
+    
+    return 0;
+}
+
+//qsort comparison of ranges by offset.
+int barspatcher_rangesCompare(const void* a, const void* b) {
+    uint64_t offset_a = ((const barspatcher_range_t*)a)->offset;
+    uint64_t offset_b = ((const barspatcher_range_t*)b)->offset;
+    return (offset_a < offset_b ? -1 : (offset_a > offset_b ? 1 : 0));
+}
+
+//Sorts the ranges by offset and joins ranges that overlap.
+void barspatcher_rangesMerge(barspatcher_range_list_t* list) {
+    if(list->count < 2) return;
+    qsort(list->ranges, list->count, sizeof(barspatcher_range_t), barspatcher_rangesCompare);
+    
+    uint32_t count = 1;
+    for(uint32_t i=1; i < list->count; i++) {
+        barspatcher_range_t* last = &list->ranges[count-1];
+        const barspatcher_range_t* range = &list->ranges[i];
+        
+        if(range->offset <= last->offset + last->length) {
+            uint64_t end = range->offset + range->length;
+            if(end > last->offset + last->length) last->length = end - last->offset;
+        }
+        else list->ranges[count++] = *range;
+    }
+    
+    list->count = count;
+}
+
+//Returns a 64-bit FNV-1a digest of the location and contents of every range in data.
+uint64_t barspatcher_rangesDigest(const unsigned char* data, const barspatcher_range_list_t* list) {
+    uint64_t digest = 14695981039346656037ULL;
+    
+    for(uint32_t i=0; i < list->count; i++) {
+        const barspatcher_range_t* range = &list->ranges[i];
+        const unsigned char* bytes = data + range->offset;
+        
+        for(uint32_t b=0; b < 16; b++) {
+            digest ^= (b < 8 ? range->offset >> (b*8) : range->length >> ((b-8)*8)) & 0xFF;
+            digest *= 1099511628211ULL;
+        }
+        for(uint64_t b=0; b < range->length; b++) {
+            digest ^= bytes[b];
+            digest *= 1099511628211ULL;
+        }
+    }
+    
+    return digest;
+}
+
+//Writes the full BARS data to the output file.
+//bytes_written - Receives the number of bytes written on success, or NULL
+//Returns 0 on success, and barspatcher_run error codes on errors.
+unsigned char barspatcher_outputWriteFull(const unsigned char* data, uint64_t size, const char* output_filename, uint64_t* bytes_written = NULL) {
+    std::ofstream ofile;
+    ofile.open(output_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!ofile.is_open()) {
+        perror(output_filename);
+        return 249;
+    }
+    
+    ofile.write((const char*)data, size);
+    
+    //Check for write errors
+    if(!ofile.good()) {
+        perror(output_filename);
+        ofile.close();
+        return 248;
+    }
+    
+    ofile.close();
+    
+    if(bytes_written != NULL) *bytes_written = size;
+    
+    return 0;
+}
+
+//Writes the given ranges of data into an existing output file, the rest of the file is not changed.
+//bytes_written - Receives the number of bytes written on success, or NULL
+//Returns 0 on success, and barspatcher_run error codes on errors.
+unsigned char barspatcher_outputUpdate(const unsigned char* data, const char* output_filename, const barspatcher_range_list_t* ranges, uint64_t* bytes_written = NULL) {
+    FILE* ofile = fopen(output_filename, "r+b");
+    if(ofile == NULL) {
+        perror(output_filename);
+        return 249;
+    }
+    
+    bool write_error = 0;
+    uint64_t written = 0;
+    for(uint32_t i=0; i < ranges->count && !write_error; i++) {
+        const barspatcher_range_t* range = &ranges->ranges[i];
+        write_error = (fseek(ofile, range->offset, SEEK_SET) != 0 || fwrite(data + range->offset, 1, range->length, ofile) != range->length);
+        written += range->length;
+    }
+    
+    if(fclose(ofile) != 0) write_error = 1;
+    
+    if(write_error) {
+        perror(output_filename);
+        return 248;
+    }
+    
+    if(bytes_written != NULL) *bytes_written = written;
+    
+    return 0;
+}
+
+#if defined BARSPATCHER_HAVE_MMAP
+
+#if defined __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+//Writes size bytes from data at offset, retrying short writes.
+//Returns 0 on success, and 1 on write error.
+bool barspatcher_pwriteAll(int fd, const unsigned char* data, uint64_t size, uint64_t offset) {
+    while(size > 0) {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return 1;
+        }
+        
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    
+    return 0;
+}
+
+//Makes the output file a copy of the input file without going through user space.
+//Uses a reflink clone where the filesystem supports it, and copy_file_range otherwise.
+//Returns 0 on success, and 1 if the file has to be copied some other way.
+bool barspatcher_outputClone(int in_fd, int out_fd, uint64_t size) {
+    #if defined __linux__
+    #if defined FICLONE
+    if(ioctl(out_fd, FICLONE, in_fd) == 0) return 0;
+    #endif
+    
+    loff_t in_off = 0, out_off = 0;
+    while((uint64_t)in_off < size) {
+        ssize_t copied = copy_file_range(in_fd, &in_off, out_fd, &out_off, size - in_off, 0);
+        if(copied < 0 && errno == EINTR) continue;
+        if(copied <= 0) return 1;
+    }
+    
+    return 0;
+    #else
+    (void)in_fd;
+    (void)out_fd;
+    (void)size;
+    return 1;
+    #endif
+}
+
+/*
+ * Writes the patched BARS file by copying the input file and then writing only the changed ranges.
+ * 
+ * data, size - Patched BARS data
+ * input_filename - Original BARS file that data was loaded from
+ * ranges - Every range of data that is different from the input file
+ * 
+ * bytes_written - Receives the number of bytes written on success, not counting the clone or copy of the input file, or NULL
+ * 
+ * If the output is the input file itself, only the changed ranges are written.
+ * If the input can't be cloned or copied in the kernel, the full data is written instead.
+ * 
+ * Returns 0 on success, and barspatcher_run error codes on errors.
+ * 
+ */
+unsigned char barspatcher_outputWrite(const unsigned char* data, uint64_t size, const char* input_filename, const char* output_filename, const barspatcher_range_list_t* ranges, uint64_t* bytes_written = NULL) {
+    int in_fd = open(input_filename, O_RDONLY);
+    if(in_fd < 0) return barspatcher_outputWriteFull(data, size, output_filename, bytes_written);
+    
+    int out_fd = open(output_filename, O_WRONLY | O_CREAT, 0666);
+    if(out_fd < 0) {
+        perror(output_filename);
+        close(in_fd);
+        return 249;
+    }
+    
+    //Without the stat data of both files, it can't be known if the input can be cloned, so everything is written
+    struct stat in_st, out_st;
+    bool have_stat = (fstat(in_fd, &in_st) == 0 && fstat(out_fd, &out_st) == 0);
+    bool same_file = (have_stat && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino);
+    
+    bool copied = same_file;
+    
+    if(have_stat && !same_file && (uint64_t)in_st.st_size == size && ftruncate(out_fd, 0) == 0) {
+        copied = !barspatcher_outputClone(in_fd, out_fd, size);
+    }
+    
+    close(in_fd);
+    
+    bool write_error = 0;
+    uint64_t written = 0;
+    
+    if(copied) {
+        //Only write the changed ranges
+        for(uint32_t i=0; i < ranges->count && !write_error; i++) {
+            write_error = barspatcher_pwriteAll(out_fd, data + ranges->ranges[i].offset, ranges->ranges[i].length, ranges->ranges[i].offset);
+            written += ranges->ranges[i].length;
+        }
+    } else {
+        //Write everything
+        write_error = (ftruncate(out_fd, 0) != 0 || barspatcher_pwriteAll(out_fd, data, size, 0));
+        written = size;
+    }
+    
+    if(write_error) {
+        perror(output_filename);
+        close(out_fd);
+        return 248;
+    }
+    
+    if(close(out_fd) != 0) {
+        perror(output_filename);
+        return 248;
+    }
+    
+    if(bytes_written != NULL) *bytes_written = written;
+    
+    return 0;
+}
+
+#else
+
+//Writes the patched BARS file. Ranged output is not supported on this platform, the full data is always written.
+//Returns 0 on success, and barspatcher_run error codes on errors.
+unsigned char barspatcher_outputWrite(const unsigned char* data, uint64_t size, const char* input_filename, const char* output_filename, const barspatcher_range_list_t* ranges, uint64_t* bytes_written = NULL) {
+    (void)input_filename;
+    (void)ranges;
+    return barspatcher_outputWriteFull(data, size, output_filename, bytes_written);
+}
+
+#endif
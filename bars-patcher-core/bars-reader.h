@@ -0,0 +1,194 @@
+//BARS archive reader for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Reads the BARS header, the track hash and offset tables and the AMTA entries into a compact track table,
+//so that the BWAV headers in the archive can be found without searching through the whole file.
+
+/*
+ * BARS layout:
+ * 0x00 - "BARS"
+ * 0x04 - File size
+ * 0x08 - Byte order mark
+ * 0x0A - Version
+ * 0x0C - Track count
+ * 0x10 - Track name CRC32 hashes, 4 bytes per track
+ * then - AMTA and BWAV offsets, 8 bytes per track
+ * 
+ * AMTA entries hold track metadata, the STRG section has the track name.
+ * BWAV offsets point to the BWAV headers embedded in the archive.
+ * 
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "bwav-header.h"
+#include "crc-index.h"
+
+//Offset value for tracks without a usable entry
+#define BARSPATCHER_BARS_NO_OFFSET 0xFFFFFFFF
+
+struct barspatcher_bars_track_t {
+    //Offset of the AMTA entry
+    uint32_t amta_offset;
+    //Offset of the track name in the AMTA entry, or BARSPATCHER_BARS_NO_OFFSET
+    uint32_t name_offset;
+    //Offset of the embedded BWAV header, or BARSPATCHER_BARS_NO_OFFSET if the track has no BWAV header
+    uint32_t bwav_offset;
+    //Raw CRC32 bytes of the embedded BWAV header as a CRC index key
+    uint32_t crc_key;
+};
+
+struct barspatcher_bars_info_t {
+    //0 = little endian, 1 = big endian
+    bool bom;
+    uint16_t version;
+    uint32_t track_count;
+    barspatcher_bars_track_t* tracks;
+};
+
+//Frees the track table.
+void barspatcher_barsFree(barspatcher_bars_info_t* info) {
+    free(info->tracks);
+    info->tracks = NULL;
+    info->track_count = 0;
+}
+
+//Reads the track name location from an AMTA entry with the byte order E.
+//Returns the offset of the null terminated name, or BARSPATCHER_BARS_NO_OFFSET if there is none.
+template<barspatcher_endian_t E>
+uint32_t barspatcher_amtaNameOffset(const unsigned char* data, uint64_t size, uint32_t amta_offset, uint32_t amta_size) {
+    if(amta_size < 0x1C) return BARSPATCHER_BARS_NO_OFFSET;
+    
+    uint32_t strg_offset = barspatcher_load<uint32_t, E>(data + amta_offset + 0x18);
+    if(strg_offset < 0x1C || (uint64_t)strg_offset + 0x08 > amta_size) return BARSPATCHER_BARS_NO_OFFSET;
+    if(!barspatcher_hasMagic(data, amta_offset + strg_offset, "STRG")) return BARSPATCHER_BARS_NO_OFFSET;
+    
+    //Make sure the name is terminated inside the entry
+    uint64_t name_offset = (uint64_t)amta_offset + strg_offset + 0x08;
+    uint64_t amta_end = (uint64_t)amta_offset + amta_size;
+    if(amta_end > size) return BARSPATCHER_BARS_NO_OFFSET;
+    if(memchr(data + name_offset, '\0', amta_end - name_offset) == NULL) return BARSPATCHER_BARS_NO_OFFSET;
+    
+    return name_offset;
+}
+
+//Reads the size of an AMTA entry and the location of its track name, with the byte order of the entry.
+//Returns 0 if the entry doesn't fit in the file.
+bool barspatcher_amtaRead(const unsigned char* data, uint64_t size, uint32_t amta_offset, uint32_t* name_offset_out) {
+    uint32_t amta_size;
+    
+    if(barspatcher_readBOM(data, amta_offset + 0x04)) {
+        amta_size = barspatcher_load<uint32_t, BARSPATCHER_BIG_ENDIAN>(data + amta_offset + 0x08);
+        if((uint64_t)amta_offset + amta_size > size) return 0;
+        *name_offset_out = barspatcher_amtaNameOffset<BARSPATCHER_BIG_ENDIAN>(data, size, amta_offset, amta_size);
+    }
+    else {
+        amta_size = barspatcher_load<uint32_t, BARSPATCHER_LITTLE_ENDIAN>(data + amta_offset + 0x08);
+        if((uint64_t)amta_offset + amta_size > size) return 0;
+        *name_offset_out = barspatcher_amtaNameOffset<BARSPATCHER_LITTLE_ENDIAN>(data, size, amta_offset, amta_size);
+    }
+    
+    return 1;
+}
+
+//Parses the header and track table of a BARS file with the byte order E, see barspatcher_barsParse.
+template<barspatcher_endian_t E>
+unsigned char barspatcher_barsParseTable(barspatcher_bars_info_t* info, const unsigned char* data, uint64_t size) {
+    info->version = barspatcher_load<uint16_t, E>(data + 0x0A);
+    
+    uint32_t bars_size = barspatcher_load<uint32_t, E>(data + 0x04);
+    uint32_t track_count = barspatcher_load<uint32_t, E>(data + 0x0C);
+    
+    if(bars_size != size) return 1;
+    
+    //Hash table and offset table
+    uint64_t offsets_start = 0x10 + (uint64_t)track_count * 4;
+    if(offsets_start + (uint64_t)track_count * 8 > size) return 1;
+    
+    if(track_count > 0) {
+        info->tracks = (barspatcher_bars_track_t*)malloc(track_count * sizeof(barspatcher_bars_track_t));
+        if(info->tracks == NULL) return 2;
+    }
+    
+    for(uint32_t t=0; t < track_count; t++) {
+        barspatcher_bars_track_t* track = &info->tracks[t];
+        
+        uint32_t amta_offset = barspatcher_load<uint32_t, E>(data + offsets_start + t*8);
+        uint32_t bwav_offset = barspatcher_load<uint32_t, E>(data + offsets_start + t*8 + 4);
+        
+        //AMTA entry, it has its own byte order mark
+        if((uint64_t)amta_offset + 0x0C > size || !barspatcher_hasMagic(data, amta_offset, "AMTA") || !barspatcher_amtaRead(data, size, amta_offset, &track->name_offset)) {
+            barspatcher_barsFree(info);
+            return 1;
+        }
+        
+        track->amta_offset = amta_offset;
+        track->bwav_offset = BARSPATCHER_BARS_NO_OFFSET;
+        track->crc_key = 0;
+        
+        //Tracks without audio data have no BWAV offset
+        if(bwav_offset == BARSPATCHER_BARS_NO_OFFSET) continue;
+        
+        //Embedded BWAV header
+        if((uint64_t)bwav_offset + 0x10 > size || !barspatcher_hasMagic(data, bwav_offset, "BWAV")) {
+            barspatcher_barsFree(info);
+            return 1;
+        }
+        
+        track->bwav_offset = bwav_offset;
+        track->crc_key = barspatcher_crcKey(data + bwav_offset + 0x08);
+    }
+    
+    info->track_count = track_count;
+    
+    return 0;
+}
+
+/*
+ * Parses the BARS file structure into a track table.
+ * 
+ * Returns:
+ * 0 - Success
+ * 1 - Data is not a BARS file that this reader recognizes
+ * 2 - Memory allocation error
+ * 
+ */
+unsigned char barspatcher_barsParse(barspatcher_bars_info_t* info, const unsigned char* data, uint64_t size) {
+    info->tracks = NULL;
+    info->track_count = 0;
+    
+    //Header
+    if(size < 0x10 || size > 0xFFFFFFFF) return 1;
+    if(!barspatcher_hasMagic(data, 0, "BARS")) return 1;
+    
+    //The byte order is checked once, every field after it is read with it
+    info->bom = barspatcher_readBOM(data, 0x08);
+    if(info->bom) return barspatcher_barsParseTable<BARSPATCHER_BIG_ENDIAN>(info, data, size);
+    return barspatcher_barsParseTable<BARSPATCHER_LITTLE_ENDIAN>(info, data, size);
+}
+
+//Returns the name of a track, or an empty string if the track has no name.
+const char* barspatcher_barsTrackName(const barspatcher_bars_info_t* info, const unsigned char* data, uint32_t track) {
+    if(info->tracks[track].name_offset == BARSPATCHER_BARS_NO_OFFSET) return "";
+    return (const char*)(data + info->tracks[track].name_offset);
+}
+
+//Adds the CRC32 location of every track in the table whose hash is in the index.
+//Locations are reported the same way as barspatcher_crcIndexScan, at the CRC32 bytes in the BWAV header.
+//Returns 0 on success, and 1 on memory error.
+bool barspatcher_barsIndexTracks(const barspatcher_bars_info_t* info, barspatcher_crc_index_t* index) {
+    for(uint32_t t=0; t < info->track_count; t++) {
+        if(info->tracks[t].bwav_offset == BARSPATCHER_BARS_NO_OFFSET) continue;
+        
+        int64_t slot = barspatcher_crcIndexFind(index, info->tracks[t].crc_key);
+        if(slot < 0) continue;
+        
+        if(barspatcher_crcIndexAddHit(index, slot, (uint64_t)info->tracks[t].bwav_offset + 0x08)) return 1;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,90 @@
+//BWAV header view for BARS patcher
+//Copyright (C) 2020 I.C.
+
+/*
+ * BWAV header layout:
+ * 0x00 - "BWAV"
+ * 0x04 - Byte order mark
+ * 0x06 - Version
+ * 0x08 - CRC32 hash of the sample data
+ * 0x0C - Prefetch flag
+ * 0x0E - Channel count
+ * 0x10 - Channel info, BARSPATCHER_BWAV_CHANNEL_INFO_SIZE bytes per channel
+ * 
+ * Channel info fields used by the patcher:
+ * 0x30 - Offset of the sample data of the channel in the file
+ * 
+ */
+
+#pragma once
+#include <stdint.h>
+
+#include "utils.h"
+
+//Size of the fixed part of a BWAV header, followed by the channel info of every channel
+#define BARSPATCHER_BWAV_HEADER_SIZE 0x10
+#define BARSPATCHER_BWAV_CHANNEL_INFO_SIZE 0x4C
+
+//Fields of a BWAV header with the byte order E, read in place from the header data
+template<barspatcher_endian_t E>
+struct barspatcher_bwav_view_t {
+    const unsigned char* data;
+    
+    uint32_t crc32() const {return barspatcher_load<uint32_t, E>(data + 0x08);}
+    uint16_t channelCount() const {return barspatcher_load<uint16_t, E>(data + 0x0E);}
+    //Channel info of a channel, channel must be below channelCount
+    const unsigned char* channelInfo(uint16_t channel) const {return data + BARSPATCHER_BWAV_HEADER_SIZE + BARSPATCHER_BWAV_CHANNEL_INFO_SIZE * channel;}
+    uint32_t sampleOffset(uint16_t channel) const {return barspatcher_load<uint32_t, E>(channelInfo(channel) + 0x30);}
+};
+
+//BWAV header fields that the patcher uses
+struct barspatcher_bwav_fields_t {
+    //0 = little endian, 1 = big endian
+    bool bom;
+    uint32_t crc32;
+    uint16_t channel_count;
+};
+
+//Returns 1 if data starts with a BWAV header, length is the number of bytes available.
+static inline bool barspatcher_isBwav(const unsigned char* data, uint64_t length) {
+    return length >= BARSPATCHER_BWAV_HEADER_SIZE && barspatcher_hasMagic(data, 0, "BWAV");
+}
+
+template<barspatcher_endian_t E>
+static inline void barspatcher_bwavReadFieldsAs(const unsigned char* data, barspatcher_bwav_fields_t* fields) {
+    barspatcher_bwav_view_t<E> view = {data};
+    fields->bom = (E == BARSPATCHER_BIG_ENDIAN);
+    fields->crc32 = view.crc32();
+    fields->channel_count = view.channelCount();
+}
+
+//Reads the fields of a BWAV header, data must have at least BARSPATCHER_BWAV_HEADER_SIZE bytes.
+//The byte order mark is checked once, and every field is read with it.
+void barspatcher_bwavReadFields(const unsigned char* data, barspatcher_bwav_fields_t* fields) {
+    if(barspatcher_readBOM(data, 0x04)) barspatcher_bwavReadFieldsAs<BARSPATCHER_BIG_ENDIAN>(data, fields);
+    else barspatcher_bwavReadFieldsAs<BARSPATCHER_LITTLE_ENDIAN>(data, fields);
+}
+
+template<barspatcher_endian_t E>
+static inline uint32_t barspatcher_bwavDataOffsetAs(const unsigned char* data) {
+    barspatcher_bwav_view_t<E> view = {data};
+    uint16_t channel_count = view.channelCount();
+    uint32_t offset = 0xFFFFFFFF;
+    for(uint16_t channel=0; channel < channel_count; channel++) {
+        if(view.sampleOffset(channel) < offset) offset = view.sampleOffset(channel);
+    }
+    return offset;
+}
+
+//Returns the offset of the first sample data of any channel, data must have the full header with the channel info of every channel.
+//Returns 0xFFFFFFFF if the file has no channels.
+uint32_t barspatcher_bwavDataOffset(const unsigned char* data) {
+    if(barspatcher_readBOM(data, 0x04)) return barspatcher_bwavDataOffsetAs<BARSPATCHER_BIG_ENDIAN>(data);
+    return barspatcher_bwavDataOffsetAs<BARSPATCHER_LITTLE_ENDIAN>(data);
+}
+
+//Replaces the CRC32 hash in a BWAV header, in the byte order of the header.
+void barspatcher_bwavSetCrc32(unsigned char* data, uint32_t crc32) {
+    uint32_t value = (barspatcher_readBOM(data, 0x04) ? barspatcher_fromEndian<uint32_t, BARSPATCHER_BIG_ENDIAN>(crc32) : barspatcher_fromEndian<uint32_t, BARSPATCHER_LITTLE_ENDIAN>(crc32));
+    memcpy(data + 0x08, &value, 4);
+}
@@ -0,0 +1,528 @@
+//Reusable patching context for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//A context opens the input BARS file once and keeps it in memory together with its parsed track table and the headers
+//of the original BWAV files, so the same BARS file can be patched with different sets of modded files and written
+//to different outputs without loading or parsing it again. barspatcher_run is a single apply and write on a context.
+//
+//Every apply starts from the unmodified input data. The input bytes of every range that an apply patches are saved,
+//and they are put back before the next apply. Ranges patched by earlier applies are written with every output,
+//so an output that was written before doesn't keep patches of an older apply.
+//
+//An apply loads the tracks, locates their original hashes and patches them in. The stages are separate functions, so
+//multi-archive mode (see multi-archive.h) can load the tracks in one context and patch them into several.
+
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc-index.h"
+#include "bars-reader.h"
+#include "scanner.h"
+#include "bars-io.h"
+#include "manifest.h"
+#include "tracks.h"
+#include "incremental.h"
+#include "crc-check.h"
+#include "stats.h"
+#include "events.h"
+
+//parse_res value of a context whose BARS structure was not parsed yet
+#define BARSPATCHER_CONTEXT_UNPARSED 255
+
+struct barspatcher_context_t {
+    bool verbose;
+    //Paths given to barspatcher_contextOpen, they have to stay valid until the context is freed
+    const char* og_stream_dirname;
+    const char* bars_input_filename;
+    const char* manifest_filename;
+    unsigned int workers;
+    //1 to keep the headers of the original BWAV files in memory between applies, even without a manifest file
+    bool cache_headers;
+    //How the CRC32 hashes of the modded files are checked, one of BARSPATCHER_CRC_CHECK_*, see crc-check.h
+    unsigned char crc_check;
+    
+    //Input BARS data, and its structure parsed by the first apply that needs it
+    barspatcher_bars_input_t input;
+    unsigned char parse_res;
+    barspatcher_bars_info_t bars_info;
+    
+    //Headers of original BWAV files
+    barspatcher_manifest_t manifest;
+    
+    //Mod stream directory listing and tracks of the last apply
+    const char* mod_stream_dirname;
+    barspatcher_name_list_t mod_dir_list;
+    barspatcher_track_t* tracks;
+    uint64_t track_count;
+    //Locations of the original hash of every track
+    barspatcher_crc_index_t crc_index;
+    
+    //Ranges patched by the last apply, and the input bytes of all of them one after another
+    barspatcher_range_list_t patched_ranges;
+    unsigned char* saved;
+    uint64_t saved_size;
+    uint64_t saved_capacity;
+    //Ranges patched by earlier applies that got their input bytes back, sorted and merged
+    barspatcher_range_list_t restored_ranges;
+    //Restored and patched ranges together, for writing
+    barspatcher_range_list_t write_ranges;
+    
+    //Output the last apply was made for in incremental mode, or NULL, and the incremental state of that apply
+    const char* incremental_output_filename;
+    barspatcher_run_state_t run_state;
+    barspatcher_file_stat_t* mod_stats;
+    uint64_t reused_count;
+    
+    //Counts of the last apply
+    uint64_t patched_files;
+    uint64_t skipped_files;
+    //Statistics of the last apply and write, total_ms is left to the caller
+    barspatcher_stats_t stats;
+    //Destination of track events, printed as text unless a callback is set
+    barspatcher_events_t events;
+};
+
+//Frees the tracks and incremental state of the last apply.
+void barspatcher_contextFreeTracks(barspatcher_context_t* ctx) {
+    if(ctx->tracks != NULL) barspatcher_freeTracks(ctx->tracks, ctx->track_count);
+    free(ctx->mod_stats);
+    barspatcher_stateFree(&ctx->run_state);
+    
+    ctx->tracks = NULL;
+    ctx->track_count = 0;
+    ctx->mod_stats = NULL;
+    ctx->reused_count = 0;
+    ctx->incremental_output_filename = NULL;
+}
+
+//Frees everything in the context.
+void barspatcher_contextFree(barspatcher_context_t* ctx) {
+    barspatcher_contextFreeTracks(ctx);
+    barspatcher_inputClose(&ctx->input);
+    barspatcher_barsFree(&ctx->bars_info);
+    barspatcher_manifestFree(&ctx->manifest);
+    barspatcher_nameListFree(&ctx->mod_dir_list);
+    barspatcher_crcIndexFree(&ctx->crc_index);
+    barspatcher_rangesFree(&ctx->patched_ranges);
+    barspatcher_rangesFree(&ctx->restored_ranges);
+    barspatcher_rangesFree(&ctx->write_ranges);
+    barspatcher_eventsFree(&ctx->events);
+    free(ctx->saved);
+    
+    ctx->saved = NULL;
+    ctx->saved_size = 0;
+    ctx->saved_capacity = 0;
+}
+
+/*
+ * Opens the input BARS file for patching.
+ * 
+ * verbose, og_stream_dirname, bars_input_filename, workers - Same as for barspatcher_run
+ * manifest_filename - Manifest file with the headers of the original BWAV files that is read now and saved after every apply
+ *                     that read new headers, or NULL. Headers are kept in memory between applies either way.
+ * 
+ * Returns 0 on success, and barspatcher_run error codes on errors.
+ * Nothing has to be freed after an error.
+ * 
+ */
+unsigned char barspatcher_contextOpen(barspatcher_context_t* ctx, bool verbose, const char* og_stream_dirname, const char* bars_input_filename, unsigned int workers = 1, const char* manifest_filename = NULL) {
+    memset(ctx, 0, sizeof(barspatcher_context_t));
+    
+    ctx->verbose = verbose;
+    ctx->og_stream_dirname = og_stream_dirname;
+    ctx->bars_input_filename = bars_input_filename;
+    ctx->manifest_filename = manifest_filename;
+    ctx->workers = workers;
+    ctx->cache_headers = 1;
+    ctx->parse_res = BARSPATCHER_CONTEXT_UNPARSED;
+    barspatcher_eventsInit(&ctx->events, NULL, NULL, verbose);
+    
+    unsigned char input_res = barspatcher_inputOpen(&ctx->input, bars_input_filename);
+    if(input_res != 0) return input_res;
+    
+    //A manifest that can't be read is replaced with an empty one
+    if(manifest_filename != NULL) barspatcher_manifestRead(&ctx->manifest, manifest_filename, og_stream_dirname);
+    
+    return 0;
+}
+
+/*
+ * Sends the events of every track to a callback instead of printing them, see events.h.
+ * Every apply reports one BARSPATCHER_EVENT_PATCHED or BARSPATCHER_EVENT_SKIPPED event for each modded file.
+ * 
+ * callback - Function that receives the events, or NULL to print them again
+ * user_data - Passed to the callback
+ * 
+ */
+void barspatcher_contextSetEventCallback(barspatcher_context_t* ctx, barspatcher_event_callback_t callback, void* user_data) {
+    barspatcher_eventsFlush(&ctx->events);
+    ctx->events.callback = callback;
+    ctx->events.user_data = user_data;
+}
+
+//Puts the input bytes back into every range patched by the last apply.
+//Returns 0 on success, and 1 on memory error.
+bool barspatcher_contextRestore(barspatcher_context_t* ctx) {
+    //Ranges can overlap, put them back in reverse order
+    uint64_t saved_position = ctx->saved_size;
+    bool memory_error = 0;
+    
+    for(uint32_t i = ctx->patched_ranges.count; i > 0; i--) {
+        const barspatcher_range_t* range = &ctx->patched_ranges.ranges[i-1];
+        saved_position -= range->length;
+        memcpy(ctx->input.data + range->offset, ctx->saved + saved_position, range->length);
+        
+        if(!memory_error) memory_error = barspatcher_rangesAdd(&ctx->restored_ranges, range->offset, range->length);
+    }
+    
+    barspatcher_rangesMerge(&ctx->restored_ranges);
+    barspatcher_rangesClear(&ctx->patched_ranges);
+    ctx->saved_size = 0;
+    
+    return memory_error;
+}
+
+//Saves the input bytes of a range and adds it to the patched ranges.
+//Returns 0 on success, and 1 on memory error.
+bool barspatcher_contextSave(barspatcher_context_t* ctx, uint64_t offset, uint64_t length) {
+    if(ctx->saved_size + length > ctx->saved_capacity) {
+        uint64_t capacity = (ctx->saved_capacity == 0 ? 65536 : ctx->saved_capacity);
+        while(ctx->saved_size + length > capacity) capacity *= 2;
+        
+        unsigned char* saved = (unsigned char*)realloc(ctx->saved, capacity);
+        if(saved == NULL) return 1;
+        ctx->saved = saved;
+        ctx->saved_capacity = capacity;
+    }
+    
+    if(barspatcher_rangesAdd(&ctx->patched_ranges, offset, length)) return 1;
+    
+    memcpy(ctx->saved + ctx->saved_size, ctx->input.data + offset, length);
+    ctx->saved_size += length;
+    
+    return 0;
+}
+
+/*
+ * Loads the tracks of every modded BWAV file in a directory, the first part of barspatcher_contextApply.
+ * Patches of the previous apply are removed first.
+ * 
+ * mod_stream_dirname, incremental_output_filename - Same as for barspatcher_contextApply
+ * 
+ * Returns 0 on success, and barspatcher_run error codes on errors.
+ * 
+ */
+unsigned char barspatcher_contextLoad(barspatcher_context_t* ctx, const char* mod_stream_dirname, const char* incremental_output_filename = NULL) {
+    bool verbose = ctx->verbose;
+    const char* og_stream_dirname = ctx->og_stream_dirname;
+    
+    //Start from the input data
+    barspatcher_contextFreeTracks(ctx);
+    if(barspatcher_contextRestore(ctx)) {
+        printf("Could not allocate memory for the list of patched ranges.\n");
+        return 100;
+    }
+    
+    ctx->mod_stream_dirname = mod_stream_dirname;
+    ctx->patched_files = 0;
+    ctx->skipped_files = 0;
+    
+    barspatcher_stats_t* stats = &ctx->stats;
+    barspatcher_statsInit(stats);
+    double phase_start = barspatcher_timeMs();
+    
+    bool incremental = (incremental_output_filename != NULL);
+    ctx->incremental_output_filename = incremental_output_filename;
+    
+    //Read mod stream directory listing
+    barspatcher_nameListClear(&ctx->mod_dir_list);
+    {
+        unsigned char list_res = barspatcher_listModDir(mod_stream_dirname, &ctx->mod_dir_list);
+        if(list_res != 0) return list_res;
+    }
+    
+    stats->list_ms = barspatcher_timeMs() - phase_start;
+    phase_start = barspatcher_timeMs();
+    
+    //State of the previous incremental run
+    if(incremental && barspatcher_stateRead(&ctx->run_state, og_stream_dirname, mod_stream_dirname, ctx->bars_input_filename, incremental_output_filename, ctx->crc_check)) {
+        printf("Could not allocate memory for the run state.\n");
+        return 100;
+    }
+    
+    //Read information from every original and modded BWAV file in the modded BWAV list
+    barspatcher_manifest_t* manifest = (ctx->cache_headers || ctx->manifest_filename != NULL ? &ctx->manifest : NULL);
+    barspatcher_track_t* tracks;
+    uint64_t track_count;
+    unsigned char tracks_res;
+    
+    if(incremental) tracks_res = barspatcher_stateLoadTracks(&ctx->run_state, og_stream_dirname, mod_stream_dirname, &ctx->mod_dir_list, &tracks, &ctx->mod_stats, &track_count, &ctx->reused_count, &ctx->skipped_files, ctx->workers, manifest, stats, &ctx->events);
+    else tracks_res = barspatcher_loadTracksCached(og_stream_dirname, mod_stream_dirname, &ctx->mod_dir_list, &tracks, &track_count, &ctx->skipped_files, ctx->workers, manifest, stats, &ctx->events);
+    
+    //Skip messages are printed before anything that follows them
+    barspatcher_eventsFlush(&ctx->events);
+    
+    if(ctx->manifest_filename != NULL) barspatcher_manifestSave(&ctx->manifest, ctx->manifest_filename, og_stream_dirname);
+    
+    if(tracks_res != 0) return tracks_res;
+    
+    ctx->tracks = tracks;
+    ctx->track_count = track_count;
+    
+    //Check the sample data hashes before the headers are patched in
+    unsigned char check_res = barspatcher_checkTracks(mod_stream_dirname, tracks, track_count, ctx->crc_check, ctx->workers, (incremental ? &ctx->run_state : NULL), ctx->mod_stats, stats, &ctx->events);
+    if(check_res != 0) return check_res;
+    
+    stats->load_ms = barspatcher_timeMs() - phase_start;
+    
+    if(verbose && ctx->run_state.valid) printf("Incremental run: %llu of %llu tracks are unchanged.\n", (unsigned long long)ctx->reused_count, (unsigned long long)track_count);
+    
+    return 0;
+}
+
+/*
+ * Finds the locations of the original hashes of some tracks in the input data, the second part of barspatcher_contextApply.
+ * The tracks can also be the tracks of another context that uses the same BWAV files.
+ * 
+ * Returns 0 on success, and 1 on memory error.
+ * 
+ */
+bool barspatcher_contextLocate(barspatcher_context_t* ctx, const barspatcher_track_t* tracks, uint64_t track_count) {
+    bool verbose = ctx->verbose;
+    unsigned char* bars_data = ctx->input.data;
+    uint64_t bars_size = ctx->input.size;
+    double phase_start = barspatcher_timeMs();
+    
+    //Collect all wanted CRC32 hashes and find their locations in the BARS file
+    barspatcher_crc_index_t* crc_index = &ctx->crc_index;
+    bool index_error = barspatcher_crcIndexReset(crc_index, track_count);
+    
+    if(!index_error) {
+        for(uint64_t t=0; t < track_count; t++) barspatcher_crcIndexInsert(crc_index, tracks[t].crc_key);
+        
+        //Incremental runs take the locations from the previous run if all hashes were in it
+        unsigned char state_index_res = (ctx->incremental_output_filename != NULL ? barspatcher_stateIndexTracks(&ctx->run_state, crc_index) : 1);
+        
+        //Look up the BWAV headers in the BARS track table, the table is only parsed once for each context.
+        //Fall back to searching the whole file in a single pass if the BARS structure is not recognized.
+        if(state_index_res == 1 && (ctx->parse_res == BARSPATCHER_CONTEXT_UNPARSED || ctx->parse_res == 2)) {
+            ctx->parse_res = barspatcher_barsParse(&ctx->bars_info, bars_data, bars_size);
+        }
+        
+        if(state_index_res != 1) index_error = (state_index_res == 2);
+        else if(ctx->parse_res == 0) {
+            if(verbose) printf("BARS file has %d tracks.\n", ctx->bars_info.track_count);
+            index_error = barspatcher_barsIndexTracks(&ctx->bars_info, crc_index);
+        }
+        else if(ctx->parse_res == 1) {
+            unsigned char scan_kernel = barspatcher_scanSelectKernel(crc_index->count);
+            unsigned int scan_threads = barspatcher_scanThreadCount(bars_size, barspatcher_workerCount(ctx->workers));
+            if(verbose) printf("BARS file structure was not recognized, searching the whole file. (%s, %u thread%s)\n", barspatcher_scanKernelName(scan_kernel), scan_threads, (scan_threads == 1 ? "" : "s"));
+            index_error = barspatcher_scanParallel(crc_index, bars_data, bars_size, scan_kernel, scan_threads);
+            ctx->stats.scan_bytes = bars_size;
+        }
+        else index_error = 1;
+    }
+    
+    if(index_error) {
+        printf("Could not allocate memory for the BARS search index.\n");
+        return 1;
+    }
+    
+    ctx->stats.matches_found = crc_index->hits_count;
+    ctx->stats.locate_ms = barspatcher_timeMs() - phase_start;
+    
+    return 0;
+}
+
+/*
+ * Patches the tracks of the first context into the input data of every context, the last part of barspatcher_contextApply.
+ * Every context is patched at the locations that barspatcher_contextLocate found in it.
+ * 
+ * ctxs - Contexts that use the same BWAV files, the first one has the tracks of the last barspatcher_contextLoad
+ * ctx_count - Number of contexts
+ * 
+ * Track events are reported by the first context, BARSPATCHER_EVENT_PATCHED events count the locations in all contexts.
+ * The counts of the first context are updated, a track is only skipped if none of the contexts has its original hash.
+ * 
+ * Returns 0 on success, and 1 on memory error.
+ * 
+ */
+bool barspatcher_contextPatch(barspatcher_context_t* ctxs, uint32_t ctx_count) {
+    barspatcher_context_t* ctx = &ctxs[0];
+    bool verbose = ctx->verbose;
+    double phase_start = barspatcher_timeMs();
+    
+    //Patch the BARS files at every location found for each track
+    barspatcher_events_t* events = &ctx->events;
+    barspatcher_event_t event;
+    memset(&event, 0, sizeof(event));
+    
+    for(uint64_t t=0; t < ctx->track_count; t++) {
+        barspatcher_track_t* track = &ctx->tracks[t];
+        event.name = track->name;
+        event.og_crc32 = track->og_crc32;
+        
+        //Verbose lines go through the event text, so they stay in order with the events
+        if(verbose) barspatcher_eventsPrintf(events, "%s: Original file hash: 0x%08X\n", track->name, track->og_crc32);
+        
+        uint32_t patches_written = 0;
+        
+        for(uint32_t c=0; c < ctx_count; c++) {
+            barspatcher_context_t* target = &ctxs[c];
+            unsigned char* bars_data = target->input.data;
+            uint64_t bars_size = target->input.size;
+            barspatcher_crc_index_t* crc_index = &target->crc_index;
+            
+            int64_t slot = barspatcher_crcIndexFind(crc_index, track->crc_key);
+            uint32_t hit = (slot < 0 ? BARSPATCHER_CRC_INDEX_NONE : crc_index->first_hit[slot]);
+            
+            for(; hit != BARSPATCHER_CRC_INDEX_NONE; hit = crc_index->hits[hit].next) {
+                //The CRC32 hash is at 0x08 in the BWAV header
+                uint64_t bars_pos = crc_index->hits[hit].offset;
+                if(bars_pos < 0x08) continue;
+                
+                //Skip locations that were already overwritten by a previous patch
+                if(barspatcher_crcKey(bars_data + bars_pos) != track->crc_key) continue;
+                
+                //Found, BARS files are named when there are several
+                uint64_t bars_bwav_offset = bars_pos - 0x08;
+                if(verbose) barspatcher_eventsPrintf(events, "Found at 0x%08llX in %s, ", (unsigned long long)bars_bwav_offset, (ctx_count > 1 ? target->bars_input_filename : "BARS"));
+                
+                if(bars_size - bars_bwav_offset < track->patch_length) {
+                    //The text of the event ends the verbose line, events sent to a callback don't
+                    if(verbose && events->callback != NULL) barspatcher_eventsPrintf(events, "not enough space for header.\n");
+                    event.type = BARSPATCHER_EVENT_NO_SPACE;
+                    event.reason = 0;
+                    event.locations = 0;
+                    event.offset = bars_bwav_offset;
+                    barspatcher_eventEmit(events, &event);
+                    continue;
+                }
+                
+                //Keep the input bytes for the next apply
+                if(barspatcher_contextSave(target, bars_bwav_offset, track->patch_length)) {
+                    barspatcher_eventsFlush(events);
+                    printf("Could not allocate memory for the list of patched ranges.\n");
+                    return 1;
+                }
+                
+                memcpy(bars_data + bars_bwav_offset, track->patch_data, track->patch_length);
+                
+                if(verbose) barspatcher_eventsPrintf(events, "wrote patch.\n");
+                patches_written++;
+            }
+        }
+        
+        event.type = (patches_written > 0 ? BARSPATCHER_EVENT_PATCHED : BARSPATCHER_EVENT_SKIPPED);
+        event.reason = (patches_written > 0 ? 0 : BARSPATCHER_SKIP_NOT_FOUND);
+        event.locations = patches_written;
+        event.offset = 0;
+        barspatcher_eventEmit(events, &event);
+        
+        if(patches_written > 0) ctx->patched_files++;
+        else ctx->skipped_files++;
+    }
+    
+    barspatcher_eventsFlush(events);
+    
+    ctx->stats.patch_ms = barspatcher_timeMs() - phase_start;
+    ctx->stats.tracks_patched = ctx->patched_files;
+    ctx->stats.tracks_skipped = ctx->skipped_files;
+    
+    return 0;
+}
+
+/*
+ * Patches the input data with every modded BWAV file in a directory.
+ * Patches of the previous apply are removed first.
+ * 
+ * mod_stream_dirname - Path to directory with modded BWAV files, it has to stay valid until the next apply
+ * incremental_output_filename - Output file for incremental mode, see incremental.h, or NULL.
+ *                               The run state is only used and updated when the output is written to this file.
+ * 
+ * Returns the same codes as barspatcher_run. After errors, the context can still be used for another apply.
+ * 
+ */
+unsigned char barspatcher_contextApply(barspatcher_context_t* ctx, const char* mod_stream_dirname, const char* incremental_output_filename = NULL) {
+    unsigned char load_res = barspatcher_contextLoad(ctx, mod_stream_dirname, incremental_output_filename);
+    if(load_res != 0) return load_res;
+    
+    if(barspatcher_contextLocate(ctx, ctx->tracks, ctx->track_count)) return 100;
+    if(barspatcher_contextPatch(ctx, 1)) return 100;
+    
+    if(ctx->patched_files == 0) {
+        printf("Error: All tracks were skipped, BARS file was not patched.\n");
+        return 200;
+    }
+    
+    return (ctx->skipped_files > 99 ? 99 : ctx->skipped_files);
+}
+
+/*
+ * Writes the patched data of the last apply to an output file.
+ * Only the changed ranges are written when the platform supports it.
+ * 
+ * Returns 0 on success, and barspatcher_run error codes on errors.
+ * 
+ */
+unsigned char barspatcher_contextWrite(barspatcher_context_t* ctx, const char* bars_output_filename) {
+    const unsigned char* bars_data = ctx->input.data;
+    uint64_t bars_size = ctx->input.size;
+    unsigned char output_res;
+    
+    double write_start = barspatcher_timeMs();
+    uint64_t bytes_written = 0;
+    
+    bool incremental = (ctx->incremental_output_filename != NULL && strcmp(ctx->incremental_output_filename, bars_output_filename) == 0);
+    
+    if(incremental) {
+        //The run state knows which ranges the output file has from earlier runs
+        bool output_written = 1;
+        output_res = barspatcher_stateOutputWrite(&ctx->run_state, bars_data, bars_size, ctx->bars_input_filename, bars_output_filename, &ctx->patched_ranges, &output_written, &bytes_written);
+        
+        if(output_res == 0) {
+            if(!output_written) printf("The output BARS file is already up to date.\n");
+            
+            //The state only has to be written again if something changed
+            if(output_written || ctx->reused_count < ctx->track_count) {
+                if(barspatcher_stateWrite(ctx->og_stream_dirname, ctx->mod_stream_dirname, ctx->bars_input_filename, bars_output_filename, ctx->tracks, ctx->mod_stats, ctx->track_count, &ctx->crc_index, bars_data, &ctx->patched_ranges, ctx->crc_check)) {
+                    printf("Warning: Could not save the run state, the next incremental run will patch everything again.\n");
+                }
+            }
+        }
+    }
+    else {
+        //Write the ranges of earlier applies too, in case one of them was written to this output
+        const barspatcher_range_list_t* ranges = &ctx->patched_ranges;
+        
+        if(ctx->restored_ranges.count > 0) {
+            bool memory_error = 0;
+            barspatcher_rangesClear(&ctx->write_ranges);
+            
+            for(uint32_t i=0; i < ctx->restored_ranges.count && !memory_error; i++) {
+                memory_error = barspatcher_rangesAdd(&ctx->write_ranges, ctx->restored_ranges.ranges[i].offset, ctx->restored_ranges.ranges[i].length);
+            }
+            for(uint32_t i=0; i < ctx->patched_ranges.count && !memory_error; i++) {
+                memory_error = barspatcher_rangesAdd(&ctx->write_ranges, ctx->patched_ranges.ranges[i].offset, ctx->patched_ranges.ranges[i].length);
+            }
+            
+            if(memory_error) {
+                printf("Could not allocate memory for the list of patched ranges.\n");
+                return 100;
+            }
+            
+            ranges = &ctx->write_ranges;
+        }
+        
+        output_res = barspatcher_outputWrite(bars_data, bars_size, ctx->bars_input_filename, bars_output_filename, ranges, &bytes_written);
+    }
+    
+    ctx->stats.write_ms += barspatcher_timeMs() - write_start;
+    ctx->stats.bytes_written += bytes_written;
+    
+    return output_res;
+}
@@ -0,0 +1,269 @@
+//CRC32 checking of modded BWAV files for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//The header of a modded BWAV file is patched into the BARS file as it is, including the CRC32 hash of its sample data.
+//Converters sometimes leave a stale hash in the header. When checking is enabled, the sample data of every modded file
+//is read and hashed after loading, on the same number of threads as the headers are loaded with, and a hash that
+//doesn't match is reported or replaced in the header that is patched into the BARS file. The modded files are not changed.
+//
+//The sample data is taken to be everything from the lowest sample data offset of any channel to the end of the file.
+//Files whose sample data offset is inside the header or past the end of the file are not checked.
+
+#pragma once
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "bwav-header.h"
+#include "tracks.h"
+#include "incremental.h"
+#include "stats.h"
+#include "events.h"
+
+//Checking modes
+//The hashes are not checked
+#define BARSPATCHER_CRC_CHECK_OFF 0
+//Hashes that don't match the sample data are reported with BARSPATCHER_EVENT_CRC_MISMATCH
+#define BARSPATCHER_CRC_CHECK_WARN 1
+//Hashes that don't match the sample data are replaced in the patched header and reported with BARSPATCHER_EVENT_CRC_FIXED
+#define BARSPATCHER_CRC_CHECK_FIX 2
+
+//Size of the buffer that every thread reads sample data with
+#ifndef BARSPATCHER_CRC_CHECK_BUFFER_SIZE
+#define BARSPATCHER_CRC_CHECK_BUFFER_SIZE (1024 * 1024)
+#endif
+
+//Results of checking a single track, values from 100 are barspatcher_run error codes
+#define BARSPATCHER_CRC_UNCHECKED 0
+#define BARSPATCHER_CRC_MATCH 1
+#define BARSPATCHER_CRC_MISMATCH 2
+//The track has to be checked and no thread has taken it yet
+#define BARSPATCHER_CRC_PENDING 3
+
+struct barspatcher_crc_result_t {
+    //One of BARSPATCHER_CRC_* or an error code
+    unsigned char status;
+    //errno value for errors
+    int error_number;
+    //CRC32 hash of the sample data
+    uint32_t data_crc32;
+    //Files opened and bytes read while checking, for run statistics
+    uint8_t files_opened;
+    uint64_t bytes_read;
+};
+
+/*
+ * Hashes the sample data of a single modded file and compares it with the hash in its header.
+ * Doesn't print anything, so it can be called from multiple threads at once.
+ * 
+ * buffer - BARSPATCHER_CRC_CHECK_BUFFER_SIZE bytes for reading the file
+ * kernel - One of BARSPATCHER_CRC32_KERNEL_*
+ * 
+ */
+void barspatcher_checkTrackCrc(const barspatcher_dir_t* mod_dir, const barspatcher_track_t* track, unsigned char* buffer, unsigned char kernel, barspatcher_crc_result_t* result) {
+    uint32_t data_offset = barspatcher_bwavDataOffset(track->patch_data);
+    if(data_offset < track->patch_length || data_offset == 0xFFFFFFFF) {
+        result->status = BARSPATCHER_CRC_UNCHECKED;
+        return;
+    }
+    
+    barspatcher_bwav_file_t mod_bwav;
+    if(barspatcher_bwavOpen(&mod_bwav, mod_dir, track->name)) {
+        result->status = 238;
+        result->error_number = errno;
+        return;
+    }
+    result->files_opened++;
+    
+    //Read the sample data up to the end of the file
+    uint32_t crc = 0;
+    uint64_t offset = data_offset;
+    
+    while(1) {
+        int64_t length = barspatcher_bwavRead(mod_bwav, buffer, BARSPATCHER_CRC_CHECK_BUFFER_SIZE, offset);
+        if(length < 0) {
+            result->status = 236;
+            result->error_number = errno;
+            barspatcher_bwavClose(mod_bwav);
+            return;
+        }
+        
+        crc = barspatcher_crc32Update(kernel, crc, buffer, length);
+        offset += length;
+        result->bytes_read += length;
+        
+        if(length < BARSPATCHER_CRC_CHECK_BUFFER_SIZE) break;
+    }
+    
+    barspatcher_bwavClose(mod_bwav);
+    
+    //Nothing after the sample data offset
+    if(offset == data_offset) {
+        result->status = BARSPATCHER_CRC_UNCHECKED;
+        return;
+    }
+    
+    barspatcher_bwav_fields_t fields;
+    barspatcher_bwavReadFields(track->patch_data, &fields);
+    result->data_crc32 = crc;
+    result->status = (crc == fields.crc32 ? BARSPATCHER_CRC_MATCH : BARSPATCHER_CRC_MISMATCH);
+}
+
+//Shared state of the checking workers
+struct barspatcher_crc_job_t {
+    const barspatcher_dir_t* mod_dir;
+    const barspatcher_track_t* tracks;
+    uint64_t track_count;
+    barspatcher_crc_result_t* results;
+    unsigned char kernel;
+    //Next track to be checked, taken atomically by the workers
+    uint64_t next_track;
+};
+
+//Checking worker, checks tracks from the job until all tracks are taken.
+//Workers that can't allocate their buffer don't take any tracks.
+void* barspatcher_crcCheckWorker(void* arg) {
+    barspatcher_crc_job_t* job = (barspatcher_crc_job_t*)arg;
+    unsigned char* buffer = (unsigned char*)malloc(BARSPATCHER_CRC_CHECK_BUFFER_SIZE);
+    if(buffer == NULL) return NULL;
+    
+    while(1) {
+        uint64_t t = __atomic_fetch_add(&job->next_track, 1, __ATOMIC_RELAXED);
+        if(t >= job->track_count) break;
+        
+        if(job->results[t].status == BARSPATCHER_CRC_PENDING) barspatcher_checkTrackCrc(job->mod_dir, &job->tracks[t], buffer, job->kernel, &job->results[t]);
+    }
+    
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Checks the CRC32 hash in the header of every track's modded file against its sample data.
+ * 
+ * mode - One of BARSPATCHER_CRC_CHECK_*, with BARSPATCHER_CRC_CHECK_FIX the hash in the patch data of the tracks is replaced
+ * workers - Number of threads that read files at once, 0 for one per CPU core
+ * state, mod_stats - Run state and stat data of the modded files of an incremental run, or NULL.
+ *                    Tracks that were taken from the state unchanged are not checked again, the state was written with the same mode.
+ * stats - Receives the files opened and bytes read, or NULL
+ * events - Receives a BARSPATCHER_EVENT_CRC_MISMATCH or BARSPATCHER_EVENT_CRC_FIXED event for every hash that doesn't match
+ * 
+ * Returns 0 on success, and barspatcher_run error codes on errors.
+ * 
+ */
+unsigned char barspatcher_checkTracks(const char* mod_stream_dirname, barspatcher_track_t* tracks, uint64_t track_count, unsigned char mode, unsigned int workers, const barspatcher_run_state_t* state, const barspatcher_file_stat_t* mod_stats, barspatcher_stats_t* stats, barspatcher_events_t* events) {
+    if(mode == BARSPATCHER_CRC_CHECK_OFF || track_count == 0) return 0;
+    
+    barspatcher_crc_result_t* results = (barspatcher_crc_result_t*)calloc(track_count, sizeof(barspatcher_crc_result_t));
+    if(results == NULL) {
+        printf("Could not allocate memory for the CRC32 check.\n");
+        return 100;
+    }
+    
+    for(uint64_t t=0; t < track_count; t++) {
+        const barspatcher_state_track_t* state_track = (state != NULL && state->reuse_tracks && mod_stats != NULL ? barspatcher_stateFind(state, tracks[t].name) : NULL);
+        bool unchanged = (state_track != NULL && barspatcher_sameFileStat(&state_track->mod_stat, &mod_stats[t]));
+        results[t].status = (unchanged ? BARSPATCHER_CRC_UNCHECKED : BARSPATCHER_CRC_PENDING);
+    }
+    
+    barspatcher_dir_t mod_dir;
+    if(barspatcher_dirOpen(&mod_dir, mod_stream_dirname)) {
+        perror(mod_stream_dirname);
+        free(results);
+        return 229;
+    }
+    
+    barspatcher_crc32InitTables();
+    
+    barspatcher_crc_job_t job;
+    job.mod_dir = &mod_dir;
+    job.tracks = tracks;
+    job.track_count = track_count;
+    job.results = results;
+    job.kernel = barspatcher_crc32SelectKernel();
+    job.next_track = 0;
+    
+    workers = barspatcher_workerCount(workers);
+    if(workers > track_count) workers = track_count;
+    
+    #if defined BARSPATCHER_HAVE_THREADS
+    if(workers > 1) {
+        //The calling thread is one of the workers
+        pthread_t* threads = (pthread_t*)malloc((workers - 1) * sizeof(pthread_t));
+        unsigned int started = 0;
+        
+        if(threads != NULL) {
+            for(; started < workers - 1; started++) {
+                if(pthread_create(&threads[started], NULL, barspatcher_crcCheckWorker, &job) != 0) break;
+            }
+        }
+        
+        barspatcher_crcCheckWorker(&job);
+        
+        for(unsigned int i=0; i < started; i++) pthread_join(threads[i], NULL);
+        free(threads);
+    }
+    else barspatcher_crcCheckWorker(&job);
+    #else
+    barspatcher_crcCheckWorker(&job);
+    #endif
+    
+    barspatcher_dirClose(&mod_dir);
+    
+    //Report the results in track order
+    unsigned char res = 0;
+    barspatcher_event_t event;
+    memset(&event, 0, sizeof(event));
+    
+    for(uint64_t t=0; t < track_count && res == 0; t++) {
+        barspatcher_track_t* track = &tracks[t];
+        barspatcher_crc_result_t* result = &results[t];
+        
+        switch(result->status) {
+            case BARSPATCHER_CRC_UNCHECKED:
+            case BARSPATCHER_CRC_MATCH:
+                break;
+            case BARSPATCHER_CRC_MISMATCH: {
+                barspatcher_bwav_fields_t fields;
+                barspatcher_bwavReadFields(track->patch_data, &fields);
+                if(mode == BARSPATCHER_CRC_CHECK_FIX) barspatcher_bwavSetCrc32(track->patch_data, result->data_crc32);
+                
+                event.type = (mode == BARSPATCHER_CRC_CHECK_FIX ? BARSPATCHER_EVENT_CRC_FIXED : BARSPATCHER_EVENT_CRC_MISMATCH);
+                event.name = track->name;
+                event.og_crc32 = track->og_crc32;
+                event.mod_crc32 = fields.crc32;
+                event.data_crc32 = result->data_crc32;
+                barspatcher_eventEmit(events, &event);
+                break;
+            }
+            case BARSPATCHER_CRC_PENDING:
+                //No worker could allocate its buffer
+                barspatcher_eventsFlush(events);
+                printf("Could not allocate memory for the CRC32 check.\n");
+                res = 100;
+                break;
+            default:
+                barspatcher_eventsFlush(events);
+                fflush(stdout);
+                fprintf(stderr, "%s/%s: %s\n", mod_stream_dirname, track->name, strerror(result->error_number));
+                res = result->status;
+                break;
+        }
+    }
+    
+    barspatcher_eventsFlush(events);
+    
+    if(stats != NULL) {
+        for(uint64_t t=0; t < track_count; t++) {
+            stats->files_opened += results[t].files_opened;
+            stats->bytes_read += results[t].bytes_read;
+        }
+    }
+    
+    free(results);
+    
+    return res;
+}
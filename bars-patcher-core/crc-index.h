@@ -0,0 +1,231 @@
+//CRC32 lookup index for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//The index holds every wanted CRC32 value and collects the BARS offsets where each one was found,
+//so the BARS data only has to be walked once no matter how many tracks are being patched.
+//Keys are the 4 raw CRC32 bytes exactly as they are stored in the BWAV header, loaded with memcpy.
+
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Stop scanning as soon as every wanted CRC32 has been found once.
+//Disabled by default because the same BWAV header can be stored in a BARS file more than once.
+#ifndef BARSPATCHER_SCAN_STOP_WHEN_FOUND
+#define BARSPATCHER_SCAN_STOP_WHEN_FOUND 0
+#endif
+
+//Value for empty hit list links
+#define BARSPATCHER_CRC_INDEX_NONE 0xFFFFFFFF
+
+struct barspatcher_crc_hit_t {
+    //Offset of the CRC32 bytes in the scanned data
+    uint64_t offset;
+    //Index of the next hit with the same key, or BARSPATCHER_CRC_INDEX_NONE
+    uint32_t next;
+};
+
+struct barspatcher_crc_index_t {
+    //Open addressing hash table, capacity is always a power of 2
+    uint32_t* keys;
+    uint32_t* first_hit;
+    uint32_t* last_hit;
+    unsigned char* used;
+    uint32_t capacity;
+    //Number of unique keys in the table
+    uint32_t count;
+    //Number of keys that have at least one hit
+    uint32_t found;
+    
+    //Bitmap of the lower 16 bits of every key, checked before probing the table
+    unsigned char filter[65536 / 8];
+    
+    //Hit storage
+    barspatcher_crc_hit_t* hits;
+    uint32_t hits_count;
+    uint32_t hits_capacity;
+};
+
+//Loads 4 bytes from data as an index key.
+static inline uint32_t barspatcher_crcKey(const unsigned char* data) {
+    uint32_t key;
+    memcpy(&key, data, 4);
+    return key;
+}
+
+static inline uint32_t barspatcher_crcIndexHash(uint32_t key) {
+    key ^= key >> 16;
+    key *= 0x7FEB352D;
+    key ^= key >> 15;
+    return key;
+}
+
+//Frees all memory used by the index.
+void barspatcher_crcIndexFree(barspatcher_crc_index_t* index) {
+    free(index->keys);
+    free(index->first_hit);
+    free(index->last_hit);
+    free(index->used);
+    free(index->hits);
+    
+    index->keys = NULL;
+    index->first_hit = NULL;
+    index->last_hit = NULL;
+    index->used = NULL;
+    index->hits = NULL;
+    index->capacity = 0;
+    index->count = 0;
+    index->found = 0;
+    index->hits_count = 0;
+    index->hits_capacity = 0;
+}
+
+//Allocates an empty index for up to key_count unique keys.
+//Returns 0 on success, and 1 on memory error.
+bool barspatcher_crcIndexInit(barspatcher_crc_index_t* index, uint32_t key_count) {
+    //Keep the table at most half full
+    uint32_t capacity = 16;
+    while(capacity < key_count * 2) capacity *= 2;
+    
+    index->capacity = capacity;
+    index->count = 0;
+    index->found = 0;
+    index->hits_count = 0;
+    index->hits_capacity = 0;
+    index->hits = NULL;
+    memset(index->filter, 0, sizeof(index->filter));
+    
+    index->keys = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    index->first_hit = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    index->last_hit = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    index->used = (unsigned char*)calloc(capacity, 1);
+    
+    if(index->keys == NULL || index->first_hit == NULL || index->last_hit == NULL || index->used == NULL) {
+        barspatcher_crcIndexFree(index);
+        return 1;
+    }
+    
+    return 0;
+}
+
+//Removes all keys and hits from the index and makes room for up to key_count unique keys.
+//Memory of the index is reused when it is big enough.
+//Returns 0 on success, and 1 on memory error.
+bool barspatcher_crcIndexReset(barspatcher_crc_index_t* index, uint32_t key_count) {
+    if(index->keys == NULL || index->capacity < key_count * 2) {
+        barspatcher_crcIndexFree(index);
+        return barspatcher_crcIndexInit(index, key_count);
+    }
+    
+    memset(index->used, 0, index->capacity);
+    memset(index->filter, 0, sizeof(index->filter));
+    index->count = 0;
+    index->found = 0;
+    index->hits_count = 0;
+    
+    return 0;
+}
+
+//Removes all hits from the index while keeping all keys.
+void barspatcher_crcIndexClearHits(barspatcher_crc_index_t* index) {
+    for(uint32_t slot=0; slot < index->capacity; slot++) {
+        index->first_hit[slot] = BARSPATCHER_CRC_INDEX_NONE;
+        index->last_hit[slot] = BARSPATCHER_CRC_INDEX_NONE;
+    }
+    
+    index->hits_count = 0;
+    index->found = 0;
+}
+
+//Returns the slot of key in the index, or -1 if the key is not in the index.
+int64_t barspatcher_crcIndexFind(const barspatcher_crc_index_t* index, uint32_t key) {
+    if(!(index->filter[(key & 0xFFFF) >> 3] & (1 << (key & 7)))) return -1;
+    
+    uint32_t mask = index->capacity - 1;
+    uint32_t slot = barspatcher_crcIndexHash(key) & mask;
+    
+    while(index->used[slot]) {
+        if(index->keys[slot] == key) return slot;
+        slot = (slot + 1) & mask;
+    }
+    
+    return -1;
+}
+
+//Adds key to the index if it isn't already there and returns its slot.
+//The index must have been initialized with enough space for all inserted keys.
+uint32_t barspatcher_crcIndexInsert(barspatcher_crc_index_t* index, uint32_t key) {
+    uint32_t mask = index->capacity - 1;
+    uint32_t slot = barspatcher_crcIndexHash(key) & mask;
+    
+    while(index->used[slot]) {
+        if(index->keys[slot] == key) return slot;
+        slot = (slot + 1) & mask;
+    }
+    
+    index->used[slot] = 1;
+    index->keys[slot] = key;
+    index->first_hit[slot] = BARSPATCHER_CRC_INDEX_NONE;
+    index->last_hit[slot] = BARSPATCHER_CRC_INDEX_NONE;
+    index->filter[(key & 0xFFFF) >> 3] |= (1 << (key & 7));
+    index->count++;
+    
+    return slot;
+}
+
+//Appends a hit at offset to the hit list of slot.
+//Returns 0 on success, and 1 on memory error.
+bool barspatcher_crcIndexAddHit(barspatcher_crc_index_t* index, uint32_t slot, uint64_t offset) {
+    if(index->hits_count >= index->hits_capacity) {
+        uint32_t new_capacity = (index->hits_capacity == 0 ? 256 : index->hits_capacity * 2);
+        barspatcher_crc_hit_t* new_hits = (barspatcher_crc_hit_t*)realloc(index->hits, new_capacity * sizeof(barspatcher_crc_hit_t));
+        if(new_hits == NULL) return 1;
+        
+        index->hits = new_hits;
+        index->hits_capacity = new_capacity;
+    }
+    
+    uint32_t hit = index->hits_count++;
+    index->hits[hit].offset = offset;
+    index->hits[hit].next = BARSPATCHER_CRC_INDEX_NONE;
+    
+    //Keep hits of each key in scan order
+    if(index->first_hit[slot] == BARSPATCHER_CRC_INDEX_NONE) {
+        index->first_hit[slot] = hit;
+        index->found++;
+    } else {
+        index->hits[index->last_hit[slot]].next = hit;
+    }
+    index->last_hit[slot] = hit;
+    
+    return 0;
+}
+
+//Walks data once starting at start and records the offset of every occurrence of every key in the index.
+//Returns 0 on success, and 1 on memory error.
+bool barspatcher_crcIndexScanFrom(barspatcher_crc_index_t* index, const unsigned char* data, uint64_t size, uint64_t start) {
+    if(size < 4 || index->count == 0) return 0;
+    
+    for(uint64_t pos = start; pos <= size - 4; pos++) {
+        uint32_t key = barspatcher_crcKey(data + pos);
+        
+        //Cheap filter check before probing the table
+        if(!(index->filter[(key & 0xFFFF) >> 3] & (1 << (key & 7)))) continue;
+        
+        int64_t slot = barspatcher_crcIndexFind(index, key);
+        if(slot < 0) continue;
+        
+        if(barspatcher_crcIndexAddHit(index, slot, pos)) return 1;
+        
+        if(BARSPATCHER_SCAN_STOP_WHEN_FOUND && index->found == index->count) break;
+    }
+    
+    return 0;
+}
+
+//Walks data once and records the offset of every occurrence of every key in the index.
+//Returns 0 on success, and 1 on memory error.
+bool barspatcher_crcIndexScan(barspatcher_crc_index_t* index, const unsigned char* data, uint64_t size) {
+    return barspatcher_crcIndexScanFrom(index, data, size, 0);
+}
@@ -0,0 +1,220 @@
+//CRC32 kernels for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Computes the standard CRC32 (the same as zlib) of BWAV sample data, see crc-check.h.
+//Slicing-by-8 tables work everywhere and process 8 bytes per step. Where the CPU supports it, carry-less multiplication
+//(PCLMULQDQ on x86) folds 64 bytes per step, and ARMv8 CRC32 instructions process 8 bytes per instruction.
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+#include "utils.h"
+
+#if defined BARSPATCHER_VERSION_PC
+#include <pthread.h>
+#ifndef BARSPATCHER_HAVE_THREADS
+#define BARSPATCHER_HAVE_THREADS
+#endif
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define BARSPATCHER_CRC32_X86
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define BARSPATCHER_CRC32_ARMV8
+#endif
+
+//CRC32 kernels
+#define BARSPATCHER_CRC32_KERNEL_SLICING8 0
+#define BARSPATCHER_CRC32_KERNEL_PCLMUL 1
+#define BARSPATCHER_CRC32_KERNEL_ARMV8 2
+
+//Slicing-by-8 tables, filled in by barspatcher_crc32InitTables
+static uint32_t barspatcher_crc32_tables[8][256];
+#if defined BARSPATCHER_HAVE_THREADS
+static pthread_once_t barspatcher_crc32_tables_once = PTHREAD_ONCE_INIT;
+#else
+static bool barspatcher_crc32_tables_ready = 0;
+#endif
+
+//Computes the slicing-by-8 tables, only called once by barspatcher_crc32InitTables.
+void barspatcher_crc32BuildTables() {
+    for(uint32_t i=0; i < 256; i++) {
+        uint32_t crc = i;
+        for(unsigned int bit=0; bit < 8; bit++) crc = (crc & 1 ? 0xEDB88320 ^ (crc >> 1) : crc >> 1);
+        barspatcher_crc32_tables[0][i] = crc;
+    }
+    for(uint32_t i=0; i < 256; i++) {
+        for(unsigned int slice=1; slice < 8; slice++) {
+            uint32_t previous = barspatcher_crc32_tables[slice-1][i];
+            barspatcher_crc32_tables[slice][i] = (previous >> 8) ^ barspatcher_crc32_tables[0][previous & 0xFF];
+        }
+    }
+}
+
+//Fills in the slicing-by-8 tables the first time it is called. Can be called from several threads at once,
+//the kernels can be used on any thread after it returns.
+void barspatcher_crc32InitTables() {
+    #if defined BARSPATCHER_HAVE_THREADS
+    pthread_once(&barspatcher_crc32_tables_once, barspatcher_crc32BuildTables);
+    #else
+    if(barspatcher_crc32_tables_ready) return;
+    barspatcher_crc32BuildTables();
+    barspatcher_crc32_tables_ready = 1;
+    #endif
+}
+
+//Returns the name of a CRC32 kernel.
+const char* barspatcher_crc32KernelName(unsigned char kernel) {
+    switch(kernel) {
+        case BARSPATCHER_CRC32_KERNEL_PCLMUL: return "PCLMUL";
+        case BARSPATCHER_CRC32_KERNEL_ARMV8: return "ARMv8";
+    }
+    return "slicing-by-8";
+}
+
+//Chooses the fastest kernel supported by this CPU.
+unsigned char barspatcher_crc32SelectKernel() {
+    #if defined(BARSPATCHER_CRC32_X86)
+    if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) return BARSPATCHER_CRC32_KERNEL_PCLMUL;
+    #elif defined(BARSPATCHER_CRC32_ARMV8)
+    return BARSPATCHER_CRC32_KERNEL_ARMV8;
+    #endif
+    
+    return BARSPATCHER_CRC32_KERNEL_SLICING8;
+}
+
+//Slicing-by-8 kernel, works on the inverted CRC32 value.
+uint32_t barspatcher_crc32Slicing8(uint32_t crc, const unsigned char* data, uint64_t length) {
+    const uint32_t (*tables)[256] = barspatcher_crc32_tables;
+    
+    for(; length >= 8; data += 8, length -= 8) {
+        uint32_t low = barspatcher_load<uint32_t, BARSPATCHER_LITTLE_ENDIAN>(data) ^ crc;
+        uint32_t high = barspatcher_load<uint32_t, BARSPATCHER_LITTLE_ENDIAN>(data + 4);
+        crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24] ^
+              tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF] ^ tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+    }
+    
+    for(; length > 0; data++, length--) crc = tables[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    
+    return crc;
+}
+
+#if defined(BARSPATCHER_CRC32_X86)
+
+/*
+ * Carry-less multiplication kernel, works on the inverted CRC32 value.
+ * length must be at least 64 and a multiple of 16.
+ * 
+ * Folds 4 blocks of 16 bytes at once, then folds them into a single block and reduces it to 32 bits with a Barrett reduction.
+ * The constants are the bit-reflected folding constants and polynomials for the CRC32 polynomial from
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" by Intel.
+ * 
+ */
+__attribute__((target("pclmul,sse4.1")))
+uint32_t barspatcher_crc32PCLMUL(uint32_t crc, const unsigned char* data, uint64_t length) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163CD6124);
+    const __m128i poly = _mm_set_epi64x(0x01F7011641, 0x01DB710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data + 0x00)), _mm_cvtsi32_si128(crc));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    data += 64;
+    length -= 64;
+    
+    //Fold 4 blocks at once
+    for(; length >= 64; data += 64, length -= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+    }
+    
+    //Fold the 4 blocks into one, then fold the remaining blocks into it
+    __m128i blocks[3] = {x2, x3, x4};
+    for(unsigned int b=0; b < 3; b++) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, blocks[b]), x5);
+    }
+    for(; length >= 16; data += 16, length -= 16) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+    }
+    
+    //Fold 128 bits to 64 bits
+    __m128i x2_64 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2_64);
+    __m128i high = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00), high);
+    
+    //Barrett reduction to 32 bits
+    __m128i reduced = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    reduced = _mm_clmulepi64_si128(_mm_and_si128(reduced, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, reduced);
+    
+    return _mm_extract_epi32(x1, 1);
+}
+
+#endif
+
+#if defined(BARSPATCHER_CRC32_ARMV8)
+
+//ARMv8 CRC32 instruction kernel, works on the inverted CRC32 value.
+uint32_t barspatcher_crc32ARMv8(uint32_t crc, const unsigned char* data, uint64_t length) {
+    for(; length >= 8; data += 8, length -= 8) crc = __crc32d(crc, barspatcher_load<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(data));
+    for(; length > 0; data++, length--) crc = __crc32b(crc, *data);
+    return crc;
+}
+
+#endif
+
+/*
+ * Continues a CRC32 value with more data.
+ * 
+ * kernel - One of BARSPATCHER_CRC32_KERNEL_*, should be chosen with barspatcher_crc32SelectKernel.
+ *          barspatcher_crc32InitTables must have been called before.
+ * crc - CRC32 of the data before, 0 for the start of the data
+ * 
+ * Returns the CRC32 of all data so far.
+ * 
+ */
+uint32_t barspatcher_crc32Update(unsigned char kernel, uint32_t crc, const unsigned char* data, uint64_t length) {
+    crc = ~crc;
+    
+    switch(kernel) {
+        #if defined(BARSPATCHER_CRC32_X86)
+        case BARSPATCHER_CRC32_KERNEL_PCLMUL:
+            if(length >= 64) {
+                uint64_t folded = length & ~(uint64_t)15;
+                crc = barspatcher_crc32PCLMUL(crc, data, folded);
+                data += folded;
+                length -= folded;
+            }
+            break;
+        #endif
+        #if defined(BARSPATCHER_CRC32_ARMV8)
+        case BARSPATCHER_CRC32_KERNEL_ARMV8: return ~barspatcher_crc32ARMv8(crc, data, length);
+        #endif
+        default: break;
+    }
+    
+    return ~barspatcher_crc32Slicing8(crc, data, length);
+}
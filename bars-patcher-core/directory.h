@@ -0,0 +1,371 @@
+//Stream directory access for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Files in the stream directories are always opened relative to an open directory, so full paths don't have to be built.
+//On PC the directory is kept open as a file descriptor and files are opened with openat. On Linux, directories are
+//listed with getdents64, which returns many entries for each system call.
+
+#pragma once
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#if defined BARSPATCHER_VERSION_PC
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined BARSPATCHER_VERSION_PC && defined __linux__
+#include <sys/syscall.h>
+#define BARSPATCHER_HAVE_GETDENTS
+#endif
+
+//Bytes read at once when listing a directory with getdents64
+#define BARSPATCHER_DIRENT_BUFFER_SIZE 32768
+
+//Marks empty slots in file name hash tables
+#define BARSPATCHER_NAME_SET_EMPTY 0xFFFFFFFFFFFFFFFFull
+
+//Open stream directory
+struct barspatcher_dir_t {
+    //Path the directory was opened with
+    const char* path;
+    size_t path_length;
+    #if defined BARSPATCHER_VERSION_PC
+    int fd;
+    #endif
+};
+
+//Opens a directory. Returns 0 on success, and 1 on error with errno set.
+bool barspatcher_dirOpen(barspatcher_dir_t* dir, const char* path) {
+    dir->path = path;
+    dir->path_length = strlen(path);
+    
+    #if defined BARSPATCHER_VERSION_PC
+    dir->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return dir->fd < 0;
+    #else
+    //Make sure the directory exists, files are opened with full paths
+    struct stat st;
+    if(stat(path, &st) != 0) return 1;
+    if(!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return 1;
+    }
+    return 0;
+    #endif
+}
+
+void barspatcher_dirClose(barspatcher_dir_t* dir) {
+    #if defined BARSPATCHER_VERSION_PC
+    if(dir->fd >= 0) close(dir->fd);
+    dir->fd = -1;
+    #else
+    (void)dir;
+    #endif
+}
+
+//Returns an allocated full path for a file in the directory, or NULL on memory error with errno set.
+char* barspatcher_dirPath(const barspatcher_dir_t* dir, const char* name) {
+    size_t name_length = strlen(name);
+    char* path = (char*)malloc(dir->path_length + name_length + 2);
+    if(path == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    memcpy(path, dir->path, dir->path_length);
+    path[dir->path_length] = '/';
+    memcpy(path + dir->path_length + 1, name, name_length + 1);
+    
+    return path;
+}
+
+//Reads the stat data of a file in the directory. Returns 0 on success, and 1 on error with errno set.
+bool barspatcher_dirStat(const barspatcher_dir_t* dir, const char* name, struct stat* st) {
+    #if defined BARSPATCHER_VERSION_PC
+    return fstatat(dir->fd, name, st, 0) != 0;
+    #else
+    char* path = barspatcher_dirPath(dir, name);
+    if(path == NULL) return 1;
+    bool res = (stat(path, st) != 0);
+    int stat_errno = errno;
+    free(path);
+    errno = stat_errno;
+    return res;
+    #endif
+}
+
+//Directory listing in progress
+struct barspatcher_dir_reader_t {
+    #if defined BARSPATCHER_HAVE_GETDENTS
+    int fd;
+    unsigned char* buffer;
+    //Read position and number of bytes in the buffer
+    uint32_t position;
+    uint32_t size;
+    #else
+    DIR* dir;
+    #endif
+    //1 if the listing stopped because of an error, with error_number set
+    bool error;
+    int error_number;
+};
+
+#if defined BARSPATCHER_HAVE_GETDENTS
+//Directory entry returned by getdents64
+struct barspatcher_dirent64_t {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+#endif
+
+//Starts listing a directory. Only one listing of a directory can be in progress at once.
+//Returns 0 on success, and 1 on error with errno set.
+bool barspatcher_dirReaderOpen(barspatcher_dir_reader_t* reader, const barspatcher_dir_t* dir) {
+    reader->error = 0;
+    reader->error_number = 0;
+    
+    #if defined BARSPATCHER_HAVE_GETDENTS
+    //The listing uses the file position of the directory, start from the first entry
+    if(lseek(dir->fd, 0, SEEK_SET) != 0) return 1;
+    
+    reader->buffer = (unsigned char*)malloc(BARSPATCHER_DIRENT_BUFFER_SIZE);
+    if(reader->buffer == NULL) {
+        errno = ENOMEM;
+        return 1;
+    }
+    
+    reader->fd = dir->fd;
+    reader->position = 0;
+    reader->size = 0;
+    return 0;
+    #else
+    reader->dir = opendir(dir->path);
+    return reader->dir == NULL;
+    #endif
+}
+
+void barspatcher_dirReaderClose(barspatcher_dir_reader_t* reader) {
+    #if defined BARSPATCHER_HAVE_GETDENTS
+    free(reader->buffer);
+    reader->buffer = NULL;
+    #else
+    if(reader->dir != NULL) closedir(reader->dir);
+    reader->dir = NULL;
+    #endif
+}
+
+/*
+ * Returns the name of the next directory entry, or NULL after the last entry or on error.
+ * The name is valid until the next call. The "." and ".." entries are never returned.
+ * 
+ * type_out - Receives the dirent d_type of the entry, DT_UNKNOWN if the file system doesn't report types
+ * 
+ */
+const char* barspatcher_dirNext(barspatcher_dir_reader_t* reader, unsigned char* type_out) {
+    while(1) {
+        #if defined BARSPATCHER_HAVE_GETDENTS
+        if(reader->position >= reader->size) {
+            long got = syscall(SYS_getdents64, reader->fd, reader->buffer, BARSPATCHER_DIRENT_BUFFER_SIZE);
+            if(got < 0) {
+                if(errno == EINTR) continue;
+                reader->error = 1;
+                reader->error_number = errno;
+                return NULL;
+            }
+            if(got == 0) return NULL;
+            
+            reader->position = 0;
+            reader->size = got;
+        }
+        
+        barspatcher_dirent64_t* entry = (barspatcher_dirent64_t*)(reader->buffer + reader->position);
+        reader->position += entry->d_reclen;
+        const char* name = entry->d_name;
+        unsigned char type = entry->d_type;
+        #else
+        errno = 0;
+        dirent* entry = readdir(reader->dir);
+        if(entry == NULL) {
+            if(errno != 0) {
+                reader->error = 1;
+                reader->error_number = errno;
+            }
+            return NULL;
+        }
+        const char* name = entry->d_name;
+        unsigned char type = entry->d_type;
+        #endif
+        
+        if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        
+        *type_out = type;
+        return name;
+    }
+}
+
+//FNV-1a hash of a file name
+static inline uint32_t barspatcher_nameHash(const char* name, uint32_t length) {
+    uint32_t hash = 2166136261u;
+    for(uint32_t i=0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//List of file names, packed one after another into a single block
+struct barspatcher_name_list_t {
+    //Null terminated names
+    char* names;
+    uint64_t names_size;
+    uint64_t names_capacity;
+    //Offset of every name in the name block
+    uint64_t* offsets;
+    uint64_t count;
+    uint64_t capacity;
+};
+
+void barspatcher_nameListInit(barspatcher_name_list_t* list) {
+    memset(list, 0, sizeof(barspatcher_name_list_t));
+}
+
+void barspatcher_nameListFree(barspatcher_name_list_t* list) {
+    free(list->names);
+    free(list->offsets);
+    barspatcher_nameListInit(list);
+}
+
+//Removes all names from the list, keeping its memory for the next names.
+void barspatcher_nameListClear(barspatcher_name_list_t* list) {
+    list->names_size = 0;
+    list->count = 0;
+}
+
+//Returns a name from the list. Names can move while names are added, don't keep the pointer until the list is complete.
+static inline const char* barspatcher_nameListGet(const barspatcher_name_list_t* list, uint64_t index) {
+    return list->names + list->offsets[index];
+}
+
+//Adds a name to the end of the list. Returns 0 on success, and 1 on memory error.
+bool barspatcher_nameListAdd(barspatcher_name_list_t* list, const char* name) {
+    size_t name_length = strlen(name);
+    
+    if(list->count >= list->capacity) {
+        uint64_t capacity = (list->capacity == 0 ? 1024 : list->capacity * 2);
+        uint64_t* offsets = (uint64_t*)realloc(list->offsets, capacity * sizeof(uint64_t));
+        if(offsets == NULL) return 1;
+        list->offsets = offsets;
+        list->capacity = capacity;
+    }
+    
+    if(list->names_size + name_length + 1 > list->names_capacity) {
+        uint64_t capacity = (list->names_capacity == 0 ? 65536 : list->names_capacity);
+        while(list->names_size + name_length + 1 > capacity) capacity *= 2;
+        char* names = (char*)realloc(list->names, capacity);
+        if(names == NULL) return 1;
+        list->names = names;
+        list->names_capacity = capacity;
+    }
+    
+    memcpy(list->names + list->names_size, name, name_length + 1);
+    list->offsets[list->count++] = list->names_size;
+    list->names_size += name_length + 1;
+    
+    return 0;
+}
+
+//Set of file names, used to check which files exist in a directory without opening them
+struct barspatcher_name_set_t {
+    barspatcher_name_list_t list;
+    //Open addressing hash table of list indexes, built by barspatcher_nameSetBuild
+    uint64_t* table;
+    uint64_t table_capacity;
+};
+
+void barspatcher_nameSetInit(barspatcher_name_set_t* set) {
+    barspatcher_nameListInit(&set->list);
+    set->table = NULL;
+    set->table_capacity = 0;
+}
+
+void barspatcher_nameSetFree(barspatcher_name_set_t* set) {
+    barspatcher_nameListFree(&set->list);
+    free(set->table);
+    barspatcher_nameSetInit(set);
+}
+
+//Builds the hash table for the names in set->list. Returns 0 on success, and 1 on memory error.
+bool barspatcher_nameSetBuild(barspatcher_name_set_t* set) {
+    uint64_t capacity = 64;
+    while(capacity < set->list.count * 2) capacity *= 2;
+    
+    uint64_t* table = (uint64_t*)malloc(capacity * sizeof(uint64_t));
+    if(table == NULL) return 1;
+    memset(table, 0xFF, capacity * sizeof(uint64_t));
+    
+    for(uint64_t i=0; i < set->list.count; i++) {
+        const char* name = barspatcher_nameListGet(&set->list, i);
+        uint64_t slot = barspatcher_nameHash(name, strlen(name)) & (capacity - 1);
+        while(table[slot] != BARSPATCHER_NAME_SET_EMPTY) slot = (slot + 1) & (capacity - 1);
+        table[slot] = i;
+    }
+    
+    free(set->table);
+    set->table = table;
+    set->table_capacity = capacity;
+    
+    return 0;
+}
+
+//Checks if a name is in the set.
+bool barspatcher_nameSetHas(const barspatcher_name_set_t* set, const char* name) {
+    if(set->table_capacity == 0) return 0;
+    
+    uint64_t mask = set->table_capacity - 1;
+    
+    for(uint64_t slot = barspatcher_nameHash(name, strlen(name)) & mask; set->table[slot] != BARSPATCHER_NAME_SET_EMPTY; slot = (slot + 1) & mask) {
+        if(strcmp(barspatcher_nameListGet(&set->list, set->table[slot]), name) == 0) return 1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Lists every entry of a directory into a name set.
+ * 
+ * set - Initialized with barspatcher_nameSetInit, receives the names and its hash table
+ * 
+ * Returns 0 on success, 1 on error with errno set, and 2 on memory error.
+ * The set has to be freed after errors.
+ * 
+ */
+unsigned char barspatcher_dirListNames(const barspatcher_dir_t* dir, barspatcher_name_set_t* set) {
+    barspatcher_dir_reader_t reader;
+    if(barspatcher_dirReaderOpen(&reader, dir)) return (errno == ENOMEM ? 2 : 1);
+    
+    const char* name;
+    unsigned char type;
+    unsigned char res = 0;
+    
+    while(res == 0 && (name = barspatcher_dirNext(&reader, &type)) != NULL) {
+        if(barspatcher_nameListAdd(&set->list, name)) res = 2;
+    }
+    
+    if(res == 0 && reader.error) res = 1;
+    
+    barspatcher_dirReaderClose(&reader);
+    
+    if(res == 1) errno = reader.error_number;
+    if(res == 0 && barspatcher_nameSetBuild(set)) res = 2;
+    
+    return res;
+}
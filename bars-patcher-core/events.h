@@ -0,0 +1,212 @@
+//Track event reporting for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//The outcome of every track is reported as an event instead of being printed where it happens.
+//Events go to a callback if one is set, so the caller can collect them or stay silent.
+//Without a callback, events are rendered as text into a buffer that is written to stdout in large blocks.
+
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+//Results of loading a single track.
+//Values below 100 are reasons for skipping the track, values from 100 are barspatcher_run error codes.
+#define BARSPATCHER_LOAD_OK 0
+#define BARSPATCHER_LOAD_NO_ORIGINAL 1
+#define BARSPATCHER_LOAD_MOD_NOT_BWAV 2
+#define BARSPATCHER_LOAD_OG_NOT_BWAV 3
+#define BARSPATCHER_LOAD_CHANNEL_MISMATCH 4
+#define BARSPATCHER_LOAD_PATCH_TOO_BIG 5
+#define BARSPATCHER_LOAD_MOD_TRUNCATED 6
+//Skip reason for tracks that loaded but whose original hash was not found in the BARS file
+#define BARSPATCHER_SKIP_NOT_FOUND 7
+
+//Event types
+//The track was patched at one or more locations
+#define BARSPATCHER_EVENT_PATCHED 0
+//The track was skipped, see reason
+#define BARSPATCHER_EVENT_SKIPPED 1
+//A location of the original hash has no space for the header, the track can still be patched at other locations
+#define BARSPATCHER_EVENT_NO_SPACE 2
+//The CRC32 hash in the modded file's header doesn't match its sample data, see crc-check.h
+#define BARSPATCHER_EVENT_CRC_MISMATCH 3
+//Same as BARSPATCHER_EVENT_CRC_MISMATCH, but the hash in the patched header was replaced with the hash of the sample data
+#define BARSPATCHER_EVENT_CRC_FIXED 4
+
+struct barspatcher_event_t {
+    //One of BARSPATCHER_EVENT_*
+    unsigned char type;
+    //One of BARSPATCHER_LOAD_* skip reasons or BARSPATCHER_SKIP_NOT_FOUND for skipped tracks, 0 otherwise
+    unsigned char reason;
+    //File name of the track
+    const char* name;
+    //CRC32 hash of the original file, 0 if the track was skipped while loading
+    uint32_t og_crc32;
+    //Number of locations that were patched
+    uint32_t locations;
+    //Offset of the BWAV header in the BARS file for BARSPATCHER_EVENT_NO_SPACE
+    uint64_t offset;
+    //CRC32 hash in the modded file's header and of its sample data for BARSPATCHER_EVENT_CRC_MISMATCH and BARSPATCHER_EVENT_CRC_FIXED
+    uint32_t mod_crc32;
+    uint32_t data_crc32;
+};
+
+//Event callback, the event is only valid during the call
+typedef void (*barspatcher_event_callback_t)(const barspatcher_event_t* event, void* user_data);
+
+//Flush buffered text when it gets this big
+#define BARSPATCHER_EVENT_TEXT_FLUSH 65536
+
+//Destination of events
+struct barspatcher_events_t {
+    barspatcher_event_callback_t callback;
+    void* user_data;
+    //Verbose text output is flushed after every event, so it stays in order with the other verbose messages
+    bool verbose;
+    //Buffered text output
+    char* text;
+    uint32_t text_length;
+    uint32_t text_capacity;
+};
+
+//Initializes an event destination. Events are rendered as text if callback is NULL.
+void barspatcher_eventsInit(barspatcher_events_t* events, barspatcher_event_callback_t callback, void* user_data, bool verbose) {
+    events->callback = callback;
+    events->user_data = user_data;
+    events->verbose = verbose;
+    events->text = NULL;
+    events->text_length = 0;
+    events->text_capacity = 0;
+}
+
+//Writes all buffered text to stdout.
+void barspatcher_eventsFlush(barspatcher_events_t* events) {
+    if(events->text_length == 0) return;
+    fwrite(events->text, 1, events->text_length, stdout);
+    events->text_length = 0;
+}
+
+//Writes buffered text and frees the buffer.
+void barspatcher_eventsFree(barspatcher_events_t* events) {
+    barspatcher_eventsFlush(events);
+    free(events->text);
+    events->text = NULL;
+    events->text_capacity = 0;
+}
+
+//Adds formatted text to the buffer, or prints it directly if the buffer can't grow.
+void barspatcher_eventsPrintf(barspatcher_events_t* events, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if(length < 0) return;
+    
+    if(events->text_length + length + 1 > events->text_capacity) {
+        uint32_t capacity = (events->text_capacity == 0 ? BARSPATCHER_EVENT_TEXT_FLUSH + 4096 : events->text_capacity);
+        while(events->text_length + length + 1 > capacity) capacity *= 2;
+        
+        char* text = (char*)realloc(events->text, capacity);
+        if(text == NULL) {
+            barspatcher_eventsFlush(events);
+            va_start(args, format);
+            vprintf(format, args);
+            va_end(args);
+            return;
+        }
+        
+        events->text = text;
+        events->text_capacity = capacity;
+    }
+    
+    va_start(args, format);
+    vsnprintf(events->text + events->text_length, length + 1, format, args);
+    va_end(args);
+    events->text_length += length;
+}
+
+//Renders an event as the text that is printed without a callback.
+void barspatcher_eventRender(barspatcher_events_t* events, const barspatcher_event_t* event) {
+    const char* name = event->name;
+    
+    if(event->type == BARSPATCHER_EVENT_NO_SPACE) {
+        //Verbose output already printed the location
+        if(!events->verbose) barspatcher_eventsPrintf(events, "Error in %s: ", name);
+        barspatcher_eventsPrintf(events, "not enough space for header in BARS file, is the BARS file valid?\n");
+        return;
+    }
+    if(event->type == BARSPATCHER_EVENT_CRC_MISMATCH) {
+        barspatcher_eventsPrintf(events, "Warning: The CRC32 hash of %s (0x%08X) doesn't match its sample data (0x%08X).\n", name, event->mod_crc32, event->data_crc32);
+        return;
+    }
+    if(event->type == BARSPATCHER_EVENT_CRC_FIXED) {
+        barspatcher_eventsPrintf(events, "%s: Replaced the CRC32 hash 0x%08X with the hash of the sample data, 0x%08X.\n", name, event->mod_crc32, event->data_crc32);
+        return;
+    }
+    if(event->type != BARSPATCHER_EVENT_SKIPPED) return;
+    
+    switch(event->reason) {
+        case BARSPATCHER_LOAD_NO_ORIGINAL:
+            barspatcher_eventsPrintf(events, "Warning: %s doesn't have a matching original file, skipping.\n", name);
+            break;
+        case BARSPATCHER_LOAD_MOD_NOT_BWAV:
+            barspatcher_eventsPrintf(events, "Error in %s: Modded file is not a BWAV file. Skipping.\n", name);
+            break;
+        case BARSPATCHER_LOAD_OG_NOT_BWAV:
+            barspatcher_eventsPrintf(events, "Error in %s: Original file is not a BWAV file. Skipping.\n", name);
+            break;
+        case BARSPATCHER_LOAD_CHANNEL_MISMATCH:
+            barspatcher_eventsPrintf(events, "Error in %s: The modded BWAV file must have the same amount of channels as the original BWAV file. Skipping.\n", name);
+            break;
+        case BARSPATCHER_LOAD_PATCH_TOO_BIG:
+            barspatcher_eventsPrintf(events, "Error in %s: The patch is too big. Skipping.\nThis should never happen if you are correctly modding a game's audio tracks. Please make sure that all your files and paths are correct, and if the error repeats, please open a new issue in the repository of this program.\n", name);
+            break;
+        case BARSPATCHER_LOAD_MOD_TRUNCATED:
+            barspatcher_eventsPrintf(events, "Error in %s: The modded BWAV file ends before the end of its header. Skipping.\n", name);
+            break;
+        case BARSPATCHER_SKIP_NOT_FOUND:
+            barspatcher_eventsPrintf(events, "%s: Not found in BARS file, skipped.\n", name);
+            break;
+    }
+}
+
+//Reports an event to the callback, or renders it as text.
+void barspatcher_eventEmit(barspatcher_events_t* events, const barspatcher_event_t* event) {
+    if(events->callback != NULL) {
+        //Text added before the event is printed before anything the callback prints
+        barspatcher_eventsFlush(events);
+        events->callback(event, events->user_data);
+        return;
+    }
+    
+    barspatcher_eventRender(events, event);
+    if(events->verbose || events->text_length >= BARSPATCHER_EVENT_TEXT_FLUSH) barspatcher_eventsFlush(events);
+}
+
+//Reports a skipped track.
+void barspatcher_eventSkipped(barspatcher_events_t* events, const char* name, uint32_t og_crc32, unsigned char reason) {
+    barspatcher_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.type = BARSPATCHER_EVENT_SKIPPED;
+    event.reason = reason;
+    event.name = name;
+    event.og_crc32 = og_crc32;
+    barspatcher_eventEmit(events, &event);
+}
+
+//Returns a short name for a skip reason.
+const char* barspatcher_getSkipReasonString(unsigned char reason) {
+    switch(reason) {
+        case BARSPATCHER_LOAD_NO_ORIGINAL: return "no_original";
+        case BARSPATCHER_LOAD_MOD_NOT_BWAV: return "mod_not_bwav";
+        case BARSPATCHER_LOAD_OG_NOT_BWAV: return "original_not_bwav";
+        case BARSPATCHER_LOAD_CHANNEL_MISMATCH: return "channel_mismatch";
+        case BARSPATCHER_LOAD_PATCH_TOO_BIG: return "patch_too_big";
+        case BARSPATCHER_LOAD_MOD_TRUNCATED: return "mod_truncated";
+        case BARSPATCHER_SKIP_NOT_FOUND: return "not_found";
+    }
+    return "unknown";
+}
@@ -0,0 +1,622 @@
+//Incremental patching for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//In incremental mode, barspatcher_run keeps a run state file next to the output BARS file. The state records every
+//modded file that was applied (name, size, modification time and the header that was patched in), where the hash of
+//its original file was found in the input BARS file, and which byte ranges of the output file were written.
+//
+//On the next run, only modded files that were added or changed since then are read again. The state also keeps the
+//bytes of every range that was written, so only ranges that are new or have different bytes now are written into the
+//existing output file, and ranges of removed tracks get the bytes of the input file back. If every patched range is
+//the same as last time, the output is not written at all.
+//
+//The state is only used if the input BARS file, both directory names and the output file are the same as when it was
+//written. Otherwise a normal full run is done and a new state is written.
+
+/*
+ * Run state file layout, in native byte order:
+ * barspatcher_state_header_t
+ * Tracks, written ranges and hit offsets
+ * Name block with null terminated file names, then the patch data block
+ * Bytes of every written range in the output file, one after another
+ * Original and modded stream directory names
+ * 
+ */
+
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc-index.h"
+#include "bars-io.h"
+#include "manifest.h"
+#include "tracks.h"
+
+#define BARSPATCHER_STATE_VERSION 3
+
+//Appended to the output file name for the run state file
+#define BARSPATCHER_STATE_SUFFIX ".state"
+
+struct barspatcher_state_header_t {
+    char magic[4];
+    uint32_t version;
+    barspatcher_file_stat_t input_stat;
+    barspatcher_file_stat_t output_stat;
+    //Size of the bytes of the written ranges
+    uint64_t output_size;
+    uint32_t track_count;
+    uint32_t range_count;
+    uint32_t hit_count;
+    uint32_t names_size;
+    uint32_t patch_size;
+    uint32_t og_dirname_length;
+    uint32_t mod_dirname_length;
+    //CRC32 check mode of the run that wrote the state, one of BARSPATCHER_CRC_CHECK_*, see crc-check.h
+    uint32_t crc_check;
+};
+
+//Track that was applied in the previous run
+struct barspatcher_state_track_t {
+    //File name in the name block
+    uint32_t name_offset;
+    uint32_t name_length;
+    barspatcher_file_stat_t mod_stat;
+    uint32_t og_crc32;
+    uint32_t crc_key;
+    //Patch data in the patch data block
+    uint32_t patch_offset;
+    uint32_t patch_length;
+    //Every location of the original hash in the input BARS file, in the hit offsets
+    uint32_t hits_first;
+    uint32_t hit_count;
+};
+
+struct barspatcher_run_state_t {
+    //1 if the state was read and matches the current run
+    bool valid;
+    //1 if the patch data of the state tracks can be reused, it was made with the CRC32 check mode of the current run
+    bool reuse_tracks;
+    barspatcher_state_header_t header;
+    //Whole state file, the pointers below point into it
+    unsigned char* file_data;
+    barspatcher_state_track_t* tracks;
+    barspatcher_range_t* ranges;
+    uint64_t* hits;
+    const char* names;
+    const unsigned char* patch;
+    const unsigned char* output_bytes;
+    //Open addressing hash table of track indexes by name
+    uint32_t* table;
+    uint32_t table_capacity;
+};
+
+//Frees the state.
+void barspatcher_stateFree(barspatcher_run_state_t* state) {
+    free(state->file_data);
+    free(state->table);
+    memset(state, 0, sizeof(barspatcher_run_state_t));
+}
+
+//Returns the allocated name of the run state file for an output file, or NULL on memory error.
+char* barspatcher_stateFilename(const char* bars_output_filename) {
+    size_t length = strlen(bars_output_filename);
+    char* state_filename = (char*)malloc(length + sizeof(BARSPATCHER_STATE_SUFFIX));
+    if(state_filename == NULL) return NULL;
+    
+    memcpy(state_filename, bars_output_filename, length);
+    memcpy(state_filename + length, BARSPATCHER_STATE_SUFFIX, sizeof(BARSPATCHER_STATE_SUFFIX));
+    
+    return state_filename;
+}
+
+//Returns the previous run's track for a file name, or NULL if the file was not applied in the previous run.
+const barspatcher_state_track_t* barspatcher_stateFind(const barspatcher_run_state_t* state, const char* name) {
+    if(!state->valid || state->table_capacity == 0) return NULL;
+    
+    uint32_t length = strlen(name);
+    uint32_t mask = state->table_capacity - 1;
+    
+    for(uint32_t slot = barspatcher_nameHash(name, length) & mask; state->table[slot] != BARSPATCHER_MANIFEST_EMPTY; slot = (slot + 1) & mask) {
+        const barspatcher_state_track_t* track = &state->tracks[state->table[slot]];
+        if(track->name_length == length && memcmp(state->names + track->name_offset, name, length) == 0) return track;
+    }
+    
+    return NULL;
+}
+
+//Checks the sizes and offsets of a state file that was read into state->file_data and sets up the pointers into it.
+//Returns 0 if the state file is valid.
+bool barspatcher_stateParse(barspatcher_run_state_t* state, uint64_t file_size, const char* og_stream_dirname, const char* mod_stream_dirname) {
+    const barspatcher_state_header_t* header = &state->header;
+    
+    uint64_t expected_size = sizeof(barspatcher_state_header_t);
+    expected_size += (uint64_t)header->track_count * sizeof(barspatcher_state_track_t);
+    expected_size += (uint64_t)header->range_count * sizeof(barspatcher_range_t);
+    expected_size += (uint64_t)header->hit_count * sizeof(uint64_t);
+    expected_size += (uint64_t)header->names_size + header->patch_size + header->og_dirname_length + header->mod_dirname_length;
+    expected_size += header->output_size;
+    if(expected_size != file_size) return 1;
+    
+    unsigned char* position = state->file_data + sizeof(barspatcher_state_header_t);
+    state->tracks = (barspatcher_state_track_t*)position;
+    position += header->track_count * sizeof(barspatcher_state_track_t);
+    state->ranges = (barspatcher_range_t*)position;
+    position += header->range_count * sizeof(barspatcher_range_t);
+    state->hits = (uint64_t*)position;
+    position += header->hit_count * sizeof(uint64_t);
+    state->names = (const char*)position;
+    position += header->names_size;
+    state->patch = position;
+    position += header->patch_size;
+    state->output_bytes = position;
+    position += header->output_size;
+    
+    //The state belongs to these directories
+    if(header->og_dirname_length != strlen(og_stream_dirname) || memcmp(position, og_stream_dirname, header->og_dirname_length) != 0) return 1;
+    position += header->og_dirname_length;
+    if(header->mod_dirname_length != strlen(mod_stream_dirname) || memcmp(position, mod_stream_dirname, header->mod_dirname_length) != 0) return 1;
+    
+    for(uint32_t t=0; t < header->track_count; t++) {
+        const barspatcher_state_track_t* track = &state->tracks[t];
+        if((uint64_t)track->name_offset + track->name_length >= header->names_size || state->names[track->name_offset + track->name_length] != '\0') return 1;
+        if((uint64_t)track->patch_offset + track->patch_length > header->patch_size) return 1;
+        if((uint64_t)track->hits_first + track->hit_count > header->hit_count) return 1;
+    }
+    
+    uint64_t total_length = 0;
+    for(uint32_t i=0; i < header->range_count; i++) {
+        if(state->ranges[i].length > header->output_size - total_length) return 1;
+        total_length += state->ranges[i].length;
+    }
+    if(total_length != header->output_size) return 1;
+    
+    return 0;
+}
+
+/*
+ * Reads the run state of the previous incremental run.
+ * state->valid is only set if the state file matches the current input file, directories and output file.
+ * crc_check - CRC32 check mode of the current run, tracks of a run with another mode are loaded again
+ * 
+ * Returns 0 on success, and 1 on memory error. A missing or outdated state file is not an error.
+ * 
+ */
+bool barspatcher_stateRead(barspatcher_run_state_t* state, const char* og_stream_dirname, const char* mod_stream_dirname, const char* bars_input_filename, const char* bars_output_filename, unsigned char crc_check) {
+    memset(state, 0, sizeof(barspatcher_run_state_t));
+    
+    char* state_filename = barspatcher_stateFilename(bars_output_filename);
+    if(state_filename == NULL) return 1;
+    
+    FILE* file = fopen(state_filename, "rb");
+    free(state_filename);
+    if(file == NULL) return 0;
+    
+    //Read the whole file at once
+    uint64_t file_size = 0;
+    if(fseek(file, 0, SEEK_END) == 0) file_size = ftell(file);
+    
+    if(file_size < sizeof(barspatcher_state_header_t) || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return 0;
+    }
+    
+    state->file_data = (unsigned char*)malloc(file_size);
+    if(state->file_data == NULL) {
+        fclose(file);
+        return 1;
+    }
+    
+    bool read_error = (fread(state->file_data, 1, file_size, file) != file_size);
+    fclose(file);
+    
+    memcpy(&state->header, state->file_data, sizeof(barspatcher_state_header_t));
+    if(read_error || memcmp(state->header.magic, "BPRS", 4) != 0 || state->header.version != BARSPATCHER_STATE_VERSION) {
+        barspatcher_stateFree(state);
+        return 0;
+    }
+    
+    if(barspatcher_stateParse(state, file_size, og_stream_dirname, mod_stream_dirname)) {
+        barspatcher_stateFree(state);
+        return 0;
+    }
+    
+    //The input file and the output file must not have changed since the state was written
+    barspatcher_file_stat_t input_stat, output_stat;
+    barspatcher_statFile(bars_input_filename, &input_stat);
+    barspatcher_statFile(bars_output_filename, &output_stat);
+    
+    if(!barspatcher_sameFileStat(&input_stat, &state->header.input_stat) || !barspatcher_sameFileStat(&output_stat, &state->header.output_stat)) {
+        barspatcher_stateFree(state);
+        return 0;
+    }
+    
+    //Track lookup table
+    uint32_t capacity = 64;
+    while(capacity < state->header.track_count * 2) capacity *= 2;
+    
+    state->table = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    if(state->table == NULL) {
+        barspatcher_stateFree(state);
+        return 1;
+    }
+    memset(state->table, 0xFF, capacity * sizeof(uint32_t));
+    state->table_capacity = capacity;
+    
+    for(uint32_t t=0; t < state->header.track_count; t++) {
+        const barspatcher_state_track_t* track = &state->tracks[t];
+        uint32_t slot = barspatcher_nameHash(state->names + track->name_offset, track->name_length) & (capacity - 1);
+        while(state->table[slot] != BARSPATCHER_MANIFEST_EMPTY) slot = (slot + 1) & (capacity - 1);
+        state->table[slot] = t;
+    }
+    
+    state->valid = 1;
+    state->reuse_tracks = (state->header.crc_check == crc_check);
+    
+    return 0;
+}
+
+/*
+ * Loads the tracks for an incremental run. Tracks whose modded file has the same size and modification time
+ * as in the previous run are taken from the state, everything else is loaded with barspatcher_loadTracksCached.
+ * 
+ * mod_stats_out - Receives an allocated array with the stat data of the modded file of every track
+ * reused_count_out - Receives the number of tracks that were taken from the state
+ * 
+ * Everything else works like barspatcher_loadTracksCached.
+ * 
+ */
+unsigned char barspatcher_stateLoadTracks(const barspatcher_run_state_t* state, const char* og_stream_dirname, const char* mod_stream_dirname, const barspatcher_name_list_t* mod_dir_list, barspatcher_track_t** tracks_out, barspatcher_file_stat_t** mod_stats_out, uint64_t* track_count_out, uint64_t* reused_count_out, uint64_t* skipped_files_out, unsigned int workers, barspatcher_manifest_t* manifest, barspatcher_stats_t* stats = NULL, barspatcher_events_t* events = NULL) {
+    //Stat data of every entry, and the state track for entries that didn't change
+    barspatcher_file_stat_t* entry_stats = (barspatcher_file_stat_t*)malloc(mod_dir_list->count * sizeof(barspatcher_file_stat_t));
+    const barspatcher_state_track_t** reused = (const barspatcher_state_track_t**)malloc(mod_dir_list->count * sizeof(barspatcher_state_track_t*));
+    //Entries that have to be loaded
+    barspatcher_name_list_t load_list;
+    barspatcher_nameListInit(&load_list);
+    bool memory_error = (entry_stats == NULL || reused == NULL);
+    
+    if(memory_error) {
+        printf("Could not allocate memory for the track list.\n");
+        free(entry_stats);
+        free(reused);
+        return 100;
+    }
+    
+    //Files that can't be checked are loaded again, and loading reports the error
+    barspatcher_dir_t mod_dir;
+    bool mod_dir_open = !barspatcher_dirOpen(&mod_dir, mod_stream_dirname);
+    
+    for(uint64_t entry=0; entry < mod_dir_list->count && !memory_error; entry++) {
+        const char* name = barspatcher_nameListGet(mod_dir_list, entry);
+        entry_stats[entry].valid = 0;
+        if(mod_dir_open) barspatcher_statDirFile(&mod_dir, name, &entry_stats[entry]);
+        
+        reused[entry] = (state->reuse_tracks ? barspatcher_stateFind(state, name) : NULL);
+        if(reused[entry] != NULL && !barspatcher_sameFileStat(&reused[entry]->mod_stat, &entry_stats[entry])) reused[entry] = NULL;
+        
+        if(reused[entry] == NULL) memory_error = barspatcher_nameListAdd(&load_list, name);
+    }
+    
+    if(mod_dir_open) barspatcher_dirClose(&mod_dir);
+    
+    if(memory_error) {
+        printf("Could not allocate memory for the track list.\n");
+        free(entry_stats);
+        free(reused);
+        barspatcher_nameListFree(&load_list);
+        return 100;
+    }
+    
+    //Load everything that changed
+    barspatcher_track_t* loaded_tracks = NULL;
+    uint64_t loaded_count = 0;
+    uint64_t skipped_files = 0;
+    
+    if(load_list.count > 0) {
+        unsigned char tracks_res = barspatcher_loadTracksCached(og_stream_dirname, mod_stream_dirname, &load_list, &loaded_tracks, &loaded_count, &skipped_files, workers, manifest, stats, events);
+        if(tracks_res != 0) {
+            free(entry_stats);
+            free(reused);
+            barspatcher_nameListFree(&load_list);
+            return tracks_res;
+        }
+    }
+    
+    //Merge the reused and loaded tracks in directory listing order
+    barspatcher_track_t* tracks = (barspatcher_track_t*)malloc((mod_dir_list->count + 1) * sizeof(barspatcher_track_t));
+    barspatcher_file_stat_t* mod_stats = (barspatcher_file_stat_t*)malloc((mod_dir_list->count + 1) * sizeof(barspatcher_file_stat_t));
+    uint64_t track_count = 0, reused_count = 0, loaded_next = 0;
+    memory_error = (tracks == NULL || mod_stats == NULL);
+    
+    for(uint64_t entry=0; entry < mod_dir_list->count && !memory_error; entry++) {
+        barspatcher_track_t* track = &tracks[track_count];
+        const char* name = barspatcher_nameListGet(mod_dir_list, entry);
+        
+        if(reused[entry] != NULL) {
+            const barspatcher_state_track_t* state_track = reused[entry];
+            track->name = name;
+            track->og_crc32 = state_track->og_crc32;
+            track->crc_key = state_track->crc_key;
+            track->patch_length = state_track->patch_length;
+            track->patch_data = (unsigned char*)malloc(state_track->patch_length);
+            
+            if(track->patch_data == NULL) {
+                memory_error = 1;
+                break;
+            }
+            
+            memcpy(track->patch_data, state->patch + state_track->patch_offset, state_track->patch_length);
+            reused_count++;
+        }
+        else {
+            //Loaded tracks are in the same order as the entries they were loaded from, skipped entries have no track.
+            //Their names point into the load list, which is freed below.
+            if(loaded_next >= loaded_count || strcmp(loaded_tracks[loaded_next].name, name) != 0) continue;
+            *track = loaded_tracks[loaded_next];
+            track->name = name;
+            loaded_tracks[loaded_next].patch_data = NULL;
+            loaded_next++;
+        }
+        
+        mod_stats[track_count] = entry_stats[entry];
+        track_count++;
+    }
+    
+    free(entry_stats);
+    free(reused);
+    barspatcher_nameListFree(&load_list);
+    if(loaded_tracks != NULL) barspatcher_freeTracks(loaded_tracks, loaded_count);
+    
+    if(memory_error) {
+        printf("Could not allocate memory for the track list.\n");
+        if(tracks != NULL) barspatcher_freeTracks(tracks, track_count);
+        free(mod_stats);
+        return 100;
+    }
+    
+    *tracks_out = tracks;
+    *mod_stats_out = mod_stats;
+    *track_count_out = track_count;
+    *reused_count_out = reused_count;
+    *skipped_files_out = skipped_files;
+    
+    return 0;
+}
+
+/*
+ * Adds the locations of every track's original hash from the previous run to the index.
+ * 
+ * Returns:
+ * 0 - All locations were added
+ * 1 - Some hashes were not in the previous run, the BARS file has to be indexed normally. Nothing was added.
+ * 2 - Memory allocation error
+ * 
+ */
+unsigned char barspatcher_stateIndexTracks(const barspatcher_run_state_t* state, barspatcher_crc_index_t* index) {
+    if(!state->valid) return 1;
+    
+    //Find a state track with the same original hash for every hash in the index
+    uint32_t* sources = (uint32_t*)malloc(index->capacity * sizeof(uint32_t));
+    if(sources == NULL) return 2;
+    memset(sources, 0xFF, index->capacity * sizeof(uint32_t));
+    
+    for(uint32_t s=0; s < state->header.track_count; s++) {
+        int64_t slot = barspatcher_crcIndexFind(index, state->tracks[s].crc_key);
+        if(slot >= 0 && sources[slot] == BARSPATCHER_MANIFEST_EMPTY) sources[slot] = s;
+    }
+    
+    for(uint32_t slot=0; slot < index->capacity; slot++) {
+        if(index->used[slot] && sources[slot] == BARSPATCHER_MANIFEST_EMPTY) {
+            free(sources);
+            return 1;
+        }
+    }
+    
+    for(uint32_t slot=0; slot < index->capacity; slot++) {
+        if(!index->used[slot]) continue;
+        
+        const barspatcher_state_track_t* source = &state->tracks[sources[slot]];
+        for(uint32_t h=0; h < source->hit_count; h++) {
+            if(barspatcher_crcIndexAddHit(index, slot, state->hits[source->hits_first + h])) {
+                free(sources);
+                return 2;
+            }
+        }
+    }
+    
+    free(sources);
+    
+    return 0;
+}
+
+/*
+ * Writes the patched BARS data for an incremental run.
+ * 
+ * With a valid state, only the ranges patched now that were not written with the same bytes by the previous run,
+ * and the ranges of the previous run that are not patched any more, are written into the existing output file.
+ * Nothing is written if every range is the same as last time.
+ * Without a valid state, the output is written with barspatcher_outputWrite.
+ * 
+ * written_out - Receives 1 if the output file was written
+ * bytes_written - Receives the number of bytes written, or NULL, see barspatcher_outputWrite
+ * 
+ * Returns 0 on success, and barspatcher_run error codes on errors.
+ * 
+ */
+unsigned char barspatcher_stateOutputWrite(const barspatcher_run_state_t* state, const unsigned char* data, uint64_t size, const char* bars_input_filename, const char* bars_output_filename, const barspatcher_range_list_t* ranges, bool* written_out, uint64_t* bytes_written = NULL) {
+    *written_out = 1;
+    if(!state->valid) return barspatcher_outputWrite(data, size, bars_input_filename, bars_output_filename, ranges, bytes_written);
+    
+    uint32_t previous_count = state->header.range_count;
+    for(uint32_t i=0; i < previous_count; i++) {
+        if(state->ranges[i].offset > size || state->ranges[i].length > size - state->ranges[i].offset) {
+            return barspatcher_outputWrite(data, size, bars_input_filename, bars_output_filename, ranges, bytes_written);
+        }
+    }
+    
+    //Open addressing hash table of the previous ranges by offset, with the position of their bytes in the state
+    uint32_t capacity = 64;
+    while(capacity < previous_count * 2) capacity *= 2;
+    uint32_t* table = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    uint64_t* positions = (uint64_t*)malloc((previous_count + 1) * sizeof(uint64_t));
+    //1 for previous ranges that are patched again with the same bytes
+    bool* kept = (bool*)calloc(previous_count + 1, sizeof(bool));
+    barspatcher_range_list_t update_ranges;
+    barspatcher_rangesInit(&update_ranges);
+    bool memory_error = (table == NULL || positions == NULL || kept == NULL);
+    
+    if(!memory_error) {
+        memset(table, 0xFF, capacity * sizeof(uint32_t));
+        uint64_t position = 0;
+        for(uint32_t i=0; i < previous_count; i++) {
+            uint32_t slot = (uint32_t)((state->ranges[i].offset * 11400714819323198485ULL) >> 32) & (capacity - 1);
+            while(table[slot] != BARSPATCHER_MANIFEST_EMPTY) slot = (slot + 1) & (capacity - 1);
+            table[slot] = i;
+            positions[i] = position;
+            position += state->ranges[i].length;
+        }
+    }
+    
+    //Ranges patched now are written unless the output file already has the same bytes there
+    for(uint32_t i=0; i < ranges->count && !memory_error; i++) {
+        const barspatcher_range_t* range = &ranges->ranges[i];
+        bool same = 0;
+        
+        for(uint32_t slot = (uint32_t)((range->offset * 11400714819323198485ULL) >> 32) & (capacity - 1); table[slot] != BARSPATCHER_MANIFEST_EMPTY && !same; slot = (slot + 1) & (capacity - 1)) {
+            uint32_t p = table[slot];
+            if(state->ranges[p].offset != range->offset || state->ranges[p].length != range->length) continue;
+            
+            same = (memcmp(state->output_bytes + positions[p], data + range->offset, range->length) == 0);
+            if(same) kept[p] = 1;
+        }
+        
+        if(!same) memory_error = barspatcher_rangesAdd(&update_ranges, range->offset, range->length);
+    }
+    
+    //Ranges that are not patched any more get the bytes of data back, which are the input bytes unless another range is patched there
+    for(uint32_t i=0; i < previous_count && !memory_error; i++) {
+        if(!kept[i]) memory_error = barspatcher_rangesAdd(&update_ranges, state->ranges[i].offset, state->ranges[i].length);
+    }
+    
+    free(table);
+    free(positions);
+    free(kept);
+    
+    if(memory_error) {
+        barspatcher_rangesFree(&update_ranges);
+        return barspatcher_outputWrite(data, size, bars_input_filename, bars_output_filename, ranges, bytes_written);
+    }
+    
+    //Nothing changed since the previous run
+    if(update_ranges.count == 0) {
+        *written_out = 0;
+        if(bytes_written != NULL) *bytes_written = 0;
+        return 0;
+    }
+    
+    unsigned char output_res = barspatcher_outputUpdate(data, bars_output_filename, &update_ranges, bytes_written);
+    barspatcher_rangesFree(&update_ranges);
+    
+    return output_res;
+}
+
+/*
+ * Writes the run state file for the next incremental run.
+ * 
+ * tracks, mod_stats, track_count - Tracks that were applied and the stat data of their modded files
+ * index - CRC index with the locations of every track's original hash
+ * ranges - Ranges that were written into the output file
+ * crc_check - CRC32 check mode the patch data of the tracks was made with
+ * 
+ * Returns 0 on success, and 1 on error.
+ * 
+ */
+bool barspatcher_stateWrite(const char* og_stream_dirname, const char* mod_stream_dirname, const char* bars_input_filename, const char* bars_output_filename, const barspatcher_track_t* tracks, const barspatcher_file_stat_t* mod_stats, uint64_t track_count, const barspatcher_crc_index_t* index, const unsigned char* data, const barspatcher_range_list_t* ranges, unsigned char crc_check) {
+    barspatcher_state_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BPRS", 4);
+    header.version = BARSPATCHER_STATE_VERSION;
+    header.track_count = track_count;
+    header.range_count = ranges->count;
+    header.og_dirname_length = strlen(og_stream_dirname);
+    header.mod_dirname_length = strlen(mod_stream_dirname);
+    header.crc_check = crc_check;
+    for(uint32_t i=0; i < ranges->count; i++) header.output_size += ranges->ranges[i].length;
+    
+    if(barspatcher_statFile(bars_input_filename, &header.input_stat) || barspatcher_statFile(bars_output_filename, &header.output_stat)) return 1;
+    
+    barspatcher_state_track_t* state_tracks = (barspatcher_state_track_t*)calloc(track_count + 1, sizeof(barspatcher_state_track_t));
+    if(state_tracks == NULL) return 1;
+    
+    for(uint64_t t=0; t < track_count; t++) {
+        barspatcher_state_track_t* state_track = &state_tracks[t];
+        state_track->name_offset = header.names_size;
+        state_track->name_length = strlen(tracks[t].name);
+        state_track->mod_stat = mod_stats[t];
+        state_track->og_crc32 = tracks[t].og_crc32;
+        state_track->crc_key = tracks[t].crc_key;
+        state_track->patch_offset = header.patch_size;
+        state_track->patch_length = tracks[t].patch_length;
+        state_track->hits_first = header.hit_count;
+        
+        int64_t slot = barspatcher_crcIndexFind(index, tracks[t].crc_key);
+        for(uint32_t hit = (slot < 0 ? BARSPATCHER_CRC_INDEX_NONE : index->first_hit[slot]); hit != BARSPATCHER_CRC_INDEX_NONE; hit = index->hits[hit].next) {
+            state_track->hit_count++;
+        }
+        
+        header.names_size += state_track->name_length + 1;
+        header.patch_size += state_track->patch_length;
+        header.hit_count += state_track->hit_count;
+    }
+    
+    char* state_filename = barspatcher_stateFilename(bars_output_filename);
+    char* temp_filename = (state_filename == NULL ? NULL : (char*)malloc(strlen(state_filename) + 5));
+    FILE* file = NULL;
+    
+    if(temp_filename != NULL) {
+        strcpy(temp_filename, state_filename);
+        strcat(temp_filename, ".tmp");
+        file = fopen(temp_filename, "wb");
+    }
+    
+    if(file == NULL) {
+        free(state_tracks);
+        free(state_filename);
+        free(temp_filename);
+        return 1;
+    }
+    
+    bool write_error = (fwrite(&header, sizeof(header), 1, file) != 1);
+    if(!write_error && track_count > 0) write_error = (fwrite(state_tracks, sizeof(barspatcher_state_track_t), track_count, file) != track_count);
+    if(!write_error && ranges->count > 0) write_error = (fwrite(ranges->ranges, sizeof(barspatcher_range_t), ranges->count, file) != ranges->count);
+    
+    for(uint64_t t=0; t < track_count && !write_error; t++) {
+        int64_t slot = barspatcher_crcIndexFind(index, tracks[t].crc_key);
+        for(uint32_t hit = (slot < 0 ? BARSPATCHER_CRC_INDEX_NONE : index->first_hit[slot]); hit != BARSPATCHER_CRC_INDEX_NONE && !write_error; hit = index->hits[hit].next) {
+            write_error = (fwrite(&index->hits[hit].offset, sizeof(uint64_t), 1, file) != 1);
+        }
+    }
+    for(uint64_t t=0; t < track_count && !write_error; t++) {
+        write_error = (fwrite(tracks[t].name, 1, state_tracks[t].name_length + 1, file) != state_tracks[t].name_length + 1);
+    }
+    for(uint64_t t=0; t < track_count && !write_error; t++) {
+        write_error = (fwrite(tracks[t].patch_data, 1, tracks[t].patch_length, file) != tracks[t].patch_length);
+    }
+    for(uint32_t i=0; i < ranges->count && !write_error; i++) {
+        write_error = (fwrite(data + ranges->ranges[i].offset, 1, ranges->ranges[i].length, file) != ranges->ranges[i].length);
+    }
+    
+    if(!write_error) write_error = (fwrite(og_stream_dirname, 1, header.og_dirname_length, file) != header.og_dirname_length);
+    if(!write_error) write_error = (fwrite(mod_stream_dirname, 1, header.mod_dirname_length, file) != header.mod_dirname_length);
+    
+    if(fclose(file) != 0) write_error = 1;
+    if(!write_error) write_error = (rename(temp_filename, state_filename) != 0);
+    if(write_error) remove(temp_filename);
+    
+    free(state_tracks);
+    free(state_filename);
+    free(temp_filename);
+    
+    return write_error;
+}
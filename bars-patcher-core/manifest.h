@@ -0,0 +1,304 @@
+//Original BWAV manifest for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//The original stream directory of a game dump doesn't change between runs, but every run needs the CRC32 hash,
+//byte order and channel count of the original files. The manifest keeps the fixed header of every original BWAV file
+//that was read, together with its size and modification time. On later runs, an original file whose stat data
+//still matches its manifest entry is not opened at all.
+
+/*
+ * Manifest file layout, in native byte order:
+ * 0x00 - "BPMF"
+ * 0x04 - Format version, also rejects files that were written with the other byte order
+ * 0x08 - Entry count
+ * 0x0C - Size of the name block
+ * 0x10 - Length of the original stream directory key, followed by the key, see barspatcher_manifestDirKey
+ * then - Entries, then the name block with null terminated file names
+ * 
+ */
+
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bars-reader.h"
+#include "directory.h"
+
+#define BARSPATCHER_MANIFEST_VERSION 1
+
+//Marks empty slots in the manifest hash table
+#define BARSPATCHER_MANIFEST_EMPTY 0xFFFFFFFF
+
+struct barspatcher_manifest_entry_t {
+    //File name in the name block
+    uint32_t name_offset;
+    uint32_t name_length;
+    //Stat data of the original file when the header was read
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    //Number of header bytes that could be read, less than BARSPATCHER_BWAV_HEADER_SIZE for short files
+    uint32_t header_length;
+    unsigned char header[BARSPATCHER_BWAV_HEADER_SIZE];
+};
+
+struct barspatcher_manifest_t {
+    barspatcher_manifest_entry_t* entries;
+    uint32_t count;
+    uint32_t capacity;
+    char* names;
+    uint32_t names_size;
+    uint32_t names_capacity;
+    //Open addressing hash table of entry indexes
+    uint32_t* table;
+    uint32_t table_capacity;
+    //1 if entries were added or changed since the manifest was read
+    bool changed;
+};
+
+//Initializes an empty manifest.
+void barspatcher_manifestInit(barspatcher_manifest_t* manifest) {
+    memset(manifest, 0, sizeof(barspatcher_manifest_t));
+}
+
+//Frees the manifest.
+void barspatcher_manifestFree(barspatcher_manifest_t* manifest) {
+    free(manifest->entries);
+    free(manifest->names);
+    free(manifest->table);
+    barspatcher_manifestInit(manifest);
+}
+
+//Returns the entry for a file name, or NULL if the manifest has no entry for it.
+barspatcher_manifest_entry_t* barspatcher_manifestFind(barspatcher_manifest_t* manifest, const char* name) {
+    if(manifest->table_capacity == 0) return NULL;
+    
+    uint32_t length = strlen(name);
+    uint32_t mask = manifest->table_capacity - 1;
+    
+    for(uint32_t slot = barspatcher_nameHash(name, length) & mask; manifest->table[slot] != BARSPATCHER_MANIFEST_EMPTY; slot = (slot + 1) & mask) {
+        barspatcher_manifest_entry_t* entry = &manifest->entries[manifest->table[slot]];
+        if(entry->name_length == length && memcmp(manifest->names + entry->name_offset, name, length) == 0) return entry;
+    }
+    
+    return NULL;
+}
+
+//Rebuilds the hash table with room for at least twice the number of entries.
+//Returns 0 on success, and 1 on memory error.
+bool barspatcher_manifestRehash(barspatcher_manifest_t* manifest, uint32_t entry_count) {
+    uint32_t capacity = 64;
+    while(capacity < entry_count * 2) capacity *= 2;
+    
+    uint32_t* table = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    if(table == NULL) return 1;
+    memset(table, 0xFF, capacity * sizeof(uint32_t));
+    
+    for(uint32_t e=0; e < manifest->count; e++) {
+        barspatcher_manifest_entry_t* entry = &manifest->entries[e];
+        uint32_t slot = barspatcher_nameHash(manifest->names + entry->name_offset, entry->name_length) & (capacity - 1);
+        while(table[slot] != BARSPATCHER_MANIFEST_EMPTY) slot = (slot + 1) & (capacity - 1);
+        table[slot] = e;
+    }
+    
+    free(manifest->table);
+    manifest->table = table;
+    manifest->table_capacity = capacity;
+    
+    return 0;
+}
+
+/*
+ * Adds or replaces the entry for a file name.
+ * 
+ * header, header_length - Bytes read from the start of the original file, at most BARSPATCHER_BWAV_HEADER_SIZE
+ * 
+ * Returns 0 on success, and 1 on memory error.
+ * 
+ */
+bool barspatcher_manifestSet(barspatcher_manifest_t* manifest, const char* name, uint64_t size, int64_t mtime_sec, uint32_t mtime_nsec, const unsigned char* header, uint32_t header_length) {
+    barspatcher_manifest_entry_t* entry = barspatcher_manifestFind(manifest, name);
+    
+    if(entry == NULL) {
+        uint32_t name_length = strlen(name);
+        
+        //Make room for the entry, its name and its hash table slot
+        if(manifest->count >= manifest->capacity) {
+            uint32_t capacity = (manifest->capacity == 0 ? 256 : manifest->capacity * 2);
+            barspatcher_manifest_entry_t* entries = (barspatcher_manifest_entry_t*)realloc(manifest->entries, capacity * sizeof(barspatcher_manifest_entry_t));
+            if(entries == NULL) return 1;
+            manifest->entries = entries;
+            manifest->capacity = capacity;
+        }
+        
+        if(manifest->names_size + name_length + 1 > manifest->names_capacity) {
+            uint32_t capacity = (manifest->names_capacity == 0 ? 4096 : manifest->names_capacity);
+            while(manifest->names_size + name_length + 1 > capacity) capacity *= 2;
+            char* names = (char*)realloc(manifest->names, capacity);
+            if(names == NULL) return 1;
+            manifest->names = names;
+            manifest->names_capacity = capacity;
+        }
+        
+        if((manifest->count + 1) * 2 > manifest->table_capacity) {
+            if(barspatcher_manifestRehash(manifest, manifest->count + 1)) return 1;
+        }
+        
+        entry = &manifest->entries[manifest->count];
+        entry->name_offset = manifest->names_size;
+        entry->name_length = name_length;
+        memcpy(manifest->names + manifest->names_size, name, name_length + 1);
+        manifest->names_size += name_length + 1;
+        
+        uint32_t mask = manifest->table_capacity - 1;
+        uint32_t slot = barspatcher_nameHash(name, name_length) & mask;
+        while(manifest->table[slot] != BARSPATCHER_MANIFEST_EMPTY) slot = (slot + 1) & mask;
+        manifest->table[slot] = manifest->count;
+        
+        manifest->count++;
+    }
+    
+    if(header_length > BARSPATCHER_BWAV_HEADER_SIZE) header_length = BARSPATCHER_BWAV_HEADER_SIZE;
+    
+    entry->size = size;
+    entry->mtime_sec = mtime_sec;
+    entry->mtime_nsec = mtime_nsec;
+    entry->header_length = header_length;
+    memset(entry->header, 0, BARSPATCHER_BWAV_HEADER_SIZE);
+    memcpy(entry->header, header, header_length);
+    
+    manifest->changed = 1;
+    
+    return 0;
+}
+
+//Returns the key that a manifest is kept under for an original stream directory, or NULL on memory error.
+//On PC this is the canonical absolute path, so the same directory reached through another relative path or symbolic link,
+//or from another working directory, uses the same manifest. The key has to be freed.
+char* barspatcher_manifestDirKey(const char* og_stream_dirname) {
+    #if defined BARSPATCHER_VERSION_PC
+    char* key = realpath(og_stream_dirname, NULL);
+    if(key != NULL) return key;
+    #endif
+    
+    //Paths that can't be resolved are used as they are
+    return strdup(og_stream_dirname);
+}
+
+//Reads the manifest from an open file, see barspatcher_manifestRead for the return values.
+unsigned char barspatcher_manifestReadFile(barspatcher_manifest_t* manifest, FILE* file, const char* dir_key) {
+    uint32_t header[5];
+    uint32_t key_length = strlen(dir_key);
+    
+    if(fread(header, sizeof(uint32_t), 5, file) != 5) return 1;
+    if(memcmp(header, "BPMF", 4) != 0 || header[1] != BARSPATCHER_MANIFEST_VERSION || header[4] != key_length) return 1;
+    
+    //Entries are only valid for the directory they were read from
+    char* file_key = (char*)malloc(key_length + 1);
+    if(file_key == NULL) return 2;
+    
+    bool same_dir = (fread(file_key, 1, key_length, file) == key_length && memcmp(file_key, dir_key, key_length) == 0);
+    free(file_key);
+    if(!same_dir) return 1;
+    
+    uint32_t entry_count = header[2];
+    uint32_t names_size = header[3];
+    if(entry_count == 0) return 0;
+    
+    manifest->entries = (barspatcher_manifest_entry_t*)malloc(entry_count * sizeof(barspatcher_manifest_entry_t));
+    manifest->names = (char*)malloc(names_size > 0 ? names_size : 1);
+    if(manifest->entries == NULL || manifest->names == NULL) return 2;
+    manifest->capacity = entry_count;
+    manifest->names_capacity = names_size;
+    
+    if(fread(manifest->entries, sizeof(barspatcher_manifest_entry_t), entry_count, file) != entry_count) return 1;
+    if(fread(manifest->names, 1, names_size, file) != names_size) return 1;
+    
+    //Every name has to be inside the name block and null terminated
+    for(uint32_t e=0; e < entry_count; e++) {
+        barspatcher_manifest_entry_t* entry = &manifest->entries[e];
+        if((uint64_t)entry->name_offset + entry->name_length >= names_size) return 1;
+        if(manifest->names[entry->name_offset + entry->name_length] != '\0') return 1;
+        if(entry->header_length > BARSPATCHER_BWAV_HEADER_SIZE) return 1;
+    }
+    
+    manifest->count = entry_count;
+    manifest->names_size = names_size;
+    
+    if(barspatcher_manifestRehash(manifest, manifest->count)) return 2;
+    
+    return 0;
+}
+
+/*
+ * Reads a manifest file that was written for the same original stream directory.
+ * 
+ * Returns:
+ * 0 - Success
+ * 1 - The file doesn't exist, is not a valid manifest, or belongs to another directory. The manifest is left empty.
+ * 2 - Memory allocation error
+ * 
+ */
+unsigned char barspatcher_manifestRead(barspatcher_manifest_t* manifest, const char* manifest_filename, const char* og_stream_dirname) {
+    barspatcher_manifestInit(manifest);
+    
+    FILE* file = fopen(manifest_filename, "rb");
+    if(file == NULL) return 1;
+    
+    char* dir_key = barspatcher_manifestDirKey(og_stream_dirname);
+    if(dir_key == NULL) {
+        fclose(file);
+        return 2;
+    }
+    
+    unsigned char res = barspatcher_manifestReadFile(manifest, file, dir_key);
+    fclose(file);
+    free(dir_key);
+    
+    if(res != 0) barspatcher_manifestFree(manifest);
+    
+    return res;
+}
+
+/*
+ * Writes the manifest file. The file is written under a temporary name first and then renamed,
+ * so an interrupted write never leaves a broken manifest behind.
+ * 
+ * Returns 0 on success, and 1 on error with errno set.
+ * 
+ */
+bool barspatcher_manifestWrite(const barspatcher_manifest_t* manifest, const char* manifest_filename, const char* og_stream_dirname) {
+    size_t filename_length = strlen(manifest_filename);
+    char* temp_filename = (char*)malloc(filename_length + 5);
+    if(temp_filename == NULL) return 1;
+    memcpy(temp_filename, manifest_filename, filename_length);
+    memcpy(temp_filename + filename_length, ".tmp", 5);
+    
+    char* dir_key = barspatcher_manifestDirKey(og_stream_dirname);
+    FILE* file = (dir_key != NULL ? fopen(temp_filename, "wb") : NULL);
+    if(file == NULL) {
+        free(dir_key);
+        free(temp_filename);
+        return 1;
+    }
+    
+    uint32_t key_length = strlen(dir_key);
+    uint32_t header[5] = {0, BARSPATCHER_MANIFEST_VERSION, manifest->count, manifest->names_size, key_length};
+    memcpy(header, "BPMF", 4);
+    
+    bool write_error = (fwrite(header, sizeof(uint32_t), 5, file) != 5);
+    if(!write_error) write_error = (fwrite(dir_key, 1, key_length, file) != key_length);
+    if(!write_error) write_error = (fwrite(manifest->entries, sizeof(barspatcher_manifest_entry_t), manifest->count, file) != manifest->count);
+    if(!write_error) write_error = (fwrite(manifest->names, 1, manifest->names_size, file) != manifest->names_size);
+    
+    if(fclose(file) != 0) write_error = 1;
+    if(!write_error) write_error = (rename(temp_filename, manifest_filename) != 0);
+    if(write_error) remove(temp_filename);
+    
+    free(dir_key);
+    free(temp_filename);
+    
+    return write_error;
+}
@@ -0,0 +1,157 @@
+//Multi-archive mode for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Games often spread their streams across several BARS files that share the same original BWAV directory.
+//Multi-archive mode opens a patching context (see context.h) for each of them, and lists the modded BWAV directory
+//and reads every original and modded BWAV header only once, in the context of the first archive.
+//
+//The original hashes of these tracks are then located in every archive, and a track is patched in every archive that
+//has its original hash. Only the archives that were patched are written.
+
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+
+#include "bars-io.h"
+#include "stats.h"
+#include "events.h"
+#include "context.h"
+
+//Closes the contexts of a multi-archive run that were opened and frees the list.
+//Output files that were only created to check their paths and were never written are removed.
+void barspatcher_archivesFree(barspatcher_context_t* archives, uint32_t opened_count, const char* const* bars_output_filenames, const bool* output_created, uint32_t archive_count) {
+    for(uint32_t a=0; a < opened_count; a++) barspatcher_contextFree(&archives[a]);
+    for(uint32_t a=0; a < archive_count; a++) {
+        if(output_created[a]) remove(bars_output_filenames[a]);
+    }
+    free(archives);
+}
+
+/*
+ * BARS patcher function for several BARS files that use the same original and modded BWAV files
+ * 
+ * Works like barspatcher_run, but patches every input BARS file and writes each one to its own output file.
+ * The modded BWAV directory is listed and every BWAV header is read only once for all archives.
+ * 
+ * bars_input_filenames - Paths to the original unmodified BARS files
+ * bars_output_filenames - Output path for every input BARS file, in the same order
+ * archive_count - Number of input and output files
+ * workers, manifest_filename, stats, event_callback, event_user_data, crc_check - Same as for barspatcher_run.
+ *                                                                       BARSPATCHER_EVENT_PATCHED events count the locations in all archives.
+ * 
+ * Output files of archives that have none of the original hashes are not created. Output files that already existed are
+ * written with the unpatched input instead, so they don't keep the patches of an earlier run.
+ * A track is only skipped if none of the archives has its original hash.
+ * 
+ * Returns the same codes as barspatcher_run.
+ * 
+ */
+unsigned char barspatcher_runMulti(bool verbose, const char* og_stream_dirname, const char* mod_stream_dirname, const char* const* bars_input_filenames, const char* const* bars_output_filenames, uint32_t archive_count, unsigned int workers = 1, const char* manifest_filename = NULL, barspatcher_stats_t* stats = NULL, barspatcher_event_callback_t event_callback = NULL, void* event_user_data = NULL, unsigned char crc_check = BARSPATCHER_CRC_CHECK_OFF) {
+    double run_start = barspatcher_timeMs();
+    if(stats != NULL) barspatcher_statsInit(stats);
+    
+    //Contexts of all archives and whether their output files existed, in one allocation
+    barspatcher_context_t* archives = (barspatcher_context_t*)malloc(archive_count * (sizeof(barspatcher_context_t) + sizeof(bool)));
+    if(archives == NULL) {
+        printf("Could not allocate memory for the list of BARS files.\n");
+        return 100;
+    }
+    bool* output_created = (bool*)(archives + archive_count);
+    memset(output_created, 0, archive_count * sizeof(bool));
+    
+    //Check if all output file paths can be opened for writing
+    for(uint32_t a=0; a < archive_count; a++) {
+        FILE* existing = fopen(bars_output_filenames[a], "rb");
+        output_created[a] = (existing == NULL);
+        if(existing != NULL) fclose(existing);
+        
+        std::ofstream ofile;
+        ofile.open(bars_output_filenames[a], std::ios::out | std::ios::binary | std::ios::app);
+        if(!ofile.is_open()) {
+            perror(bars_output_filenames[a]);
+            output_created[a] = 0;
+            barspatcher_archivesFree(archives, 0, bars_output_filenames, output_created, archive_count);
+            if(stats != NULL) stats->total_ms = barspatcher_timeMs() - run_start;
+            return 249;
+        }
+        ofile.close();
+    }
+    
+    //Open all input BARS files, the first context loads the tracks for all of them
+    for(uint32_t a=0; a < archive_count; a++) {
+        unsigned char open_res = barspatcher_contextOpen(&archives[a], verbose, og_stream_dirname, bars_input_filenames[a], workers, (a == 0 ? manifest_filename : NULL));
+        if(open_res != 0) {
+            barspatcher_archivesFree(archives, a, bars_output_filenames, output_created, archive_count);
+            if(stats != NULL) stats->total_ms = barspatcher_timeMs() - run_start;
+            return open_res;
+        }
+        
+        archives[a].cache_headers = 0;
+    }
+    
+    barspatcher_context_t* ctx = &archives[0];
+    ctx->crc_check = crc_check;
+    if(event_callback != NULL) barspatcher_contextSetEventCallback(ctx, event_callback, event_user_data);
+    
+    //List the modded BWAV directory and read every BWAV header, once for all archives
+    unsigned char res = barspatcher_contextLoad(ctx, mod_stream_dirname);
+    barspatcher_stats_t run_stats = ctx->stats;
+    
+    //Find the original hashes in every archive, then patch all of them
+    for(uint32_t a=0; a < archive_count && res == 0; a++) {
+        if(verbose) printf("%s: ", archives[a].bars_input_filename);
+        if(barspatcher_contextLocate(&archives[a], ctx->tracks, ctx->track_count)) res = 100;
+        
+        run_stats.scan_bytes += archives[a].stats.scan_bytes;
+        run_stats.matches_found += archives[a].stats.matches_found;
+        run_stats.locate_ms += archives[a].stats.locate_ms;
+    }
+    
+    if(res == 0 && barspatcher_contextPatch(archives, archive_count)) res = 100;
+    
+    run_stats.patch_ms = ctx->stats.patch_ms;
+    run_stats.tracks_patched = ctx->stats.tracks_patched;
+    run_stats.tracks_skipped = ctx->stats.tracks_skipped;
+    
+    uint64_t patched_files = ctx->patched_files, skipped_files = ctx->skipped_files;
+    if(res == 0 && patched_files == 0) {
+        printf("Error: All tracks were skipped, BARS file was not patched.\n");
+        res = 200;
+    }
+    
+    //Write every archive that was patched, the empty output files of the others are removed when the archives are freed
+    uint32_t written_archives = 0;
+    for(uint32_t a=0; a < archive_count && res == 0; a++) {
+        barspatcher_context_t* archive = &archives[a];
+        bool patched = (archive->patched_ranges.count > 0);
+        if(!patched && output_created[a]) {
+            if(verbose) printf("%s: No tracks were found, the output file was not written.\n", archive->bars_input_filename);
+            continue;
+        }
+        if(!patched) printf("%s: No tracks were found, %s was written without patches.\n", archive->bars_input_filename, bars_output_filenames[a]);
+        
+        res = barspatcher_contextWrite(archive, bars_output_filenames[a]);
+        run_stats.bytes_written += archive->stats.bytes_written;
+        run_stats.write_ms += archive->stats.write_ms;
+        if(res == 0) {
+            output_created[a] = 0;
+            if(patched) written_archives++;
+        }
+    }
+    
+    barspatcher_archivesFree(archives, archive_count, bars_output_filenames, output_created, archive_count);
+    
+    if(stats != NULL) {
+        *stats = run_stats;
+        stats->total_ms = barspatcher_timeMs() - run_start;
+    }
+    
+    if(res != 0) return res;
+    
+    if(event_callback == NULL) printf("%llu track%s patched in %u of %u BARS files, %llu track%s skipped.\n", (unsigned long long)patched_files, (patched_files == 1 ? "" : "s"), written_archives, archive_count, (unsigned long long)skipped_files, (skipped_files == 1 ? "" : "s"));
+    
+    return (skipped_files > 99 ? 99 : skipped_files);
+}
@@ -0,0 +1,310 @@
+//Patch plan files for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//A patch plan records every range of the BARS file that a run patched, with its bytes before and after the patch.
+//barspatcher_runPlan applies a plan to a BARS file, or reverts it, without reading any BWAV files.
+//
+//Patched ranges can overlap, so the ranges are applied in plan order and reverted in reverse order, the same way
+//barspatcher_contextRestore puts the input bytes back. A plan only applies to BARS files with the same size and the
+//same bytes in every patched range as the input of the run that made it. This is checked with a digest of the ranges,
+//so applying or reverting a plan only reads and writes the patched ranges.
+
+/*
+ * Patch plan file layout, all numbers are little endian so plans can be used on any machine:
+ * 0x00 - "BPPL"
+ * 0x04 - Version (u32)
+ * 0x08 - Number of patched ranges (u32)
+ * 0x0C - Reserved (u32)
+ * 0x10 - Size of the BARS file (u64)
+ * 0x18 - Digest of the ranges in the input BARS file (u64)
+ * 0x20 - Digest of the ranges in the patched BARS file (u64)
+ * 0x28 - Size of each of the two byte blocks (u64)
+ * 0x30 - Offset and length (u64 each) of every patched range, in the order they were patched
+ * Bytes of every range before it was patched, one after another
+ * Bytes of every range in the patched file, one after another
+ * 
+ */
+
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bars-io.h"
+#include "context.h"
+
+#define BARSPATCHER_PLAN_VERSION 2
+
+//Size of the plan file header and of each range in the plan file
+#define BARSPATCHER_PLAN_HEADER_SIZE 0x30
+#define BARSPATCHER_PLAN_RANGE_SIZE 0x10
+
+//Plan file header fields
+struct barspatcher_plan_header_t {
+    uint32_t range_count;
+    //Size of the BARS file
+    uint64_t bars_size;
+    //Digests of the ranges in the input and in the patched BARS file, see barspatcher_rangesDigest
+    uint64_t input_digest;
+    uint64_t output_digest;
+    //Size of each of the two byte blocks
+    uint64_t data_size;
+};
+
+struct barspatcher_plan_t {
+    barspatcher_plan_header_t header;
+    //Whole plan file, the byte pointers below point into it
+    unsigned char* file_data;
+    //Patched ranges
+    barspatcher_range_list_t ranges;
+    const unsigned char* input_bytes;
+    const unsigned char* output_bytes;
+};
+
+//Frees the plan.
+void barspatcher_planFree(barspatcher_plan_t* plan) {
+    free(plan->file_data);
+    barspatcher_rangesFree(&plan->ranges);
+    memset(plan, 0, sizeof(barspatcher_plan_t));
+}
+
+/*
+ * Writes the ranges patched by the last apply of a context to a plan file.
+ * The data of the context is restored and patched again to get the digest of the input, it is the same afterwards.
+ * 
+ * Returns 0 on success, and 1 on error.
+ * 
+ */
+bool barspatcher_planWrite(barspatcher_context_t* ctx, const char* plan_filename) {
+    unsigned char* data = ctx->input.data;
+    const barspatcher_range_list_t* ranges = &ctx->patched_ranges;
+    
+    barspatcher_plan_header_t header;
+    header.range_count = ranges->count;
+    header.bars_size = ctx->input.size;
+    header.data_size = ctx->saved_size;
+    header.output_digest = barspatcher_rangesDigest(data, ranges);
+    
+    //Bytes of every range in the patched data
+    unsigned char* output_bytes = (unsigned char*)malloc(header.data_size + 1);
+    if(output_bytes == NULL) return 1;
+    
+    uint64_t position = 0;
+    for(uint32_t i=0; i < ranges->count; i++) {
+        memcpy(output_bytes + position, data + ranges->ranges[i].offset, ranges->ranges[i].length);
+        position += ranges->ranges[i].length;
+    }
+    
+    //Put the input bytes back in reverse order for the input digest, then patch the data again
+    for(uint32_t i = ranges->count; i > 0; i--) {
+        position -= ranges->ranges[i-1].length;
+        memcpy(data + ranges->ranges[i-1].offset, ctx->saved + position, ranges->ranges[i-1].length);
+    }
+    header.input_digest = barspatcher_rangesDigest(data, ranges);
+    for(uint32_t i=0; i < ranges->count; i++) {
+        memcpy(data + ranges->ranges[i].offset, output_bytes + position, ranges->ranges[i].length);
+        position += ranges->ranges[i].length;
+    }
+    
+    char* temp_filename = (char*)malloc(strlen(plan_filename) + 5);
+    FILE* file = NULL;
+    
+    if(temp_filename != NULL) {
+        strcpy(temp_filename, plan_filename);
+        strcat(temp_filename, ".tmp");
+        file = fopen(temp_filename, "wb");
+    }
+    
+    if(file == NULL) {
+        free(output_bytes);
+        free(temp_filename);
+        return 1;
+    }
+    
+    unsigned char header_data[BARSPATCHER_PLAN_HEADER_SIZE];
+    memset(header_data, 0, sizeof(header_data));
+    memcpy(header_data, "BPPL", 4);
+    barspatcher_store<uint32_t, BARSPATCHER_LITTLE_ENDIAN>(header_data + 0x04, BARSPATCHER_PLAN_VERSION);
+    barspatcher_store<uint32_t, BARSPATCHER_LITTLE_ENDIAN>(header_data + 0x08, header.range_count);
+    barspatcher_store<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(header_data + 0x10, header.bars_size);
+    barspatcher_store<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(header_data + 0x18, header.input_digest);
+    barspatcher_store<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(header_data + 0x20, header.output_digest);
+    barspatcher_store<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(header_data + 0x28, header.data_size);
+    
+    bool write_error = (fwrite(header_data, BARSPATCHER_PLAN_HEADER_SIZE, 1, file) != 1);
+    for(uint32_t i=0; i < ranges->count && !write_error; i++) {
+        unsigned char range_data[BARSPATCHER_PLAN_RANGE_SIZE];
+        barspatcher_store<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(range_data, ranges->ranges[i].offset);
+        barspatcher_store<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(range_data + 8, ranges->ranges[i].length);
+        write_error = (fwrite(range_data, BARSPATCHER_PLAN_RANGE_SIZE, 1, file) != 1);
+    }
+    if(!write_error && header.data_size > 0) write_error = (fwrite(ctx->saved, 1, header.data_size, file) != header.data_size);
+    if(!write_error && header.data_size > 0) write_error = (fwrite(output_bytes, 1, header.data_size, file) != header.data_size);
+    
+    if(fclose(file) != 0) write_error = 1;
+    if(!write_error) write_error = (rename(temp_filename, plan_filename) != 0);
+    if(write_error) remove(temp_filename);
+    
+    free(output_bytes);
+    free(temp_filename);
+    
+    return write_error;
+}
+
+/*
+ * Reads a plan file.
+ * 
+ * Returns:
+ * 0 - The plan was read
+ * 1 - Memory allocation error
+ * 2 - The file could not be read or is not a valid plan file
+ * 
+ */
+unsigned char barspatcher_planRead(barspatcher_plan_t* plan, const char* plan_filename) {
+    memset(plan, 0, sizeof(barspatcher_plan_t));
+    
+    FILE* file = fopen(plan_filename, "rb");
+    if(file == NULL) {
+        perror(plan_filename);
+        return 2;
+    }
+    
+    //Read the whole file at once
+    uint64_t file_size = 0;
+    if(fseek(file, 0, SEEK_END) == 0) file_size = ftell(file);
+    
+    if(file_size < BARSPATCHER_PLAN_HEADER_SIZE || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return 2;
+    }
+    
+    plan->file_data = (unsigned char*)malloc(file_size);
+    if(plan->file_data == NULL) {
+        fclose(file);
+        return 1;
+    }
+    
+    bool read_error = (fread(plan->file_data, 1, file_size, file) != file_size);
+    fclose(file);
+    
+    const unsigned char* data = plan->file_data;
+    if(read_error || !barspatcher_hasMagic(data, 0, "BPPL") || barspatcher_load<uint32_t, BARSPATCHER_LITTLE_ENDIAN>(data + 0x04) != BARSPATCHER_PLAN_VERSION) {
+        barspatcher_planFree(plan);
+        return 2;
+    }
+    
+    barspatcher_plan_header_t* header = &plan->header;
+    header->range_count = barspatcher_load<uint32_t, BARSPATCHER_LITTLE_ENDIAN>(data + 0x08);
+    header->bars_size = barspatcher_load<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(data + 0x10);
+    header->input_digest = barspatcher_load<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(data + 0x18);
+    header->output_digest = barspatcher_load<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(data + 0x20);
+    header->data_size = barspatcher_load<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(data + 0x28);
+    
+    //Check the sizes, and that every range is inside the BARS file
+    uint64_t ranges_size = (uint64_t)header->range_count * BARSPATCHER_PLAN_RANGE_SIZE;
+    if(header->data_size > file_size || BARSPATCHER_PLAN_HEADER_SIZE + ranges_size + header->data_size * 2 != file_size) {
+        barspatcher_planFree(plan);
+        return 2;
+    }
+    
+    plan->input_bytes = data + BARSPATCHER_PLAN_HEADER_SIZE + ranges_size;
+    plan->output_bytes = plan->input_bytes + header->data_size;
+    
+    uint64_t total_length = 0;
+    for(uint32_t i=0; i < header->range_count; i++) {
+        const unsigned char* range_data = data + BARSPATCHER_PLAN_HEADER_SIZE + (uint64_t)i * BARSPATCHER_PLAN_RANGE_SIZE;
+        uint64_t offset = barspatcher_load<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(range_data);
+        uint64_t length = barspatcher_load<uint64_t, BARSPATCHER_LITTLE_ENDIAN>(range_data + 8);
+        
+        if(offset > header->bars_size || length > header->bars_size - offset) {
+            barspatcher_planFree(plan);
+            return 2;
+        }
+        if(barspatcher_rangesAdd(&plan->ranges, offset, length)) {
+            barspatcher_planFree(plan);
+            return 1;
+        }
+        total_length += length;
+    }
+    
+    if(total_length != header->data_size) {
+        barspatcher_planFree(plan);
+        return 2;
+    }
+    
+    return 0;
+}
+
+/*
+ * Applies a patch plan to a BARS file, or reverts it, without reading any BWAV files.
+ * 
+ * plan_filename - Plan file written by barspatcher_run
+ * bars_input_filename - BARS file to apply the plan to, or to revert it from
+ * bars_output_filename - Path for the output BARS file, can be the same as the input file
+ * revert - 0 to apply the plan to an unpatched BARS file, 1 to restore the unpatched BARS file from a patched one
+ * 
+ * An input file that already has the result of the operation is written to the output unchanged.
+ * 
+ * Returns 0 on success, and barspatcher_run error codes on errors.
+ * 
+ */
+unsigned char barspatcher_runPlan(bool verbose, const char* plan_filename, const char* bars_input_filename, const char* bars_output_filename, bool revert) {
+    barspatcher_plan_t plan;
+    {
+        unsigned char plan_res = barspatcher_planRead(&plan, plan_filename);
+        if(plan_res == 1) {
+            printf("Could not allocate memory for the patch plan.\n");
+            return 100;
+        }
+        if(plan_res != 0) return 219;
+    }
+    
+    barspatcher_bars_input_t input;
+    {
+        unsigned char input_res = barspatcher_inputOpen(&input, bars_input_filename);
+        if(input_res != 0) {
+            barspatcher_planFree(&plan);
+            return input_res;
+        }
+    }
+    
+    const barspatcher_range_list_t* ranges = &plan.ranges;
+    uint64_t from_digest = (revert ? plan.header.output_digest : plan.header.input_digest);
+    uint64_t to_digest = (revert ? plan.header.input_digest : plan.header.output_digest);
+    uint64_t digest = (input.size == plan.header.bars_size ? barspatcher_rangesDigest(input.data, ranges) : 0);
+    
+    if(input.size != plan.header.bars_size || (digest != from_digest && digest != to_digest)) {
+        printf("The patch plan was not made for this BARS file.\n");
+        barspatcher_inputClose(&input);
+        barspatcher_planFree(&plan);
+        return 218;
+    }
+    
+    if(digest == to_digest) {
+        printf("The BARS file is already %s.\n", (revert ? "unpatched" : "patched"));
+    }
+    else if(revert) {
+        uint64_t position = plan.header.data_size;
+        for(uint32_t i = ranges->count; i > 0; i--) {
+            position -= ranges->ranges[i-1].length;
+            memcpy(input.data + ranges->ranges[i-1].offset, plan.input_bytes + position, ranges->ranges[i-1].length);
+        }
+    }
+    else {
+        uint64_t position = 0;
+        for(uint32_t i=0; i < ranges->count; i++) {
+            memcpy(input.data + ranges->ranges[i].offset, plan.output_bytes + position, ranges->ranges[i].length);
+            position += ranges->ranges[i].length;
+        }
+    }
+    
+    if(verbose) printf("%s %u ranges, %llu bytes.\n", (revert ? "Reverted" : "Patched"), ranges->count, (unsigned long long)plan.header.data_size);
+    
+    unsigned char output_res = barspatcher_outputWrite(input.data, input.size, bars_input_filename, bars_output_filename, ranges);
+    
+    barspatcher_inputClose(&input);
+    barspatcher_planFree(&plan);
+    
+    return output_res;
+}
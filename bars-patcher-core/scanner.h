@@ -0,0 +1,433 @@
+//Vectorized CRC32 search kernels for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Used when the BARS structure is not recognized and the whole file has to be searched.
+//Every kernel checks all CRC32 values in the index in a single pass and reports each (pattern, offset) hit
+//to the index in the same order as barspatcher_crcIndexScan, so the patching step doesn't care which kernel ran.
+//
+//For small sets, the vector kernels compare the first and last byte of every pattern against a full vector of positions
+//at once and only verify the full 4 bytes for candidates. Their cost grows with the number of patterns, so bigger sets
+//use the 16-bit filter bitmap of the index instead, which costs the same no matter how many patterns there are.
+//With AVX2 the filter bits of 16 positions are gathered at once and only positions that pass it probe the index.
+//Without AVX2 there is no gather instruction, so bigger sets use the scalar kernel, which checks the filter once per position.
+//
+//Big files can be split into contiguous parts that are searched on several threads. Each part also reads the 3 bytes
+//after it, so every position is checked by exactly one thread. Threads collect hits in their own lists, which are
+//merged into the index in part order afterwards, so the hits of every key stay in offset order.
+
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc-index.h"
+
+#if defined BARSPATCHER_VERSION_PC
+#include <pthread.h>
+#ifndef BARSPATCHER_HAVE_THREADS
+#define BARSPATCHER_HAVE_THREADS
+#endif
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define BARSPATCHER_SCAN_X86
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BARSPATCHER_SCAN_NEON
+#endif
+
+//Highest number of patterns that the vector kernels are used for
+#ifndef BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT
+#define BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT 8
+#endif
+
+//Smallest part of the data that is searched on its own thread
+#ifndef BARSPATCHER_SCAN_PARALLEL_MIN_SIZE
+#define BARSPATCHER_SCAN_PARALLEL_MIN_SIZE (4 * 1024 * 1024)
+#endif
+
+//Scan kernels
+#define BARSPATCHER_SCAN_KERNEL_SCALAR 0
+#define BARSPATCHER_SCAN_KERNEL_SSE2 1
+#define BARSPATCHER_SCAN_KERNEL_AVX2 2
+#define BARSPATCHER_SCAN_KERNEL_NEON 3
+#define BARSPATCHER_SCAN_KERNEL_AVX2_FILTER 4
+
+//Patterns in the form used by the vector kernels
+struct barspatcher_scan_patterns_t {
+    uint32_t count;
+    uint32_t keys[BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT];
+    uint32_t slots[BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT];
+    unsigned char first[BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT];
+    unsigned char last[BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT];
+};
+
+//Returns the name of a scan kernel.
+const char* barspatcher_scanKernelName(unsigned char kernel) {
+    switch(kernel) {
+        case BARSPATCHER_SCAN_KERNEL_SSE2: return "SSE2";
+        case BARSPATCHER_SCAN_KERNEL_AVX2: return "AVX2";
+        case BARSPATCHER_SCAN_KERNEL_NEON: return "NEON";
+        case BARSPATCHER_SCAN_KERNEL_AVX2_FILTER: return "AVX2 filter";
+    }
+    return "scalar";
+}
+
+//Chooses the fastest kernel supported by this CPU for pattern_count patterns.
+unsigned char barspatcher_scanSelectKernel(uint32_t pattern_count) {
+    if(pattern_count == 0) return BARSPATCHER_SCAN_KERNEL_SCALAR;
+    
+    if(pattern_count > BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT) {
+        #if defined(BARSPATCHER_SCAN_X86)
+        if(__builtin_cpu_supports("avx2")) return BARSPATCHER_SCAN_KERNEL_AVX2_FILTER;
+        #endif
+        return BARSPATCHER_SCAN_KERNEL_SCALAR;
+    }
+    
+    #if defined(BARSPATCHER_SCAN_X86)
+    if(__builtin_cpu_supports("avx2")) return BARSPATCHER_SCAN_KERNEL_AVX2;
+    if(__builtin_cpu_supports("sse2")) return BARSPATCHER_SCAN_KERNEL_SSE2;
+    #elif defined(BARSPATCHER_SCAN_NEON)
+    return BARSPATCHER_SCAN_KERNEL_NEON;
+    #endif
+    
+    return BARSPATCHER_SCAN_KERNEL_SCALAR;
+}
+
+//Verifies the candidate positions in mask (one bit per position starting at pos) for a single pattern.
+//Returns 0 on success, and 1 on memory error.
+static inline bool barspatcher_scanVerify(barspatcher_crc_index_t* index, const barspatcher_scan_patterns_t* patterns, uint32_t p, const unsigned char* data, uint64_t pos, uint64_t mask, unsigned char bits_per_position) {
+    uint64_t position_bits = (1ULL << bits_per_position) - 1;
+    
+    while(mask) {
+        uint32_t position = __builtin_ctzll(mask) / bits_per_position;
+        if(barspatcher_crcKey(data + pos + position) == patterns->keys[p]) {
+            if(barspatcher_crcIndexAddHit(index, patterns->slots[p], pos + position)) return 1;
+        }
+        
+        //Clear all bits of this position
+        mask &= ~(position_bits << (position * bits_per_position));
+    }
+    
+    return 0;
+}
+
+#if defined(BARSPATCHER_SCAN_X86)
+
+//SSE2 kernel, 16 positions per step. Returns the position where the scalar tail has to continue, or -1 on memory error.
+__attribute__((target("sse2")))
+int64_t barspatcher_scanSSE2(barspatcher_crc_index_t* index, const barspatcher_scan_patterns_t* patterns, const unsigned char* data, uint64_t size) {
+    __m128i first[BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT];
+    __m128i last[BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT];
+    for(uint32_t p=0; p < patterns->count; p++) {
+        first[p] = _mm_set1_epi8(patterns->first[p]);
+        last[p] = _mm_set1_epi8(patterns->last[p]);
+    }
+    
+    uint64_t pos = 0;
+    for(; pos + 16 + 3 <= size; pos += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*)(data + pos));
+        __m128i block_last = _mm_loadu_si128((const __m128i*)(data + pos + 3));
+        
+        for(uint32_t p=0; p < patterns->count; p++) {
+            uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first[p]), _mm_cmpeq_epi8(block_last, last[p])));
+            if(mask && barspatcher_scanVerify(index, patterns, p, data, pos, mask, 1)) return -1;
+        }
+        
+        if(BARSPATCHER_SCAN_STOP_WHEN_FOUND && index->found == index->count) return size;
+    }
+    
+    return pos;
+}
+
+//AVX2 kernel, 32 positions per step. Returns the position where the scalar tail has to continue, or -1 on memory error.
+__attribute__((target("avx2")))
+int64_t barspatcher_scanAVX2(barspatcher_crc_index_t* index, const barspatcher_scan_patterns_t* patterns, const unsigned char* data, uint64_t size) {
+    __m256i first[BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT];
+    __m256i last[BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT];
+    for(uint32_t p=0; p < patterns->count; p++) {
+        first[p] = _mm256_set1_epi8(patterns->first[p]);
+        last[p] = _mm256_set1_epi8(patterns->last[p]);
+    }
+    
+    uint64_t pos = 0;
+    for(; pos + 32 + 3 <= size; pos += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(data + pos));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(data + pos + 3));
+        
+        for(uint32_t p=0; p < patterns->count; p++) {
+            uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first[p]), _mm256_cmpeq_epi8(block_last, last[p])));
+            if(mask && barspatcher_scanVerify(index, patterns, p, data, pos, mask, 1)) return -1;
+        }
+        
+        if(BARSPATCHER_SCAN_STOP_WHEN_FOUND && index->found == index->count) return size;
+    }
+    
+    return pos;
+}
+
+/*
+ * AVX2 filter kernel for any number of patterns, 16 positions per step.
+ * The lower 16 bits of the key at every position are the first two bytes there. They are made from two overlapping
+ * loads, and the filter bitmap of the index is read as 32-bit words with a gather, so bit (value & 31) of word
+ * (value >> 5) is the filter bit of the value. Only positions whose filter bit is set probe the index.
+ * 
+ * Returns the position where the scalar tail has to continue, or -1 on memory error.
+ * 
+ */
+__attribute__((target("avx2")))
+int64_t barspatcher_scanAVX2Filter(barspatcher_crc_index_t* index, const unsigned char* data, uint64_t size) {
+    const int* filter = (const int*)index->filter;
+    const __m256i bit_mask = _mm256_set1_epi32(31);
+    
+    uint64_t pos = 0;
+    for(; pos + 16 + 3 <= size; pos += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(data + pos));
+        __m128i next_bytes = _mm_loadu_si128((const __m128i*)(data + pos + 1));
+        
+        //Lower 16 bits of the keys at positions 0-7 and 8-15
+        __m256i values_low = _mm256_cvtepu16_epi32(_mm_unpacklo_epi8(bytes, next_bytes));
+        __m256i values_high = _mm256_cvtepu16_epi32(_mm_unpackhi_epi8(bytes, next_bytes));
+        
+        __m256i words_low = _mm256_i32gather_epi32(filter, _mm256_srli_epi32(values_low, 5), 4);
+        __m256i words_high = _mm256_i32gather_epi32(filter, _mm256_srli_epi32(values_high, 5), 4);
+        
+        //Move the filter bit of every position to the sign bit
+        words_low = _mm256_sllv_epi32(words_low, _mm256_sub_epi32(bit_mask, _mm256_and_si256(values_low, bit_mask)));
+        words_high = _mm256_sllv_epi32(words_high, _mm256_sub_epi32(bit_mask, _mm256_and_si256(values_high, bit_mask)));
+        uint32_t mask = _mm256_movemask_ps(_mm256_castsi256_ps(words_low)) | (_mm256_movemask_ps(_mm256_castsi256_ps(words_high)) << 8);
+        
+        while(mask) {
+            uint32_t position = __builtin_ctz(mask);
+            mask &= mask - 1;
+            
+            int64_t slot = barspatcher_crcIndexFind(index, barspatcher_crcKey(data + pos + position));
+            if(slot >= 0 && barspatcher_crcIndexAddHit(index, slot, pos + position)) return -1;
+        }
+        
+        if(BARSPATCHER_SCAN_STOP_WHEN_FOUND && index->found == index->count) return size;
+    }
+    
+    return pos;
+}
+
+#endif
+
+#if defined(BARSPATCHER_SCAN_NEON)
+
+//NEON kernel, 16 positions per step. Returns the position where the scalar tail has to continue, or -1 on memory error.
+int64_t barspatcher_scanNEON(barspatcher_crc_index_t* index, const barspatcher_scan_patterns_t* patterns, const unsigned char* data, uint64_t size) {
+    uint8x16_t first[BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT];
+    uint8x16_t last[BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT];
+    for(uint32_t p=0; p < patterns->count; p++) {
+        first[p] = vdupq_n_u8(patterns->first[p]);
+        last[p] = vdupq_n_u8(patterns->last[p]);
+    }
+    
+    uint64_t pos = 0;
+    for(; pos + 16 + 3 <= size; pos += 16) {
+        uint8x16_t block_first = vld1q_u8(data + pos);
+        uint8x16_t block_last = vld1q_u8(data + pos + 3);
+        
+        for(uint32_t p=0; p < patterns->count; p++) {
+            uint8x16_t eq = vandq_u8(vceqq_u8(block_first, first[p]), vceqq_u8(block_last, last[p]));
+            //Narrow the byte mask to 4 bits per position
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+            if(mask && barspatcher_scanVerify(index, patterns, p, data, pos, mask, 4)) return -1;
+        }
+        
+        if(BARSPATCHER_SCAN_STOP_WHEN_FOUND && index->found == index->count) return size;
+    }
+    
+    return pos;
+}
+
+#endif
+
+/*
+ * Searches data for every CRC32 value in the index and adds all hits to the index.
+ * 
+ * kernel - One of BARSPATCHER_SCAN_KERNEL_*, should be chosen with barspatcher_scanSelectKernel
+ * 
+ * Returns 0 on success, and 1 on memory error.
+ * 
+ */
+bool barspatcher_scanWithKernel(barspatcher_crc_index_t* index, const unsigned char* data, uint64_t size, unsigned char kernel) {
+    #if defined(BARSPATCHER_SCAN_X86)
+    if(kernel == BARSPATCHER_SCAN_KERNEL_AVX2_FILTER && index->count > 0) {
+        int64_t tail = barspatcher_scanAVX2Filter(index, data, size);
+        if(tail < 0) return 1;
+        return ((uint64_t)tail < size ? barspatcher_crcIndexScanFrom(index, data, size, tail) : 0);
+    }
+    #endif
+    
+    if(kernel == BARSPATCHER_SCAN_KERNEL_SCALAR || kernel == BARSPATCHER_SCAN_KERNEL_AVX2_FILTER || index->count > BARSPATCHER_SCAN_VECTOR_PATTERN_LIMIT) {
+        return barspatcher_crcIndexScan(index, data, size);
+    }
+    
+    //Collect the patterns from the index
+    barspatcher_scan_patterns_t patterns;
+    patterns.count = 0;
+    
+    for(uint32_t slot=0; slot < index->capacity; slot++) {
+        if(!index->used[slot]) continue;
+        
+        unsigned char key_bytes[4];
+        memcpy(key_bytes, &index->keys[slot], 4);
+        
+        patterns.keys[patterns.count] = index->keys[slot];
+        patterns.slots[patterns.count] = slot;
+        patterns.first[patterns.count] = key_bytes[0];
+        patterns.last[patterns.count] = key_bytes[3];
+        patterns.count++;
+    }
+    
+    int64_t tail = 0;
+    
+    switch(kernel) {
+        #if defined(BARSPATCHER_SCAN_X86)
+        case BARSPATCHER_SCAN_KERNEL_SSE2: tail = barspatcher_scanSSE2(index, &patterns, data, size); break;
+        case BARSPATCHER_SCAN_KERNEL_AVX2: tail = barspatcher_scanAVX2(index, &patterns, data, size); break;
+        #endif
+        #if defined(BARSPATCHER_SCAN_NEON)
+        case BARSPATCHER_SCAN_KERNEL_NEON: tail = barspatcher_scanNEON(index, &patterns, data, size); break;
+        #endif
+        default: break;
+    }
+    
+    if(tail < 0) return 1;
+    
+    //Finish the last positions that don't fill a full vector
+    if((uint64_t)tail < size) return barspatcher_crcIndexScanFrom(index, data, size, tail);
+    
+    return 0;
+}
+
+//Searches data for every CRC32 value in the index with the fastest available kernel.
+//Returns 0 on success, and 1 on memory error.
+bool barspatcher_scan(barspatcher_crc_index_t* index, const unsigned char* data, uint64_t size) {
+    return barspatcher_scanWithKernel(index, data, size, barspatcher_scanSelectKernel(index->count));
+}
+
+//One part of a parallel search
+struct barspatcher_scan_part_t {
+    //Copy of the shared index with its own hit lists, the key table is only read
+    barspatcher_crc_index_t index;
+    const unsigned char* data;
+    uint64_t start;
+    uint64_t size;
+    unsigned char kernel;
+    bool error;
+};
+
+//Searches a single part of a parallel search.
+void* barspatcher_scanPartWorker(void* arg) {
+    barspatcher_scan_part_t* part = (barspatcher_scan_part_t*)arg;
+    part->error = barspatcher_scanWithKernel(&part->index, part->data + part->start, part->size, part->kernel);
+    return NULL;
+}
+
+//Returns the number of threads a parallel search of size bytes uses with at most threads threads.
+unsigned int barspatcher_scanThreadCount(uint64_t size, unsigned int threads) {
+    #if defined BARSPATCHER_HAVE_THREADS
+    uint64_t max_threads = size / BARSPATCHER_SCAN_PARALLEL_MIN_SIZE;
+    if(threads > max_threads) threads = max_threads;
+    return (threads > 0 ? threads : 1);
+    #else
+    (void)size;
+    (void)threads;
+    return 1;
+    #endif
+}
+
+/*
+ * Searches data for every CRC32 value in the index on several threads and adds all hits to the index.
+ * 
+ * The data is split into one contiguous part per thread, see barspatcher_scanThreadCount.
+ * Hits of every key are added in offset order, the same as with a single thread.
+ * 
+ * kernel - One of BARSPATCHER_SCAN_KERNEL_*, should be chosen with barspatcher_scanSelectKernel
+ * threads - Highest number of threads to use, should be given by barspatcher_workerCount
+ * 
+ * Returns 0 on success, and 1 on memory error.
+ * 
+ */
+bool barspatcher_scanParallel(barspatcher_crc_index_t* index, const unsigned char* data, uint64_t size, unsigned char kernel, unsigned int threads) {
+    threads = barspatcher_scanThreadCount(size, threads);
+    if(threads <= 1 || index->count == 0) return barspatcher_scanWithKernel(index, data, size, kernel);
+    
+    #if defined BARSPATCHER_HAVE_THREADS
+    barspatcher_scan_part_t* parts = (barspatcher_scan_part_t*)malloc(threads * sizeof(barspatcher_scan_part_t));
+    pthread_t* thread_ids = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    bool error = (parts == NULL || thread_ids == NULL);
+    unsigned int part_count = 0;
+    
+    //Every part gets its own hit lists, the keys and the filter are shared
+    uint64_t part_size = size / threads;
+    for(; part_count < threads && !error; part_count++) {
+        barspatcher_scan_part_t* part = &parts[part_count];
+        part->index = *index;
+        part->index.first_hit = (uint32_t*)malloc(index->capacity * sizeof(uint32_t));
+        part->index.last_hit = (uint32_t*)malloc(index->capacity * sizeof(uint32_t));
+        part->index.hits = NULL;
+        part->index.hits_count = 0;
+        part->index.hits_capacity = 0;
+        part->index.found = 0;
+        
+        if(part->index.first_hit == NULL || part->index.last_hit == NULL) {
+            free(part->index.first_hit);
+            free(part->index.last_hit);
+            error = 1;
+            break;
+        }
+        memset(part->index.first_hit, 0xFF, index->capacity * sizeof(uint32_t));
+        memset(part->index.last_hit, 0xFF, index->capacity * sizeof(uint32_t));
+        
+        //Positions from start up to the start of the next part, plus the 3 bytes that the last positions need
+        uint64_t end = (part_count == threads - 1 ? size : (part_count + 1) * part_size);
+        part->data = data;
+        part->start = part_count * part_size;
+        part->size = (end + 3 < size ? end + 3 : size) - part->start;
+        part->kernel = kernel;
+        part->error = 0;
+    }
+    
+    if(!error) {
+        //The calling thread searches the first part
+        unsigned int started = 1;
+        for(; started < part_count; started++) {
+            if(pthread_create(&thread_ids[started], NULL, barspatcher_scanPartWorker, &parts[started]) != 0) break;
+        }
+        
+        barspatcher_scanPartWorker(&parts[0]);
+        for(unsigned int p=1; p < started; p++) pthread_join(thread_ids[p], NULL);
+        //Parts whose thread could not be started are searched here
+        for(unsigned int p=started; p < part_count; p++) barspatcher_scanPartWorker(&parts[p]);
+        
+        //Merge the hits in part order
+        for(unsigned int p=0; p < part_count && !error; p++) {
+            barspatcher_crc_index_t* part_index = &parts[p].index;
+            error = parts[p].error;
+            
+            for(uint32_t h=0; h < part_index->hits_count && !error; h++) {
+                uint64_t offset = parts[p].start + part_index->hits[h].offset;
+                int64_t slot = barspatcher_crcIndexFind(index, barspatcher_crcKey(data + offset));
+                if(slot >= 0) error = barspatcher_crcIndexAddHit(index, slot, offset);
+            }
+        }
+    }
+    
+    for(unsigned int p=0; p < part_count; p++) {
+        free(parts[p].index.first_hit);
+        free(parts[p].index.last_hit);
+        free(parts[p].index.hits);
+    }
+    free(parts);
+    free(thread_ids);
+    
+    return error;
+    #else
+    return barspatcher_scanWithKernel(index, data, size, kernel);
+    #endif
+}
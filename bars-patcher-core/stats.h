@@ -0,0 +1,41 @@
+//Run statistics for BARS patcher
+//Copyright (C) 2020 I.C.
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+
+//Wall time and I/O counters of a patch run
+struct barspatcher_stats_t {
+    //Wall time of every phase in milliseconds
+    double list_ms;
+    double load_ms;
+    double locate_ms;
+    double patch_ms;
+    double write_ms;
+    //Wall time of the whole run, including opening the input BARS file
+    double total_ms;
+    
+    //BWAV files opened and bytes read from them
+    uint64_t files_opened;
+    uint64_t bytes_read;
+    //Bytes written into the output file, data that the kernel copied from the input file is not counted
+    uint64_t bytes_written;
+    //Bytes of BARS data searched for hashes, 0 if the BARS track table or the run state was used
+    uint64_t scan_bytes;
+    //Locations found for the original hashes of all tracks
+    uint64_t matches_found;
+    
+    uint64_t tracks_patched;
+    uint64_t tracks_skipped;
+};
+
+void barspatcher_statsInit(barspatcher_stats_t* stats) {
+    memset(stats, 0, sizeof(barspatcher_stats_t));
+}
+
+//Returns a monotonic time in milliseconds.
+double barspatcher_timeMs() {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
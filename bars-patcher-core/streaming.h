@@ -0,0 +1,368 @@
+//Streaming mode for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Patches BARS files of any size with a fixed amount of memory.
+//The input file is read in windows of a fixed size, every window is searched for the wanted CRC32 hashes,
+//all patches that overlap the window are applied, and the window is written to the output file.
+//
+//The last bytes of every window are kept and searched again with the next window,
+//so CRC32 hashes that cross a window boundary are found and patch locations before them are not written out too early.
+
+#pragma once
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+
+#include "crc-index.h"
+#include "scanner.h"
+#include "tracks.h"
+
+//Default size of the streaming window (4MB)
+#define BARSPATCHER_STREAM_DEFAULT_WINDOW 4194304
+
+//Smallest allowed size of the streaming window
+#define BARSPATCHER_STREAM_MIN_WINDOW 4096
+
+//Bytes kept from the end of every window.
+//8 bytes between the start of a BWAV header and its CRC32 hash, and 3 bytes for hashes that cross the window boundary.
+#define BARSPATCHER_STREAM_OVERLAP 11
+
+//Patch that was found in the stream and still has to be written
+struct barspatcher_stream_patch_t {
+    //Offset of the patch in the BARS file
+    uint64_t offset;
+    //Track with the patch data
+    uint32_t track;
+};
+
+//Hit reported by the search in the current window
+struct barspatcher_stream_hit_t {
+    uint64_t offset;
+    uint32_t slot;
+};
+
+static int barspatcher_streamHitCompare(const void* a, const void* b) {
+    uint64_t offset_a = ((const barspatcher_stream_hit_t*)a)->offset;
+    uint64_t offset_b = ((const barspatcher_stream_hit_t*)b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+/*
+ * BARS patcher function for streaming mode
+ * 
+ * Works like barspatcher_run, but never holds more than window_size bytes of the BARS file in memory.
+ * The BARS structure is not parsed in this mode, the whole file is always searched.
+ * 
+ * window_size - Bytes of BARS data read at once, BARSPATCHER_STREAM_DEFAULT_WINDOW can be used as a default
+ * workers - Number of threads used for loading BWAV headers, 0 for one per CPU core
+ * manifest_filename - Cache of original BWAV headers that is created or updated, NULL to always read the original files
+ * event_callback, event_user_data - Same as for barspatcher_run
+ * 
+ * The output is written to a temporary file next to the output file first, and then moved to the output path,
+ * so the output path can be the same as the input path.
+ * 
+ * Returns the same codes as barspatcher_run.
+ * 
+ */
+unsigned char barspatcher_runStreaming(bool verbose, const char* og_stream_dirname, const char* mod_stream_dirname, const char* bars_input_filename, const char* bars_output_filename, uint64_t window_size, unsigned int workers = 1, const char* manifest_filename = NULL, barspatcher_event_callback_t event_callback = NULL, void* event_user_data = NULL) {
+    if(window_size < BARSPATCHER_STREAM_MIN_WINDOW) window_size = BARSPATCHER_STREAM_MIN_WINDOW;
+    
+    //Open input BARS file
+    std::ifstream ifile;
+    ifile.open(bars_input_filename, std::ios::in | std::ios::binary | std::ios::ate);
+    if(!ifile.is_open()) {
+        perror(bars_input_filename);
+        return 255;
+    }
+    
+    uint64_t bars_size = ifile.tellg();
+    ifile.seekg(0);
+    
+    //Read mod stream directory listing and BWAV headers
+    barspatcher_name_list_t mod_dir_list;
+    barspatcher_nameListInit(&mod_dir_list);
+    {
+        unsigned char list_res = barspatcher_listModDir(mod_stream_dirname, &mod_dir_list);
+        if(list_res != 0) return list_res;
+    }
+    
+    uint64_t patched_files = 0, skipped_files = 0;
+    
+    barspatcher_events_t events;
+    barspatcher_eventsInit(&events, event_callback, event_user_data, verbose);
+    
+    barspatcher_track_t* tracks;
+    uint64_t track_count;
+    {
+        unsigned char tracks_res = barspatcher_loadTracks(og_stream_dirname, mod_stream_dirname, &mod_dir_list, &tracks, &track_count, &skipped_files, workers, manifest_filename, &events);
+        barspatcher_eventsFlush(&events);
+        
+        if(tracks_res != 0) {
+            barspatcher_eventsFree(&events);
+            barspatcher_nameListFree(&mod_dir_list);
+            return tracks_res;
+        }
+    }
+    
+    if(verbose) {
+        for(uint64_t t=0; t < track_count; t++) printf("%s: Original file hash: 0x%08X\n", tracks[t].name, tracks[t].og_crc32);
+    }
+    
+    //CRC32 index, first track of every index slot, and number of patches written for every track
+    barspatcher_crc_index_t crc_index;
+    bool memory_error = barspatcher_crcIndexInit(&crc_index, track_count);
+    
+    //Temporary output path
+    char* tmp_output_filename = NULL;
+    uint32_t* slot_tracks = NULL;
+    uint32_t* patches_written = NULL;
+    unsigned char* window = NULL;
+    barspatcher_stream_hit_t* window_hits = NULL;
+    uint32_t window_hits_capacity = 0;
+    barspatcher_stream_patch_t* active_patches = NULL;
+    uint32_t active_count = 0, active_capacity = 0;
+    
+    if(!memory_error) {
+        slot_tracks = (uint32_t*)malloc(crc_index.capacity * sizeof(uint32_t));
+        patches_written = (uint32_t*)calloc(track_count + 1, sizeof(uint32_t));
+        window = (unsigned char*)malloc(window_size + BARSPATCHER_STREAM_OVERLAP);
+        tmp_output_filename = (char*)malloc(strlen(bars_output_filename) + 5);
+        memory_error = (slot_tracks == NULL || patches_written == NULL || window == NULL || tmp_output_filename == NULL);
+    }
+    
+    if(!memory_error) {
+        strcpy(tmp_output_filename, bars_output_filename);
+        strcat(tmp_output_filename, ".tmp");
+    }
+    
+    if(!memory_error) {
+        //Tracks added first win when several tracks have the same original hash
+        for(uint64_t t=track_count; t > 0; t--) {
+            uint32_t slot = barspatcher_crcIndexInsert(&crc_index, tracks[t-1].crc_key);
+            slot_tracks[slot] = t-1;
+        }
+    }
+    
+    std::ofstream ofile;
+    if(!memory_error) {
+        ofile.open(tmp_output_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    }
+    
+    unsigned char res = 0;
+    if(memory_error) res = 100;
+    else if(!ofile.is_open()) {
+        perror(tmp_output_filename);
+        res = 249;
+    }
+    
+    //Absolute offset of the first byte in the window, and bytes currently in the window
+    uint64_t window_start = 0;
+    uint64_t window_length = 0;
+    //Absolute offset where the next search starts
+    uint64_t search_start = 0;
+    //End of the last accepted patch
+    uint64_t last_patch_start = 0, last_patch_end = 0;
+    uint32_t last_patch_track = 0;
+    
+    while(res == 0) {
+        //Fill the window
+        uint64_t read_length = window_size + BARSPATCHER_STREAM_OVERLAP - window_length;
+        if(read_length > bars_size - (window_start + window_length)) read_length = bars_size - (window_start + window_length);
+        
+        ifile.read((char*)window + window_length, read_length);
+        if(!ifile.good() && (uint64_t)ifile.gcount() != read_length) {
+            perror(bars_input_filename);
+            res = 254;
+            break;
+        }
+        
+        window_length += read_length;
+        uint64_t window_end = window_start + window_length;
+        bool last_window = (window_end >= bars_size);
+        
+        //Search the part of the window that wasn't searched yet
+        barspatcher_crcIndexClearHits(&crc_index);
+        if(window_end > search_start && barspatcher_scan(&crc_index, window + (search_start - window_start), window_end - search_start)) {
+            res = 100;
+            break;
+        }
+        
+        //Collect the hits in file order
+        if(crc_index.hits_count > window_hits_capacity) {
+            barspatcher_stream_hit_t* new_hits = (barspatcher_stream_hit_t*)realloc(window_hits, crc_index.hits_count * sizeof(barspatcher_stream_hit_t));
+            if(new_hits == NULL) {
+                res = 100;
+                break;
+            }
+            window_hits = new_hits;
+            window_hits_capacity = crc_index.hits_count;
+        }
+        
+        uint32_t window_hit_count = 0;
+        for(uint32_t slot=0; slot < crc_index.capacity; slot++) {
+            if(!crc_index.used[slot]) continue;
+            for(uint32_t hit = crc_index.first_hit[slot]; hit != BARSPATCHER_CRC_INDEX_NONE; hit = crc_index.hits[hit].next) {
+                window_hits[window_hit_count].offset = search_start + crc_index.hits[hit].offset;
+                window_hits[window_hit_count].slot = slot;
+                window_hit_count++;
+            }
+        }
+        
+        qsort(window_hits, window_hit_count, sizeof(barspatcher_stream_hit_t), barspatcher_streamHitCompare);
+        
+        for(uint32_t h=0; h < window_hit_count; h++) {
+            //The CRC32 hash is at 0x08 in the BWAV header
+            uint64_t bars_pos = window_hits[h].offset;
+            if(bars_pos < 0x08) continue;
+            
+            uint32_t t = slot_tracks[window_hits[h].slot];
+            barspatcher_track_t* track = &tracks[t];
+            
+            //Skip locations that were already overwritten by the previous patch
+            if(bars_pos >= last_patch_start && bars_pos + 4 <= last_patch_end) {
+                if(barspatcher_crcKey(tracks[last_patch_track].patch_data + (bars_pos - last_patch_start)) != track->crc_key) continue;
+            }
+            
+            //Found
+            uint64_t bars_bwav_offset = bars_pos - 0x08;
+            if(verbose) printf("%s: Found at 0x%08llX in BARS, ", track->name, (unsigned long long)bars_bwav_offset);
+            
+            if(bars_size - bars_bwav_offset < track->patch_length) {
+                barspatcher_event_t event;
+                memset(&event, 0, sizeof(event));
+                event.type = BARSPATCHER_EVENT_NO_SPACE;
+                event.name = track->name;
+                event.og_crc32 = track->og_crc32;
+                event.offset = bars_bwav_offset;
+                barspatcher_eventEmit(&events, &event);
+                continue;
+            }
+            
+            if(active_count >= active_capacity) {
+                uint32_t new_capacity = (active_capacity == 0 ? 16 : active_capacity * 2);
+                barspatcher_stream_patch_t* new_patches = (barspatcher_stream_patch_t*)realloc(active_patches, new_capacity * sizeof(barspatcher_stream_patch_t));
+                if(new_patches == NULL) {
+                    res = 100;
+                    break;
+                }
+                active_patches = new_patches;
+                active_capacity = new_capacity;
+            }
+            
+            active_patches[active_count].offset = bars_bwav_offset;
+            active_patches[active_count].track = t;
+            active_count++;
+            
+            last_patch_start = bars_bwav_offset;
+            last_patch_end = bars_bwav_offset + track->patch_length;
+            last_patch_track = t;
+            
+            if(verbose) printf("wrote patch.\n");
+            patches_written[t]++;
+        }
+        
+        if(res != 0) break;
+        
+        //Apply all patches that overlap the window
+        for(uint32_t p=0; p < active_count; p++) {
+            barspatcher_track_t* track = &tracks[active_patches[p].track];
+            uint64_t patch_start = active_patches[p].offset;
+            uint64_t patch_end = patch_start + track->patch_length;
+            
+            uint64_t copy_start = (patch_start > window_start ? patch_start : window_start);
+            uint64_t copy_end = (patch_end < window_end ? patch_end : window_end);
+            
+            if(copy_start < copy_end) {
+                memcpy(window + (copy_start - window_start), track->patch_data + (copy_start - patch_start), copy_end - copy_start);
+            }
+        }
+        
+        //Write everything except the bytes that are kept for the next window
+        uint64_t write_end = window_end;
+        if(!last_window) write_end = (window_end - window_start > BARSPATCHER_STREAM_OVERLAP ? window_end - BARSPATCHER_STREAM_OVERLAP : window_start);
+        
+        ofile.write((char*)window, write_end - window_start);
+        if(!ofile.good()) {
+            perror(tmp_output_filename);
+            res = 248;
+            break;
+        }
+        
+        if(last_window) break;
+        
+        //Move the kept bytes to the beginning of the window
+        memmove(window, window + (write_end - window_start), window_end - write_end);
+        window_length = window_end - write_end;
+        window_start = write_end;
+        search_start = (window_end >= 3 ? window_end - 3 : 0);
+        
+        //Forget patches that were completely written
+        uint32_t kept = 0;
+        for(uint32_t p=0; p < active_count; p++) {
+            if(active_patches[p].offset + tracks[active_patches[p].track].patch_length > window_start) active_patches[kept++] = active_patches[p];
+        }
+        active_count = kept;
+    }
+    
+    ifile.close();
+    if(ofile.is_open()) ofile.close();
+    
+    if(res == 0) {
+        barspatcher_event_t event;
+        memset(&event, 0, sizeof(event));
+        
+        for(uint64_t t=0; t < track_count; t++) {
+            event.type = (patches_written[t] > 0 ? BARSPATCHER_EVENT_PATCHED : BARSPATCHER_EVENT_SKIPPED);
+            event.reason = (patches_written[t] > 0 ? 0 : BARSPATCHER_SKIP_NOT_FOUND);
+            event.name = tracks[t].name;
+            event.og_crc32 = tracks[t].og_crc32;
+            event.locations = patches_written[t];
+            barspatcher_eventEmit(&events, &event);
+            
+            if(patches_written[t] > 0) patched_files++;
+            else skipped_files++;
+        }
+        
+        barspatcher_eventsFlush(&events);
+        
+        if(patched_files == 0) {
+            printf("Error: All tracks were skipped, BARS file was not patched.\n");
+            res = 200;
+        }
+    }
+    
+    barspatcher_eventsFree(&events);
+    
+    if(res == 100) printf("Could not allocate memory for streaming mode.\n");
+    
+    //Move the finished output into place
+    if(res == 0 && rename(tmp_output_filename, bars_output_filename) != 0) {
+        //Some filesystems can't rename over an existing file
+        if((remove(bars_output_filename) != 0 && errno != ENOENT) || rename(tmp_output_filename, bars_output_filename) != 0) {
+            perror(bars_output_filename);
+            res = 248;
+        }
+    }
+    
+    if(res != 0 && tmp_output_filename != NULL) remove(tmp_output_filename);
+    
+    //Free everything
+    free(tmp_output_filename);
+    free(window);
+    free(window_hits);
+    free(active_patches);
+    free(slot_tracks);
+    free(patches_written);
+    barspatcher_crcIndexFree(&crc_index);
+    barspatcher_freeTracks(tracks, track_count);
+    barspatcher_nameListFree(&mod_dir_list);
+    
+    if(res != 0) return res;
+    
+    if(event_callback == NULL) printf("%llu track%s patched, %llu track%s skipped.\n", (unsigned long long)patched_files, (patched_files == 1 ? "" : "s"), (unsigned long long)skipped_files, (skipped_files == 1 ? "" : "s"));
+    
+    return (skipped_files > 99 ? 99 : skipped_files);
+}
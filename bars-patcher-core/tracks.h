@@ -0,0 +1,914 @@
+//Mod stream directory listing and BWAV header loading for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Headers are loaded on a pool of worker threads where threads are available.
+//Workers only fill in a result for each directory entry, all messages are printed afterwards in directory order.
+
+#pragma once
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#if defined BARSPATCHER_VERSION_PC
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#define BARSPATCHER_HAVE_THREADS
+#endif
+
+#include "utils.h"
+#include "crc-index.h"
+#include "bars-reader.h"
+#include "directory.h"
+#include "uring.h"
+#include "manifest.h"
+#include "stats.h"
+#include "events.h"
+
+//Largest modded BWAV header that is patched into BARS files
+#define BARSPATCHER_MODBWAV_MEMBLOCK_SIZE 65536
+
+//Information about a track that will be patched into the BARS file
+struct barspatcher_track_t {
+    //File name in the mod stream directory
+    const char* name;
+    //CRC32 hash of the original file
+    uint32_t og_crc32;
+    //Raw CRC32 bytes of the original file as a CRC index key
+    uint32_t crc_key;
+    //Modded BWAV header to be written into BARS
+    uint32_t patch_length;
+    unsigned char* patch_data;
+};
+
+//Frees the patch data of all tracks and the track list.
+void barspatcher_freeTracks(barspatcher_track_t* tracks, uint64_t track_count) {
+    for(uint64_t i=0; i < track_count; i++) free(tracks[i].patch_data);
+    free(tracks);
+}
+
+/*
+ * Reads the names of all normal files in the mod stream directory.
+ * 
+ * mod_dir_list - Initialized with barspatcher_nameListInit, receives the file names. Free with barspatcher_nameListFree.
+ * 
+ * Returns 0 on success, and barspatcher_run error codes on errors.
+ * Nothing has to be freed after an error.
+ * 
+ */
+unsigned char barspatcher_listModDir(const char* mod_stream_dirname, barspatcher_name_list_t* mod_dir_list) {
+    barspatcher_dir_t mod_dir;
+    barspatcher_dir_reader_t mod_dir_reader;
+    if(barspatcher_dirOpen(&mod_dir, mod_stream_dirname)) {
+        perror(mod_stream_dirname);
+        return 229;
+    }
+    if(barspatcher_dirReaderOpen(&mod_dir_reader, &mod_dir)) {
+        perror(mod_stream_dirname);
+        barspatcher_dirClose(&mod_dir);
+        return 229;
+    }
+    
+    const char* mod_dir_entry;
+    unsigned char mod_dir_entry_type;
+    unsigned char res = 0;
+    
+    while((mod_dir_entry = barspatcher_dirNext(&mod_dir_reader, &mod_dir_entry_type)) != NULL) {
+        //Ignore entries that are not normal files
+        if(mod_dir_entry_type != DT_REG) continue;
+        
+        if(barspatcher_nameListAdd(mod_dir_list, mod_dir_entry)) {
+            printf("Could not allocate memory for the mod stream directory listing.\n");
+            res = 100;
+            break;
+        }
+    }
+    
+    if(res == 0 && mod_dir_reader.error) {
+        fprintf(stderr, "%s: %s\n", mod_stream_dirname, strerror(mod_dir_reader.error_number));
+        res = 229;
+    }
+    
+    barspatcher_dirReaderClose(&mod_dir_reader);
+    barspatcher_dirClose(&mod_dir);
+    
+    if(res == 0 && mod_dir_list->count == 0) {
+        printf("The mod directory has no files.\n");
+        res = 228;
+    }
+    
+    //Free everything that was previously allocated in this function
+    if(res != 0) barspatcher_nameListFree(mod_dir_list);
+    
+    return res;
+}
+
+//Results of loading a single track are BARSPATCHER_LOAD_* values, see events.h
+struct barspatcher_track_load_t {
+    //One of BARSPATCHER_LOAD_* or an error code
+    unsigned char status;
+    //errno value for errors
+    int error_number;
+    //Path of the file that caused the error
+    bool error_in_mod_file;
+    //Loaded track if status is BARSPATCHER_LOAD_OK
+    barspatcher_track_t track;
+    //Fixed header of the original file and the number of bytes in it, -1 if the original file wasn't read
+    unsigned char og_header[BARSPATCHER_BWAV_HEADER_SIZE];
+    int32_t og_header_length;
+    //1 if og_header was filled in from the manifest before loading, the original file is then not opened
+    bool og_cached;
+    //Files opened and bytes read while loading, for run statistics
+    uint8_t files_opened;
+    uint32_t bytes_read;
+};
+
+//Prepares a result for loading. Loaders skip results whose status is already set to a skip reason.
+void barspatcher_loadInit(barspatcher_track_load_t* result) {
+    result->status = BARSPATCHER_LOAD_OK;
+    result->error_number = 0;
+    result->error_in_mod_file = 0;
+    result->track.patch_data = NULL;
+    result->og_header_length = -1;
+    result->og_cached = 0;
+    result->files_opened = 0;
+    result->bytes_read = 0;
+}
+
+/*
+ * Checks the fixed headers of a modded BWAV file and its matching original BWAV file.
+ * 
+ * og_header, mod_header - First BARSPATCHER_BWAV_HEADER_SIZE bytes of both files
+ * og_length, mod_length - Number of bytes that could be read into each header, shorter files are not BWAV files
+ * name - File name that is stored in the loaded track
+ * result - result->status receives BARSPATCHER_LOAD_OK or the reason for skipping the track.
+ *          On success, everything in result->track except the patch data is filled in.
+ * 
+ */
+void barspatcher_checkHeaders(const unsigned char* og_header, uint64_t og_length, const unsigned char* mod_header, uint64_t mod_length, const char* name, barspatcher_track_load_t* result) {
+    //Make sure that both files are BWAV files
+    if(!barspatcher_isBwav(mod_header, mod_length)) {
+        result->status = BARSPATCHER_LOAD_MOD_NOT_BWAV;
+        return;
+    }
+    if(!barspatcher_isBwav(og_header, og_length)) {
+        result->status = BARSPATCHER_LOAD_OG_NOT_BWAV;
+        return;
+    }
+    
+    //Read the fields of both headers, each with the byte order of its file
+    barspatcher_bwav_fields_t og_fields, mod_fields;
+    barspatcher_bwavReadFields(og_header, &og_fields);
+    barspatcher_bwavReadFields(mod_header, &mod_fields);
+    
+    //Compare channel counts
+    if(og_fields.channel_count != mod_fields.channel_count) {
+        result->status = BARSPATCHER_LOAD_CHANNEL_MISMATCH;
+        return;
+    }
+    
+    //Size of BWAV file header to be written into BARS
+    uint32_t patch_length = BARSPATCHER_BWAV_HEADER_SIZE + BARSPATCHER_BWAV_CHANNEL_INFO_SIZE*mod_fields.channel_count;
+    if(patch_length > BARSPATCHER_MODBWAV_MEMBLOCK_SIZE) {
+        result->status = BARSPATCHER_LOAD_PATCH_TOO_BIG;
+        return;
+    }
+    
+    barspatcher_track_t* track = &result->track;
+    track->name = name;
+    //The CRC32 hash of the original file is used to find the location of the original file in the BARS file,
+    //the index key is the raw bytes so it matches the BARS data in either byte order
+    track->og_crc32 = og_fields.crc32;
+    track->crc_key = barspatcher_crcKey(og_header + 0x08);
+    track->patch_length = patch_length;
+    track->patch_data = NULL;
+    
+    result->status = BARSPATCHER_LOAD_OK;
+}
+
+//BWAV file handles for the header reads, plain file descriptors where pread is available
+#if defined BARSPATCHER_VERSION_PC
+typedef int barspatcher_bwav_file_t;
+#define BARSPATCHER_BWAV_FILE_NONE -1
+#else
+typedef FILE* barspatcher_bwav_file_t;
+#define BARSPATCHER_BWAV_FILE_NONE NULL
+#endif
+
+//Opens a BWAV file in a stream directory for reading. Returns 0 on success, and 1 on error with errno set.
+bool barspatcher_bwavOpen(barspatcher_bwav_file_t* file, const barspatcher_dir_t* dir, const char* name) {
+    #if defined BARSPATCHER_VERSION_PC
+    *file = openat(dir->fd, name, O_RDONLY | O_CLOEXEC);
+    return *file < 0;
+    #else
+    char* path = barspatcher_dirPath(dir, name);
+    if(path == NULL) return 1;
+    *file = fopen(path, "rb");
+    int open_errno = errno;
+    free(path);
+    errno = open_errno;
+    return *file == NULL;
+    #endif
+}
+
+void barspatcher_bwavClose(barspatcher_bwav_file_t file) {
+    #if defined BARSPATCHER_VERSION_PC
+    close(file);
+    #else
+    fclose(file);
+    #endif
+}
+
+//Reads up to length bytes at offset, less only at the end of the file.
+//Returns the number of bytes read, or -1 on error with errno set.
+int64_t barspatcher_bwavRead(barspatcher_bwav_file_t file, unsigned char* buffer, uint32_t length, uint64_t offset) {
+    #if defined BARSPATCHER_VERSION_PC
+    uint32_t done = 0;
+    while(done < length) {
+        ssize_t got = pread(file, buffer + done, length - done, offset + done);
+        if(got < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(got == 0) break;
+        done += got;
+    }
+    return done;
+    #else
+    if(fseek(file, offset, SEEK_SET) != 0) return -1;
+    size_t done = fread(buffer, 1, length, file);
+    if(done < length && ferror(file)) return -1;
+    return done;
+    #endif
+}
+
+/*
+ * Reads and checks the headers of a single modded BWAV file and its matching original BWAV file.
+ * Only the fixed header of the original file and the fixed header and channel info of the modded file are read.
+ * Doesn't print anything, so it can be called from multiple threads at once.
+ * 
+ * og_dir, mod_dir - Stream directories of both files
+ * name - File name in both directories, also stored in the loaded track
+ * result - Prepared with barspatcher_loadInit, receives the result.
+ *          result->track.patch_data is allocated if result->status is BARSPATCHER_LOAD_OK.
+ * 
+ */
+void barspatcher_loadTrack(const barspatcher_dir_t* og_dir, const barspatcher_dir_t* mod_dir, const char* name, barspatcher_track_load_t* result) {
+    if(result->status != BARSPATCHER_LOAD_OK) return;
+    
+    //Try opening original BWAV, unless its header is already known
+    barspatcher_bwav_file_t og_bwav = BARSPATCHER_BWAV_FILE_NONE;
+    if(!result->og_cached && barspatcher_bwavOpen(&og_bwav, og_dir, name)) {
+        //Skip if file doesn't exist
+        if(errno == ENOENT) {
+            result->status = BARSPATCHER_LOAD_NO_ORIGINAL;
+            return;
+        }
+        
+        //Error if the opening failed for any other reason
+        result->status = 239;
+        result->error_number = errno;
+        return;
+    }
+    if(!result->og_cached) result->files_opened++;
+    
+    //Try opening modded BWAV
+    barspatcher_bwav_file_t mod_bwav;
+    if(barspatcher_bwavOpen(&mod_bwav, mod_dir, name)) {
+        result->status = 238;
+        result->error_number = errno;
+        result->error_in_mod_file = 1;
+        if(!result->og_cached) barspatcher_bwavClose(og_bwav);
+        return;
+    }
+    result->files_opened++;
+    
+    //Read the fixed headers of both BWAV files
+    unsigned char mod_header[BARSPATCHER_BWAV_HEADER_SIZE];
+    
+    int64_t og_length = result->og_header_length;
+    if(!result->og_cached) og_length = barspatcher_bwavRead(og_bwav, result->og_header, BARSPATCHER_BWAV_HEADER_SIZE, 0);
+    int64_t mod_length = (og_length < 0 ? 0 : barspatcher_bwavRead(mod_bwav, mod_header, BARSPATCHER_BWAV_HEADER_SIZE, 0));
+    if(!result->og_cached && og_length > 0) result->bytes_read += og_length;
+    if(mod_length > 0) result->bytes_read += mod_length;
+    
+    //Check for read errors
+    if(og_length < 0 || mod_length < 0) {
+        //Which file has the error
+        bool which_error = (og_length < 0);
+        result->status = (which_error ? 237 : 236);
+        result->error_number = errno;
+        result->error_in_mod_file = !which_error;
+        
+        if(!result->og_cached) barspatcher_bwavClose(og_bwav);
+        barspatcher_bwavClose(mod_bwav);
+        return;
+    }
+    
+    if(!result->og_cached) {
+        barspatcher_bwavClose(og_bwav);
+        result->og_header_length = og_length;
+    }
+    
+    barspatcher_checkHeaders(result->og_header, og_length, mod_header, mod_length, name, result);
+    if(result->status != BARSPATCHER_LOAD_OK) {
+        barspatcher_bwavClose(mod_bwav);
+        return;
+    }
+    
+    //Keep the header for the patching step
+    barspatcher_track_t* track = &result->track;
+    track->patch_data = (unsigned char*)malloc(track->patch_length);
+    
+    if(track->patch_data == NULL) {
+        result->status = 100;
+        barspatcher_bwavClose(mod_bwav);
+        return;
+    }
+    
+    //Read exactly the channel info after the fixed header
+    memcpy(track->patch_data, mod_header, BARSPATCHER_BWAV_HEADER_SIZE);
+    uint32_t channel_info_length = track->patch_length - BARSPATCHER_BWAV_HEADER_SIZE;
+    int64_t channel_info_read = barspatcher_bwavRead(mod_bwav, track->patch_data + BARSPATCHER_BWAV_HEADER_SIZE, channel_info_length, BARSPATCHER_BWAV_HEADER_SIZE);
+    
+    if(channel_info_read < 0) {
+        result->status = 236;
+        result->error_number = errno;
+        result->error_in_mod_file = 1;
+    }
+    else {
+        result->bytes_read += channel_info_read;
+        if(channel_info_read < channel_info_length) result->status = BARSPATCHER_LOAD_MOD_TRUNCATED;
+    }
+    
+    barspatcher_bwavClose(mod_bwav);
+    
+    if(result->status != BARSPATCHER_LOAD_OK) {
+        free(track->patch_data);
+        track->patch_data = NULL;
+    }
+}
+
+//Shared state of the header loading workers
+struct barspatcher_load_job_t {
+    const barspatcher_dir_t* og_dir;
+    const barspatcher_dir_t* mod_dir;
+    const barspatcher_name_list_t* mod_dir_list;
+    barspatcher_track_load_t* results;
+    //Next entry to be loaded, taken atomically by the workers
+    uint64_t next_entry;
+};
+
+//Header loading worker, loads entries from the job until all entries are taken.
+void* barspatcher_loadWorker(void* arg) {
+    barspatcher_load_job_t* job = (barspatcher_load_job_t*)arg;
+    
+    while(1) {
+        uint64_t entry = __atomic_fetch_add(&job->next_entry, 1, __ATOMIC_RELAXED);
+        if(entry >= job->mod_dir_list->count) break;
+        
+        barspatcher_loadTrack(job->og_dir, job->mod_dir, barspatcher_nameListGet(job->mod_dir_list, entry), &job->results[entry]);
+    }
+    
+    return NULL;
+}
+
+//Returns the number of workers to use for a requested worker count. 0 means one worker per CPU core.
+unsigned int barspatcher_workerCount(unsigned int workers) {
+    #if defined BARSPATCHER_HAVE_THREADS
+    if(workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cpus > 0 ? cpus : 1);
+    }
+    return workers;
+    #else
+    (void)workers;
+    return 1;
+    #endif
+}
+
+#if defined BARSPATCHER_HAVE_URING
+
+//Entries that are loaded at once by the io_uring loader, two files are open for each entry
+#define BARSPATCHER_URING_BATCH_ENTRIES 128
+
+//State of one entry in an io_uring batch
+struct barspatcher_uring_load_t {
+    //File descriptors or negative errno values from opening
+    int og_fd;
+    int mod_fd;
+    //Bytes read or negative errno values from the last read
+    int32_t og_read;
+    int32_t mod_read;
+    unsigned char mod_header[BARSPATCHER_BWAV_HEADER_SIZE];
+};
+
+//Completion handler for the io_uring loader.
+//User data is the batch entry index times two, plus one for operations on the modded file.
+//Each stage of the loader reuses the field that the previous stage left its result in.
+void barspatcher_uringLoadComplete(void* context, uint64_t user_data, int32_t res) {
+    barspatcher_uring_load_t* batch = (barspatcher_uring_load_t*)context;
+    barspatcher_uring_load_t* state = &batch[user_data >> 1];
+    
+    if(user_data & 1) state->mod_read = res;
+    else state->og_read = res;
+}
+
+//Prepares a read of length bytes at offset into buffer.
+//Returns 0 on success, and 1 if the submission queue is full.
+static inline bool barspatcher_uringPrepareRead(barspatcher_uring_t* ring, int fd, unsigned char* buffer, uint32_t length, uint64_t offset, uint64_t user_data) {
+    io_uring_sqe* sqe = barspatcher_uringPrepare(ring, IORING_OP_READ, fd, user_data);
+    if(sqe == NULL) return 1;
+    
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    return 0;
+}
+
+/*
+ * Loads the headers of all entries with batched io_uring opens and reads, in batches of BARSPATCHER_URING_BATCH_ENTRIES.
+ * Each batch takes three submissions: open all files, read all fixed headers, and read exactly the channel info
+ * of all modded files that passed the checks. Results are the same as from barspatcher_loadTrack.
+ * 
+ * results - Prepared with barspatcher_loadInit
+ * loaded_out - Receives the number of entries from the start of the list that have their result
+ * 
+ * Returns 0 when every entry has its result, and 1 if io_uring can't be used or stopped working.
+ * The remaining entries still have to be loaded with barspatcher_loadTrack then. Entries that already have
+ * a result other than BARSPATCHER_LOAD_OK keep it, so barspatcher_loadTrack skips them.
+ * 
+ */
+bool barspatcher_uringLoadTracks(const barspatcher_dir_t* og_dir, const barspatcher_dir_t* mod_dir, const barspatcher_name_list_t* mod_dir_list, barspatcher_track_load_t* results, uint64_t* loaded_out) {
+    *loaded_out = 0;
+    
+    const uint8_t ops[] = {IORING_OP_OPENAT, IORING_OP_READ};
+    barspatcher_uring_t ring;
+    if(barspatcher_uringInit(&ring, BARSPATCHER_URING_BATCH_ENTRIES * 2, ops, sizeof(ops))) return 1;
+    
+    barspatcher_uring_load_t* batch = (barspatcher_uring_load_t*)malloc(BARSPATCHER_URING_BATCH_ENTRIES * sizeof(barspatcher_uring_load_t));
+    
+    if(batch == NULL || ring.entries < BARSPATCHER_URING_BATCH_ENTRIES * 2) {
+        free(batch);
+        barspatcher_uringFree(&ring);
+        return 1;
+    }
+    
+    bool failed = 0;
+    uint64_t first;
+    
+    for(first=0; first < mod_dir_list->count && !failed; first += BARSPATCHER_URING_BATCH_ENTRIES) {
+        uint32_t count = BARSPATCHER_URING_BATCH_ENTRIES;
+        if(mod_dir_list->count - first < count) count = mod_dir_list->count - first;
+        
+        //Open both files of every entry that still has to be loaded
+        for(uint32_t i=0; i < count && !failed; i++) {
+            barspatcher_track_load_t* result = &results[first + i];
+            batch[i].og_read = (result->og_cached ? -1 : -EIO);
+            batch[i].mod_read = -EIO;
+            if(result->status != BARSPATCHER_LOAD_OK) continue;
+            
+            for(uint32_t is_mod = result->og_cached; is_mod < 2 && !failed; is_mod++) {
+                io_uring_sqe* sqe = barspatcher_uringPrepare(&ring, IORING_OP_OPENAT, (is_mod ? mod_dir->fd : og_dir->fd), i*2 + is_mod);
+                failed = (sqe == NULL);
+                if(failed) break;
+                
+                sqe->addr = (uint64_t)(uintptr_t)barspatcher_nameListGet(mod_dir_list, first + i);
+                sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            }
+        }
+        if(!failed) failed = barspatcher_uringSubmitAndWait(&ring, barspatcher_uringLoadComplete, batch);
+        
+        for(uint32_t i=0; i < count; i++) {
+            batch[i].og_fd = batch[i].og_read;
+            batch[i].mod_fd = batch[i].mod_read;
+            results[first + i].files_opened = (batch[i].og_fd >= 0) + (batch[i].mod_fd >= 0);
+        }
+        
+        //Read the fixed headers of entries where the files are open
+        for(uint32_t i=0; i < count && !failed; i++) {
+            barspatcher_track_load_t* result = &results[first + i];
+            if(result->status != BARSPATCHER_LOAD_OK || batch[i].mod_fd < 0) continue;
+            if(!result->og_cached) {
+                if(batch[i].og_fd < 0) continue;
+                failed = barspatcher_uringPrepareRead(&ring, batch[i].og_fd, result->og_header, BARSPATCHER_BWAV_HEADER_SIZE, 0, i*2);
+            }
+            if(!failed) failed = barspatcher_uringPrepareRead(&ring, batch[i].mod_fd, batch[i].mod_header, BARSPATCHER_BWAV_HEADER_SIZE, 0, i*2 + 1);
+        }
+        if(!failed) failed = barspatcher_uringSubmitAndWait(&ring, barspatcher_uringLoadComplete, batch);
+        
+        //Check the headers and read exactly the channel info of the modded files that can be used
+        for(uint32_t i=0; i < count && !failed; i++) {
+            barspatcher_uring_load_t* state = &batch[i];
+            barspatcher_track_load_t* result = &results[first + i];
+            if(result->status != BARSPATCHER_LOAD_OK) continue;
+            
+            if(!result->og_cached && state->og_fd < 0) {
+                result->status = (state->og_fd == -ENOENT ? BARSPATCHER_LOAD_NO_ORIGINAL : 239);
+                result->error_number = -state->og_fd;
+                continue;
+            }
+            if(state->mod_fd < 0) {
+                result->status = 238;
+                result->error_number = -state->mod_fd;
+                result->error_in_mod_file = 1;
+                continue;
+            }
+            
+            if(result->og_cached) state->og_read = result->og_header_length;
+            else if(state->og_read > 0) result->bytes_read += state->og_read;
+            if(state->mod_read > 0) result->bytes_read += state->mod_read;
+            if(state->og_read < 0 || state->mod_read < 0) {
+                bool which_error = (state->og_read < 0);
+                result->status = (which_error ? 237 : 236);
+                result->error_number = -(which_error ? state->og_read : state->mod_read);
+                result->error_in_mod_file = !which_error;
+                continue;
+            }
+            result->og_header_length = state->og_read;
+            
+            barspatcher_checkHeaders(result->og_header, state->og_read, state->mod_header, state->mod_read, barspatcher_nameListGet(mod_dir_list, first + i), result);
+            if(result->status != BARSPATCHER_LOAD_OK) continue;
+            
+            barspatcher_track_t* track = &result->track;
+            track->patch_data = (unsigned char*)malloc(track->patch_length);
+            if(track->patch_data == NULL) {
+                result->status = 100;
+                continue;
+            }
+            
+            memcpy(track->patch_data, state->mod_header, BARSPATCHER_BWAV_HEADER_SIZE);
+            failed = barspatcher_uringPrepareRead(&ring, state->mod_fd, track->patch_data + BARSPATCHER_BWAV_HEADER_SIZE, track->patch_length - BARSPATCHER_BWAV_HEADER_SIZE, BARSPATCHER_BWAV_HEADER_SIZE, i*2 + 1);
+        }
+        if(!failed) failed = barspatcher_uringSubmitAndWait(&ring, barspatcher_uringLoadComplete, batch);
+        
+        for(uint32_t i=0; i < count; i++) {
+            barspatcher_track_load_t* result = &results[first + i];
+            
+            //If the ring stopped working in the middle of this batch, results that were already decided are kept
+            //and the entries that are still loading are loaded again without the ring
+            if(!failed && result->status == BARSPATCHER_LOAD_OK) {
+                int32_t channel_info_read = batch[i].mod_read;
+                if(channel_info_read < 0) {
+                    result->status = 236;
+                    result->error_number = -channel_info_read;
+                    result->error_in_mod_file = 1;
+                }
+                else {
+                    result->bytes_read += channel_info_read;
+                    if((uint32_t)channel_info_read < result->track.patch_length - BARSPATCHER_BWAV_HEADER_SIZE) result->status = BARSPATCHER_LOAD_MOD_TRUNCATED;
+                }
+            }
+            
+            if(failed || result->status != BARSPATCHER_LOAD_OK) {
+                free(result->track.patch_data);
+                result->track.patch_data = NULL;
+            }
+        }
+        
+        for(uint32_t i=0; i < count; i++) {
+            if(batch[i].og_fd >= 0) close(batch[i].og_fd);
+            if(batch[i].mod_fd >= 0) close(batch[i].mod_fd);
+        }
+        
+        if(failed) break;
+    }
+    
+    free(batch);
+    barspatcher_uringFree(&ring);
+    
+    *loaded_out = (failed ? first : mod_dir_list->count);
+    
+    return failed;
+}
+
+#endif
+
+//Size and modification time of a file, used to check if cached data about the file is still valid
+struct barspatcher_file_stat_t {
+    //0 if the file could not be checked
+    bool valid;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+};
+
+//Fills in the size and modification time of a file from its stat data.
+void barspatcher_setFileStat(barspatcher_file_stat_t* file_stat, const struct stat* st) {
+    file_stat->valid = 1;
+    file_stat->size = st->st_size;
+    #if defined BARSPATCHER_VERSION_PC
+    file_stat->mtime_sec = st->st_mtim.tv_sec;
+    file_stat->mtime_nsec = st->st_mtim.tv_nsec;
+    #else
+    file_stat->mtime_sec = st->st_mtime;
+    file_stat->mtime_nsec = 0;
+    #endif
+}
+
+//Reads the size and modification time of a file.
+//Returns 0 on success, and 1 on error with errno set.
+bool barspatcher_statFile(const char* path, barspatcher_file_stat_t* file_stat) {
+    memset(file_stat, 0, sizeof(barspatcher_file_stat_t));
+    
+    struct stat st;
+    if(stat(path, &st) != 0) return 1;
+    
+    barspatcher_setFileStat(file_stat, &st);
+    return 0;
+}
+
+//Reads the size and modification time of a file in a stream directory.
+//Returns 0 on success, and 1 on error with errno set.
+bool barspatcher_statDirFile(const barspatcher_dir_t* dir, const char* name, barspatcher_file_stat_t* file_stat) {
+    memset(file_stat, 0, sizeof(barspatcher_file_stat_t));
+    
+    struct stat st;
+    if(barspatcher_dirStat(dir, name, &st)) return 1;
+    
+    barspatcher_setFileStat(file_stat, &st);
+    return 0;
+}
+
+//Checks if two files have the same size and modification time.
+static inline bool barspatcher_sameFileStat(const barspatcher_file_stat_t* a, const barspatcher_file_stat_t* b) {
+    return a->valid && b->valid && a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/*
+ * Checks every original file against the manifest before the headers are loaded.
+ * Originals whose size and modification time still match their manifest entry get their header from the manifest,
+ * so the loaders don't open them.
+ * 
+ * og_stats - Array of mod_dir_list->count elements, receives the stat data for barspatcher_manifestUpdate
+ * 
+ */
+void barspatcher_manifestPrepare(barspatcher_manifest_t* manifest, const barspatcher_dir_t* og_dir, const barspatcher_name_list_t* mod_dir_list, barspatcher_track_load_t* results, barspatcher_file_stat_t* og_stats) {
+    for(uint64_t entry=0; entry < mod_dir_list->count; entry++) {
+        barspatcher_file_stat_t* og_stat = &og_stats[entry];
+        og_stat->valid = 0;
+        if(results[entry].status != BARSPATCHER_LOAD_OK) continue;
+        
+        if(barspatcher_statDirFile(og_dir, barspatcher_nameListGet(mod_dir_list, entry), og_stat)) {
+            if(errno == ENOENT) results[entry].status = BARSPATCHER_LOAD_NO_ORIGINAL;
+            continue;
+        }
+        
+        barspatcher_manifest_entry_t* manifest_entry = barspatcher_manifestFind(manifest, barspatcher_nameListGet(mod_dir_list, entry));
+        if(manifest_entry == NULL) continue;
+        if(manifest_entry->size != og_stat->size || manifest_entry->mtime_sec != og_stat->mtime_sec || manifest_entry->mtime_nsec != og_stat->mtime_nsec) continue;
+        
+        memcpy(results[entry].og_header, manifest_entry->header, BARSPATCHER_BWAV_HEADER_SIZE);
+        results[entry].og_header_length = manifest_entry->header_length;
+        results[entry].og_cached = 1;
+    }
+}
+
+//Writes the manifest file if anything was added to the manifest since it was read or last saved.
+void barspatcher_manifestSave(barspatcher_manifest_t* manifest, const char* manifest_filename, const char* og_stream_dirname) {
+    if(!manifest->changed) return;
+    
+    if(barspatcher_manifestWrite(manifest, manifest_filename, og_stream_dirname)) {
+        printf("Warning: Could not save the original file manifest %s: %s\n", manifest_filename, strerror(errno));
+    }
+    else manifest->changed = 0;
+}
+
+//Adds the original headers that were read by the loaders to the manifest.
+void barspatcher_manifestUpdate(barspatcher_manifest_t* manifest, const barspatcher_name_list_t* mod_dir_list, const barspatcher_track_load_t* results, const barspatcher_file_stat_t* og_stats) {
+    for(uint64_t entry=0; entry < mod_dir_list->count; entry++) {
+        const barspatcher_track_load_t* result = &results[entry];
+        if(!og_stats[entry].valid || result->og_cached || result->og_header_length < 0) continue;
+        
+        //The manifest only saves time, stop adding to it if there is not enough memory
+        if(barspatcher_manifestSet(manifest, barspatcher_nameListGet(mod_dir_list, entry), og_stats[entry].size, og_stats[entry].mtime_sec, og_stats[entry].mtime_nsec, result->og_header, result->og_header_length)) return;
+    }
+}
+
+/*
+ * Reads and checks the headers of every modded BWAV file and its matching original BWAV file.
+ * 
+ * mod_dir_list - Mod stream directory listing from barspatcher_listModDir
+ * tracks_out - Receives the allocated list of tracks that passed all checks, free with barspatcher_freeTracks
+ * track_count_out - Receives the number of tracks in the list
+ * skipped_files_out - Receives the number of files that were skipped
+ * workers - Number of threads that load headers at once, 0 for one per CPU core.
+ *           Tracks, messages and counts are always in directory listing order no matter how many workers are used.
+ * manifest - Original file manifest in memory that is used and updated, or NULL to always read the original files
+ * stats - Run statistics that the opened files and read bytes are added to, or NULL
+ * events - Receives a BARSPATCHER_EVENT_SKIPPED event for every skipped file, or NULL to print the reasons
+ * 
+ * Returns 0 on success, and barspatcher_run error codes on errors.
+ * Nothing has to be freed after an error.
+ * 
+ */
+unsigned char barspatcher_loadTracksCached(const char* og_stream_dirname, const char* mod_stream_dirname, const barspatcher_name_list_t* mod_dir_list, barspatcher_track_t** tracks_out, uint64_t* track_count_out, uint64_t* skipped_files_out, unsigned int workers, barspatcher_manifest_t* manifest, barspatcher_stats_t* stats = NULL, barspatcher_events_t* events = NULL) {
+    uint64_t skipped_files = 0;
+    
+    //Tracks that passed all checks
+    barspatcher_track_t* tracks = (barspatcher_track_t*)malloc(mod_dir_list->count * sizeof(barspatcher_track_t));
+    uint64_t track_count = 0;
+    
+    //Results for every entry
+    barspatcher_track_load_t* results = (barspatcher_track_load_t*)malloc(mod_dir_list->count * sizeof(barspatcher_track_load_t));
+    
+    if(tracks == NULL || results == NULL) {
+        printf("Could not allocate memory for the track list.\n");
+        free(tracks);
+        free(results);
+        return 100;
+    }
+    
+    for(uint64_t entry=0; entry < mod_dir_list->count; entry++) barspatcher_loadInit(&results[entry]);
+    
+    //Open both stream directories, all files are opened relative to them
+    barspatcher_dir_t og_dir, mod_dir;
+    if(barspatcher_dirOpen(&og_dir, og_stream_dirname)) {
+        perror(og_stream_dirname);
+        free(tracks);
+        free(results);
+        return 239;
+    }
+    if(barspatcher_dirOpen(&mod_dir, mod_stream_dirname)) {
+        perror(mod_stream_dirname);
+        barspatcher_dirClose(&og_dir);
+        free(tracks);
+        free(results);
+        return 229;
+    }
+    
+    //List the original stream directory once, so entries without an original file are skipped without trying to open it
+    {
+        barspatcher_name_set_t og_names;
+        barspatcher_nameSetInit(&og_names);
+        unsigned char list_res = barspatcher_dirListNames(&og_dir, &og_names);
+        
+        if(list_res == 0) {
+            for(uint64_t entry=0; entry < mod_dir_list->count; entry++) {
+                if(!barspatcher_nameSetHas(&og_names, barspatcher_nameListGet(mod_dir_list, entry))) results[entry].status = BARSPATCHER_LOAD_NO_ORIGINAL;
+            }
+        }
+        else if(list_res == 1) perror(og_stream_dirname);
+        else printf("Could not allocate memory for the original stream directory listing.\n");
+        
+        barspatcher_nameSetFree(&og_names);
+        
+        if(list_res != 0) {
+            barspatcher_dirClose(&og_dir);
+            barspatcher_dirClose(&mod_dir);
+            free(tracks);
+            free(results);
+            return (list_res == 1 ? 239 : 100);
+        }
+    }
+    
+    //Original file manifest
+    barspatcher_file_stat_t* og_stats = NULL;
+    
+    if(manifest != NULL) {
+        og_stats = (barspatcher_file_stat_t*)malloc(mod_dir_list->count * sizeof(barspatcher_file_stat_t));
+        
+        //The manifest only saves time, run without it if there is not enough memory
+        if(og_stats != NULL) barspatcher_manifestPrepare(manifest, &og_dir, mod_dir_list, results, og_stats);
+    }
+    
+    barspatcher_load_job_t job;
+    job.og_dir = &og_dir;
+    job.mod_dir = &mod_dir;
+    job.mod_dir_list = mod_dir_list;
+    job.results = results;
+    job.next_entry = 0;
+    
+    workers = barspatcher_workerCount(workers);
+    if(workers > mod_dir_list->count) workers = mod_dir_list->count;
+    
+    //Batched io_uring loading does all I/O without worker threads. The workers only load the entries
+    //that io_uring didn't, everything if it is not available or from the batch where it stopped working.
+    bool loaded = 0;
+    #if defined BARSPATCHER_HAVE_URING
+    loaded = !barspatcher_uringLoadTracks(&og_dir, &mod_dir, mod_dir_list, results, &job.next_entry);
+    #endif
+    
+    #if defined BARSPATCHER_HAVE_THREADS
+    if(!loaded && workers > 1) {
+        //The calling thread is one of the workers
+        pthread_t* threads = (pthread_t*)malloc((workers - 1) * sizeof(pthread_t));
+        unsigned int started = 0;
+        
+        if(threads != NULL) {
+            for(; started < workers - 1; started++) {
+                if(pthread_create(&threads[started], NULL, barspatcher_loadWorker, &job) != 0) break;
+            }
+        }
+        
+        barspatcher_loadWorker(&job);
+        
+        for(unsigned int i=0; i < started; i++) pthread_join(threads[i], NULL);
+        free(threads);
+        loaded = 1;
+    }
+    #endif
+    
+    if(!loaded) barspatcher_loadWorker(&job);
+    
+    barspatcher_dirClose(&og_dir);
+    barspatcher_dirClose(&mod_dir);
+    
+    if(og_stats != NULL) barspatcher_manifestUpdate(manifest, mod_dir_list, results, og_stats);
+    free(og_stats);
+    
+    //Without an event destination the reasons for skipping files are printed
+    barspatcher_events_t text_events;
+    if(events == NULL) {
+        barspatcher_eventsInit(&text_events, NULL, NULL, 0);
+        events = &text_events;
+    }
+    
+    //Collect the results in directory listing order
+    unsigned char res = 0;
+    uint64_t entry;
+    
+    for(entry=0; entry < mod_dir_list->count && res == 0; entry++) {
+        barspatcher_track_load_t* result = &results[entry];
+        const char* name = barspatcher_nameListGet(mod_dir_list, entry);
+        
+        switch(result->status) {
+            case BARSPATCHER_LOAD_OK:
+                tracks[track_count++] = result->track;
+                result->track.patch_data = NULL;
+                continue;
+            case BARSPATCHER_LOAD_NO_ORIGINAL:
+            case BARSPATCHER_LOAD_MOD_NOT_BWAV:
+            case BARSPATCHER_LOAD_OG_NOT_BWAV:
+            case BARSPATCHER_LOAD_CHANNEL_MISMATCH:
+            case BARSPATCHER_LOAD_PATCH_TOO_BIG:
+            case BARSPATCHER_LOAD_MOD_TRUNCATED:
+                barspatcher_eventSkipped(events, name, 0, result->status);
+                break;
+            case 100:
+                barspatcher_eventsFlush(events);
+                printf("Could not allocate memory for the track list.\n");
+                res = 100;
+                continue;
+            default:
+                //Print the error like perror does, after the skip messages before it
+                barspatcher_eventsFlush(events);
+                fflush(stdout);
+                fprintf(stderr, "%s/%s: %s\n", (result->error_in_mod_file ? mod_stream_dirname : og_stream_dirname), name, strerror(result->error_number));
+                res = result->status;
+                continue;
+        }
+        
+        skipped_files++;
+    }
+    
+    if(events == &text_events) barspatcher_eventsFree(&text_events);
+    
+    //Free patch data of results that weren't used
+    for(entry=0; entry < mod_dir_list->count; entry++) {
+        free(results[entry].track.patch_data);
+        
+        if(stats != NULL) {
+            stats->files_opened += results[entry].files_opened;
+            stats->bytes_read += results[entry].bytes_read;
+        }
+    }
+    free(results);
+    
+    if(res != 0) {
+        barspatcher_freeTracks(tracks, track_count);
+        return res;
+    }
+    
+    *tracks_out = tracks;
+    *track_count_out = track_count;
+    *skipped_files_out = skipped_files;
+    
+    return 0;
+}
+
+/*
+ * Loads tracks like barspatcher_loadTracksCached, with the manifest read from a file and saved again afterwards.
+ * 
+ * manifest_filename - Original file manifest that is read and updated, or NULL to always read the original files
+ * events - Receives the skipped files, or NULL to print the reasons
+ * 
+ */
+unsigned char barspatcher_loadTracks(const char* og_stream_dirname, const char* mod_stream_dirname, const barspatcher_name_list_t* mod_dir_list, barspatcher_track_t** tracks_out, uint64_t* track_count_out, uint64_t* skipped_files_out, unsigned int workers = 1, const char* manifest_filename = NULL, barspatcher_events_t* events = NULL) {
+    if(manifest_filename == NULL) return barspatcher_loadTracksCached(og_stream_dirname, mod_stream_dirname, mod_dir_list, tracks_out, track_count_out, skipped_files_out, workers, NULL, NULL, events);
+    
+    //The manifest only saves time, run without it if there is not enough memory
+    barspatcher_manifest_t manifest;
+    bool use_manifest = (barspatcher_manifestRead(&manifest, manifest_filename, og_stream_dirname) != 2);
+    
+    unsigned char res = barspatcher_loadTracksCached(og_stream_dirname, mod_stream_dirname, mod_dir_list, tracks_out, track_count_out, skipped_files_out, workers, (use_manifest ? &manifest : NULL), NULL, events);
+    
+    if(use_manifest) barspatcher_manifestSave(&manifest, manifest_filename, og_stream_dirname);
+    barspatcher_manifestFree(&manifest);
+    
+    return res;
+}
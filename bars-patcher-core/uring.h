@@ -0,0 +1,221 @@
+//Minimal io_uring submission ring for BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Used on Linux to submit many small file operations with a single system call.
+//Talks to the kernel directly through the io_uring system calls, so no extra library is needed.
+//Everything in here fails softly: if the kernel doesn't support io_uring or one of the needed operations,
+//barspatcher_uringInit returns an error and the caller falls back to normal system calls.
+
+#pragma once
+
+#if defined BARSPATCHER_VERSION_PC && defined __linux__ && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#define BARSPATCHER_HAVE_URING
+#endif
+#endif
+
+#if defined BARSPATCHER_HAVE_URING
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+//Called for every completed operation with the user data of the submission and the result of the operation
+typedef void (*barspatcher_uring_complete_t)(void* context, uint64_t user_data, int32_t result);
+
+struct barspatcher_uring_t {
+    int fd;
+    //Number of submission queue entries
+    uint32_t entries;
+    //Operations prepared but not submitted yet
+    uint32_t pending;
+    
+    //Submission queue
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_mask;
+    uint32_t* sq_array;
+    io_uring_sqe* sqes;
+    
+    //Completion queue
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t* cq_mask;
+    io_uring_cqe* cqes;
+    
+    //Mappings of the rings
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+//Closes the ring and unmaps its memory.
+void barspatcher_uringFree(barspatcher_uring_t* ring) {
+    if(ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_map != NULL && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+    if(ring->sq_map != NULL) munmap(ring->sq_map, ring->sq_map_size);
+    if(ring->fd >= 0) close(ring->fd);
+    
+    ring->fd = -1;
+    ring->sqes = NULL;
+    ring->cq_map = NULL;
+    ring->sq_map = NULL;
+}
+
+//Checks if the kernel supports every operation in ops.
+//Returns 1 if all operations are supported.
+bool barspatcher_uringSupports(barspatcher_uring_t* ring, const uint8_t* ops, uint32_t op_count) {
+    const uint32_t probe_ops = 256;
+    io_uring_probe* probe = (io_uring_probe*)calloc(1, sizeof(io_uring_probe) + probe_ops * sizeof(io_uring_probe_op));
+    if(probe == NULL) return 0;
+    
+    bool supported = (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, probe_ops) == 0);
+    
+    for(uint32_t i=0; i < op_count && supported; i++) {
+        supported = (ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED));
+    }
+    
+    free(probe);
+    return supported;
+}
+
+/*
+ * Sets up a ring with room for at least entries operations at once.
+ * 
+ * ops - Operations that will be used, all of them have to be supported by the kernel
+ * 
+ * Returns 0 on success, and 1 if io_uring can't be used.
+ * Nothing has to be freed after an error.
+ * 
+ */
+bool barspatcher_uringInit(barspatcher_uring_t* ring, uint32_t entries, const uint8_t* ops, uint32_t op_count) {
+    memset(ring, 0, sizeof(barspatcher_uring_t));
+    
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) return 1;
+    
+    if(!barspatcher_uringSupports(ring, ops, op_count)) {
+        barspatcher_uringFree(ring);
+        return 1;
+    }
+    
+    ring->entries = params.sq_entries;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    
+    //Both rings can share one mapping on newer kernels
+    bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP);
+    if(single_map) {
+        if(ring->cq_map_size > ring->sq_map_size) ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    
+    void* map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(map == MAP_FAILED) {
+        barspatcher_uringFree(ring);
+        return 1;
+    }
+    ring->sq_map = map;
+    
+    if(single_map) ring->cq_map = ring->sq_map;
+    else {
+        map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(map == MAP_FAILED) {
+            barspatcher_uringFree(ring);
+            return 1;
+        }
+        ring->cq_map = map;
+    }
+    
+    map = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(map == MAP_FAILED) {
+        barspatcher_uringFree(ring);
+        return 1;
+    }
+    ring->sqes = (io_uring_sqe*)map;
+    
+    unsigned char* sq = (unsigned char*)ring->sq_map;
+    unsigned char* cq = (unsigned char*)ring->cq_map;
+    ring->sq_head = (uint32_t*)(sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+    ring->sq_mask = (uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t*)(sq + params.sq_off.array);
+    ring->cq_head = (uint32_t*)(cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+    ring->cq_mask = (uint32_t*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    
+    return 0;
+}
+
+//Adds an operation to the submission queue. The caller fills in the operation specific fields.
+//Returns NULL if the queue is full, it has to be submitted first.
+io_uring_sqe* barspatcher_uringPrepare(barspatcher_uring_t* ring, uint8_t opcode, int fd, uint64_t user_data) {
+    if(ring->pending >= ring->entries) return NULL;
+    
+    uint32_t tail = *ring->sq_tail + ring->pending;
+    uint32_t index = tail & *ring->sq_mask;
+    
+    io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    
+    ring->sq_array[index] = index;
+    ring->pending++;
+    
+    return sqe;
+}
+
+/*
+ * Submits all prepared operations and waits until every one of them is completed.
+ * 
+ * complete - Called once for each completed operation
+ * 
+ * Returns 0 on success, and 1 if the ring stopped working.
+ * 
+ */
+bool barspatcher_uringSubmitAndWait(barspatcher_uring_t* ring, barspatcher_uring_complete_t complete, void* context) {
+    uint32_t to_submit = ring->pending;
+    uint32_t outstanding = ring->pending;
+    ring->pending = 0;
+    
+    //Make the prepared entries visible to the kernel
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+    
+    while(outstanding > 0) {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(submitted < 0) {
+            if(errno != EINTR && errno != EAGAIN && errno != EBUSY) return 1;
+            submitted = 0;
+        }
+        to_submit -= submitted;
+        
+        //Reap completions
+        uint32_t head = *ring->cq_head;
+        uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        
+        for(; head != tail; head++) {
+            io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            complete(context, cqe->user_data, cqe->res);
+            outstanding--;
+        }
+        
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    
+    return 0;
+}
+
+#endif
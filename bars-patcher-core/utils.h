@@ -1,74 +1,59 @@
-//Generic slicing functions for BARS patcher and BWAV readers
+//Byte order functions for BARS patcher and BWAV readers
 //Copyright (C) 2020 I.C.
 
-//Bool endian: 0 = little endian, 1 = big endian
+//Fields are read in place from the file data. The byte order of a file is a template parameter,
+//so it is checked once per file and every field read is a single load, byte swapped if needed.
 
 #pragma once
+#include <stdint.h>
+#include <string.h>
 
-//Get slice of data
-//output is expected to have at least [length] bytes of memory allocated
-unsigned char* barspatcher_getSlice(unsigned char* output, const unsigned char* data, unsigned long start, unsigned long length) {
-    for(unsigned int i=0; i < length; i++) {
-        output[i] = data[i + start];
-    }
-    return output;
+//Byte order of a file, the same values as the bool endian used elsewhere: 0 = little endian, 1 = big endian
+enum barspatcher_endian_t {
+    BARSPATCHER_LITTLE_ENDIAN = 0,
+    BARSPATCHER_BIG_ENDIAN = 1
+};
+
+//Byte order of the machine
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BARSPATCHER_HOST_ENDIAN BARSPATCHER_BIG_ENDIAN
+#else
+#define BARSPATCHER_HOST_ENDIAN BARSPATCHER_LITTLE_ENDIAN
+#endif
+
+//Reverses the bytes of a number.
+constexpr uint8_t barspatcher_byteSwap(uint8_t value) {return value;}
+constexpr uint16_t barspatcher_byteSwap(uint16_t value) {return __builtin_bswap16(value);}
+constexpr uint32_t barspatcher_byteSwap(uint32_t value) {return __builtin_bswap32(value);}
+constexpr uint64_t barspatcher_byteSwap(uint64_t value) {return __builtin_bswap64(value);}
+
+//Converts a number between the machine byte order and a file byte order.
+template<typename T, barspatcher_endian_t E>
+constexpr T barspatcher_fromEndian(T value) {
+    return (E == BARSPATCHER_HOST_ENDIAN ? value : barspatcher_byteSwap(value));
+}
+
+//Reads an unsigned number with the byte order E at data.
+template<typename T, barspatcher_endian_t E>
+static inline T barspatcher_load(const unsigned char* data) {
+    T value;
+    memcpy(&value, data, sizeof(T));
+    return barspatcher_fromEndian<T, E>(value);
 }
 
-//Get slice and convert it to a number
-//output is expected to have at least [length] bytes of memory allocated
-unsigned long barspatcher_getSliceAsNumber(unsigned char* output, const unsigned char* data, unsigned long start, unsigned long length, bool endian) {
-    //Limit to 32-bit number
-    if(length>4) length = 4;
-    
-    unsigned long number = 0;
-    
-    unsigned char* bytes = barspatcher_getSlice(output, data, start, length);
-    
-    unsigned char pos;
-    
-    if(endian) {
-        pos = length - 1; //Read as big endian
-    } else {
-        pos = 0; //Read as little endian
-    }
-    
-    unsigned long pw = 1; //Multiply by 1,256,65536...
-    for(unsigned int i=0; i < length; i++) {
-        if(i > 0) pw *= 256;
-        number += bytes[pos] * pw;
-        
-        if(endian) pos--;
-        else pos++;
-    }
-    return number;
+//Writes an unsigned number with the byte order E at data.
+template<typename T, barspatcher_endian_t E>
+static inline void barspatcher_store(unsigned char* data, T value) {
+    value = barspatcher_fromEndian<T, E>(value);
+    memcpy(data, &value, sizeof(T));
 }
 
-//Get slice as signed 16 bit number
-signed int barspatcher_getSliceAsInt16Sample(const unsigned char* data, unsigned long start, bool endian) {
-    unsigned long number = 0;
-    unsigned char bytes[2] = {data[start], data[start+1]};
-    unsigned char little = bytes[endian];
-    signed   char big = bytes[!endian];
-    number = little + big*256;
-    return number;
+//Reads a byte order mark at start. Returns 0 for little endian, 1 for big endian.
+static inline bool barspatcher_readBOM(const unsigned char* data, unsigned long start) {
+    return barspatcher_load<uint16_t, BARSPATCHER_BIG_ENDIAN>(data + start) == 0xFEFF;
 }
 
-//Get slice as a null terminated string
-//output is expected to have at least [length+1] bytes of memory allocated
-char* barspatcher_getSliceAsString(unsigned char* output, const unsigned char* data, unsigned long start, unsigned long length) {
-    unsigned char slicestr[length+1];
-    unsigned char* bytes = barspatcher_getSlice(output, data, start, length);
-    
-    for(unsigned int i=0; i < length; i++) {
-        slicestr[i] = bytes[i];
-        if(slicestr[i] == '\0') slicestr[i]=' ';
-    }
-    
-    slicestr[length]='\0';
-    
-    for(unsigned int i=0; i < length+1; i++) {
-        output[i] = slicestr[i];
-    }
-    
-    return (char*)output;
+//Checks if the 4 bytes at start match a magic string.
+static inline bool barspatcher_hasMagic(const unsigned char* data, unsigned long start, const char* magic) {
+    return memcmp(data + start, magic, 4) == 0;
 }
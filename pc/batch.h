@@ -0,0 +1,225 @@
+//Batch mode for the PC frontend of automatic BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Batch mode reads a game config file in the same format as the Nintendo Switch version (see switch/src/config.h),
+//resolves '*' in its paths and patches every game in it, or only the selected games.
+//Games are independent of each other, so they are patched at the same time by a pool of threads
+//that each take the next game that wasn't started yet.
+
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "../switch/src/config.h"
+#include "../switch/src/path-resolver.h"
+//Track event output
+#include "event-output.h"
+
+//Options used for every game in a batch
+struct batch_options_t {
+    bool verbose;
+    //Streaming window size, or 0 to load the BARS files at once
+    uint64_t stream_window;
+    //Threads used for reading BWAV files of each game
+    unsigned int workers;
+    bool incremental;
+    //One of EVENT_OUTPUT_*
+    int events;
+    //Cache file of resolved wildcard paths, or NULL
+    const char* path_cache;
+    //One of BARSPATCHER_CRC_CHECK_*
+    unsigned char crc_check;
+};
+
+struct batch_job_t {
+    const batch_options_t* options;
+    bars_game_config_t** games;
+    uint32_t game_count;
+    //Result code of every game
+    unsigned char* results;
+    //Index of the next game that wasn't started yet
+    uint32_t next_game;
+};
+
+//Patches one game of a batch.
+unsigned char batch_run_game(const batch_options_t* options, const bars_game_config_t* game) {
+    if(options->events == EVENT_OUTPUT_TEXT) printf("Patching %s (%s)...\n", game->full_name, game->id);
+    
+    event_output_t output;
+    output.game_id = game->id;
+    barspatcher_event_callback_t callback = event_output_callback(options->events);
+    
+    if(options->stream_window > 0) return barspatcher_runStreaming(options->verbose, game->stream_dir, game->mod_stream_dir, game->bars_path, game->output_bars_path, options->stream_window, options->workers, NULL, callback, &output);
+    return barspatcher_run(options->verbose, game->stream_dir, game->mod_stream_dir, game->bars_path, game->output_bars_path, options->workers, NULL, options->incremental, NULL, callback, &output, NULL, options->crc_check);
+}
+
+//Batch worker thread, patches games until there are none left.
+void* batch_worker(void* arg) {
+    batch_job_t* job = (batch_job_t*)arg;
+    
+    while(1) {
+        uint32_t game = __atomic_fetch_add(&job->next_game, 1, __ATOMIC_RELAXED);
+        if(game >= job->game_count) break;
+        
+        job->results[game] = batch_run_game(job->options, job->games[game]);
+    }
+    
+    return NULL;
+}
+
+/*
+ * Patches every selected game in a config file.
+ * 
+ * config_filename - Path to the game config file
+ * id_list - Comma separated list of game IDs to patch, or NULL for all games in the config file
+ * options - Options used for every game
+ * jobs - Number of games patched at the same time, 0 for one per CPU core
+ * 
+ * Returns 0 if every game was patched, and 2 if any game could not be patched or on errors.
+ * 
+ */
+int batch_run(const char* config_filename, const char* id_list, const batch_options_t* options, unsigned int jobs) {
+    bars_config_storage_t* config = (bars_config_storage_t*)malloc(sizeof(bars_config_storage_t));
+    if(config == NULL) {
+        printf("Could not allocate memory for the config.\n");
+        return 2;
+    }
+    
+    config_init(config);
+    
+    unsigned char config_res = config_read_file(config, config_filename, 0);
+    if(config_res != 0) {
+        switch(config_res) {
+            case 1: printf("Could not allocate memory for the config.\n"); break;
+            case 2: perror(config_filename); break;
+            case 3: printf("The config file %s is too big.\n", config_filename); break;
+            default: printf("An unknown error has occurred when loading the config file %s.\n", config_filename); break;
+        }
+        
+        free(config);
+        return 2;
+    }
+    
+    //Select games, in the order of the config file
+    bars_game_config_t** games = (bars_game_config_t**)malloc(config->entries_loaded * sizeof(bars_game_config_t*) + 1);
+    unsigned char* results = (unsigned char*)malloc(config->entries_loaded + 1);
+    if(games == NULL || results == NULL) {
+        printf("Could not allocate memory for the config.\n");
+        free(games);
+        free(results);
+        config_free(config);
+        free(config);
+        return 2;
+    }
+    
+    //Every selected ID must be in the config file, IDs are looked up in the config ID index.
+    //results marks the selected entries until the games are patched.
+    bool unknown_id = 0;
+    memset(results, id_list == NULL, config->entries_loaded);
+    if(id_list != NULL) {
+        const char* id = id_list;
+        
+        while(*id != '\0') {
+            const char* end = strchr(id, ',');
+            size_t length = (end == NULL ? strlen(id) : (size_t)(end - id));
+            int64_t entry = config_find(config, id, length);
+            
+            if(entry >= 0) results[entry] = 1;
+            else if(length > 0) {
+                printf("Game '%.*s' is not in the config file %s.\n", (int)length, id, config_filename);
+                unknown_id = 1;
+            }
+            
+            if(end == NULL) break;
+            id = end + 1;
+        }
+    }
+    
+    uint32_t game_count = 0;
+    for(uint32_t e=0; e < config->entries_loaded; e++) {
+        if(results[e]) games[game_count++] = &config->entries[e];
+    }
+    
+    if(unknown_id || game_count == 0) {
+        if(game_count == 0 && !unknown_id) printf("There are no games in the config file %s.\n", config_filename);
+        free(games);
+        free(results);
+        config_free(config);
+        free(config);
+        return 2;
+    }
+    
+    //Resolve '*' in all paths before any game is patched, games share the listings of their wildcard directories
+    path_resolver_t resolver;
+    path_resolver_init(&resolver);
+    if(options->path_cache != NULL && path_resolver_load(&resolver, options->path_cache)) printf("Warning: Could not load the path cache file %s.\n", options->path_cache);
+    
+    for(uint32_t g=0; g < game_count; g++) {
+        config_set_string(config, games[g]->bars_path, path_resolver_resolve(&resolver, games[g]->bars_path));
+        config_set_string(config, games[g]->stream_dir, path_resolver_resolve(&resolver, games[g]->stream_dir));
+        config_set_string(config, games[g]->mod_stream_dir, path_resolver_resolve(&resolver, games[g]->mod_stream_dir));
+        config_set_string(config, games[g]->output_bars_path, path_resolver_resolve(&resolver, games[g]->output_bars_path));
+    }
+    
+    if(options->path_cache != NULL && path_resolver_save(&resolver, options->path_cache)) perror(options->path_cache);
+    path_resolver_free(&resolver);
+    
+    batch_job_t job;
+    job.options = options;
+    job.games = games;
+    job.game_count = game_count;
+    job.results = results;
+    job.next_game = 0;
+    
+    jobs = barspatcher_workerCount(jobs);
+    if(jobs > game_count) jobs = game_count;
+    
+    //The calling thread is one of the workers
+    pthread_t* threads = (pthread_t*)malloc((jobs - 1) * sizeof(pthread_t));
+    unsigned int started = 0;
+    
+    if(threads != NULL) {
+        for(; started + 1 < jobs; started++) {
+            if(pthread_create(&threads[started], NULL, batch_worker, &job) != 0) break;
+        }
+    }
+    
+    batch_worker(&job);
+    
+    for(unsigned int i=0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    
+    //Combined summary
+    uint32_t patched_games = 0, failed_games = 0;
+    printf("\nBatch summary:\n");
+    
+    for(uint32_t g=0; g < game_count; g++) {
+        unsigned char res = results[g];
+        
+        if(res >= 100) {
+            printf("%s: Error. (%d, %s)\n", games[g]->id, res, barspatcher_getErrorString(res));
+            failed_games++;
+        }
+        else if(res > 0) {
+            printf("%s: Patched, %d %stracks were skipped.\n", games[g]->id, res, (res == 99 ? "or more " : ""));
+            patched_games++;
+        }
+        else {
+            printf("%s: Patched.\n", games[g]->id);
+            patched_games++;
+        }
+    }
+    
+    printf("%u of %u game%s patched, %u failed.\n", patched_games, game_count, (game_count == 1 ? "" : "s"), failed_games);
+    
+    free(games);
+    free(results);
+    config_free(config);
+    free(config);
+    
+    return (failed_games > 0 ? 2 : 0);
+}
@@ -0,0 +1,601 @@
+//Benchmark for automatic BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Generates a synthetic BARS file with matching original and modded BWAV directories, then times every step of a patch
+//run separately. Results can be saved as a baseline and compared against it on later runs.
+
+#include <iostream>
+#include <cstring>
+#include <time.h>
+#include <sys/stat.h>
+
+#define BARSPATCHER_VERSION_PC
+#include "../bars-patcher-core/bars-patcher.h"
+//Game config parser of batch mode
+#include "../switch/src/config.h"
+
+//Benchmark parameters, also saved in baseline files
+struct bench_params_t {
+    uint32_t tracks;
+    uint16_t channels;
+    bool big_endian;
+    //Size of the generated BARS file in MB, 0 for BWAV headers without sample data
+    uint32_t bars_mb;
+    unsigned int workers;
+    //Number of entries in the generated game config file
+    uint32_t games;
+};
+
+//Steps of a patch run that are timed
+#define BENCH_STEP_COUNT 7
+const char* bench_step_names[BENCH_STEP_COUNT] = {"list", "load", "locate", "locate-scan", "patch", "write", "config"};
+
+//Returns a monotonic time in milliseconds.
+double bench_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+//xorshift64 generator, the data only has to look random and be the same for the same parameters
+uint64_t bench_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+void bench_fillRandom(unsigned char* data, uint64_t size, uint64_t* state) {
+    for(uint64_t i=0; i < size; i++) data[i] = bench_random(state) >> 56;
+}
+
+void bench_put16(unsigned char* data, uint16_t value, bool big_endian) {
+    if(big_endian) {data[0] = value >> 8; data[1] = value;}
+    else {data[0] = value; data[1] = value >> 8;}
+}
+
+void bench_put32(unsigned char* data, uint32_t value, bool big_endian) {
+    for(unsigned int b=0; b < 4; b++) data[big_endian ? 3-b : b] = value >> (b*8);
+}
+
+//Size of a generated BWAV header with all channel infos, aligned to 0x40
+uint32_t bench_bwavHeaderSize(uint16_t channels) {
+    return (BARSPATCHER_BWAV_HEADER_SIZE + BARSPATCHER_BWAV_CHANNEL_INFO_SIZE * channels + 0x3F) & ~0x3F;
+}
+
+//Writes a BWAV header with random channel data into data, which must have space for bench_bwavHeaderSize bytes.
+void bench_makeBwavHeader(unsigned char* data, const bench_params_t* params, uint32_t crc32, uint32_t payload_length, uint64_t* state) {
+    bool be = params->big_endian;
+    uint32_t header_size = bench_bwavHeaderSize(params->channels);
+    memset(data, 0, header_size);
+    
+    memcpy(data, "BWAV", 4);
+    bench_put16(data + 0x04, 0xFEFF, be);
+    bench_put16(data + 0x06, 1, be);
+    bench_put32(data + 0x08, crc32, be);
+    bench_put16(data + 0x0C, 1, be);
+    bench_put16(data + 0x0E, params->channels, be);
+    
+    for(uint16_t c=0; c < params->channels; c++) {
+        unsigned char* info = data + BARSPATCHER_BWAV_HEADER_SIZE + BARSPATCHER_BWAV_CHANNEL_INFO_SIZE * c;
+        bench_put16(info + 0x00, 1, be);
+        bench_put16(info + 0x02, c, be);
+        bench_put32(info + 0x04, 48000, be);
+        bench_put32(info + 0x08, 1000, be);
+        bench_put32(info + 0x0C, 100, be);
+        bench_fillRandom(info + 0x10, 0x20, state);
+        bench_put32(info + 0x30, header_size + c * (payload_length / params->channels), be);
+        bench_put32(info + 0x3C, 1000, be);
+    }
+}
+
+//Writes data to a file. Returns 0 on success, and 1 on errors.
+bool bench_writeFile(const char* filename, const unsigned char* data, uint64_t size) {
+    FILE* file = fopen(filename, "wb");
+    if(file == NULL) {
+        perror(filename);
+        return 1;
+    }
+    
+    bool error = (fwrite(data, 1, size, file) != size);
+    if(fclose(file) != 0) error = 1;
+    if(error) perror(filename);
+    
+    return error;
+}
+
+//Writes a BWAV file with a header and random sample data. Returns 0 on success, and 1 on errors.
+bool bench_writeBwav(const char* filename, const bench_params_t* params, uint32_t crc32, uint64_t* state, unsigned char* buf) {
+    uint32_t header_size = bench_bwavHeaderSize(params->channels);
+    uint32_t payload_length = 64 + bench_random(state) % 256;
+    
+    bench_makeBwavHeader(buf, params, crc32, payload_length, state);
+    bench_fillRandom(buf + header_size, payload_length, state);
+    
+    return bench_writeFile(filename, buf, header_size + payload_length);
+}
+
+//Writes a game config file with params->games entries. Returns 0 on success, and 1 on errors.
+bool bench_writeConfig(const char* filename, const char* dirname, const bench_params_t* params) {
+    FILE* file = fopen(filename, "wb");
+    if(file == NULL) {
+        perror(filename);
+        return 1;
+    }
+    
+    fprintf(file, "#Generated benchmark game config\n");
+    for(uint32_t g=0; g < params->games; g++) {
+        fprintf(file, "^game%06u\nfull_name=Benchmark Game %u\n", g, g);
+        fprintf(file, "bars_path=%s/in.bars\nstream_dir=%s/og\nmod_stream_dir=%s/mod\n", dirname, dirname, dirname);
+        fprintf(file, "output_bars_path=%s/out_%06u.bars\n\n", dirname, g);
+    }
+    
+    bool error = (ferror(file) != 0);
+    if(fclose(file) != 0) error = 1;
+    if(error) perror(filename);
+    
+    return error;
+}
+
+/*
+ * Generates the benchmark data in a directory:
+ * og/ - Original BWAV files
+ * mod/ - Modded BWAV files, one for every original file
+ * in.bars - BARS file with the headers of all original files
+ * games.txt - Game config file for batch mode
+ * 
+ * Returns 0 on success, and 1 on errors.
+ * 
+ */
+bool bench_generate(const char* dirname, const bench_params_t* params) {
+    bool be = params->big_endian;
+    uint32_t track_count = params->tracks;
+    uint32_t header_size = bench_bwavHeaderSize(params->channels);
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ (track_count * 0x100000001B3ULL) ^ params->channels;
+    
+    size_t dirname_length = strlen(dirname);
+    char* path = (char*)malloc(dirname_length + 64);
+    unsigned char* buf = (unsigned char*)malloc(header_size + 512);
+    uint32_t* og_crcs = (uint32_t*)malloc(track_count * sizeof(uint32_t));
+    
+    if(path == NULL || buf == NULL || og_crcs == NULL) {
+        printf("Could not allocate memory for the benchmark data.\n");
+        free(path); free(buf); free(og_crcs);
+        return 1;
+    }
+    
+    mkdir(dirname, 0755);
+    snprintf(path, dirname_length + 64, "%s/og", dirname);
+    mkdir(path, 0755);
+    snprintf(path, dirname_length + 64, "%s/mod", dirname);
+    mkdir(path, 0755);
+    
+    //Original and modded BWAV files
+    bool error = 0;
+    for(uint32_t t=0; t < track_count && !error; t++) {
+        og_crcs[t] = bench_random(&state);
+        
+        snprintf(path, dirname_length + 64, "%s/og/track_%06u.bwav", dirname, t);
+        error = bench_writeBwav(path, params, og_crcs[t], &state, buf);
+        
+        snprintf(path, dirname_length + 64, "%s/mod/track_%06u.bwav", dirname, t);
+        if(!error) error = bench_writeBwav(path, params, bench_random(&state), &state, buf);
+    }
+    
+    //BARS file: header, name hash table, offset table, then an AMTA entry and an embedded BWAV header for every track
+    const uint32_t amta_size = 0x24 + 0x08 + 16;
+    uint64_t entry_size = ((amta_size + 0x3F) & ~0x3F) + header_size;
+    uint64_t table_end = 0x10 + 12 * (uint64_t)track_count;
+    uint64_t base_size = table_end + entry_size * track_count;
+    
+    //Sample data after every embedded header fills the BARS file up to the requested size
+    uint64_t target_size = (uint64_t)params->bars_mb * 1000000;
+    uint64_t extra = (target_size > base_size ? (target_size - base_size) / track_count : 0);
+    extra &= ~0x3FULL;
+    uint64_t bars_size = table_end + (entry_size + extra) * track_count + 0x40;
+    
+    if(bars_size > 0xFFFFFFFFULL) {
+        printf("The BARS file would be too big for 32-bit offsets.\n");
+        error = 1;
+    }
+    
+    unsigned char* bars = (error ? NULL : (unsigned char*)calloc(bars_size, 1));
+    if(!error && bars == NULL) {
+        printf("Could not allocate memory for the benchmark BARS file.\n");
+        error = 1;
+    }
+    
+    if(!error) {
+        memcpy(bars, "BARS", 4);
+        bench_put16(bars + 0x08, 0xFEFF, be);
+        bench_put16(bars + 0x0A, 0x0101, be);
+        bench_put32(bars + 0x0C, track_count, be);
+        
+        uint64_t pos = (table_end + 0x3F) & ~0x3FULL;
+        for(uint32_t t=0; t < track_count; t++) {
+            //Name hashes must be sorted
+            bench_put32(bars + 0x10 + 4 * (uint64_t)t, (uint32_t)(((uint64_t)t << 32) / track_count), be);
+            
+            //AMTA entry with the track name in its STRG section
+            unsigned char* amta = bars + pos;
+            memcpy(amta, "AMTA", 4);
+            bench_put16(amta + 0x04, 0xFEFF, be);
+            bench_put16(amta + 0x06, 4, be);
+            bench_put32(amta + 0x08, amta_size, be);
+            for(unsigned int s=0; s < 4; s++) bench_put32(amta + 0x0C + 4*s, 0x24, be);
+            memcpy(amta + 0x24, "STRG", 4);
+            bench_put32(amta + 0x28, 13, be);
+            snprintf((char*)amta + 0x2C, 16, "track_%06u", t % 1000000);
+            
+            uint64_t amta_pos = pos;
+            pos += (amta_size + 0x3F) & ~0x3F;
+            
+            //Embedded BWAV header of the original file, followed by sample data
+            uint64_t bwav_pos = pos;
+            bench_makeBwavHeader(bars + pos, params, og_crcs[t], 256, &state);
+            pos += header_size;
+            bench_fillRandom(bars + pos, extra, &state);
+            pos += extra;
+            
+            bench_put32(bars + table_end - 8 * ((uint64_t)track_count - t), amta_pos, be);
+            bench_put32(bars + table_end - 8 * ((uint64_t)track_count - t) + 4, bwav_pos, be);
+        }
+        
+        bars_size = pos;
+        bench_put32(bars + 0x04, bars_size, be);
+        
+        snprintf(path, dirname_length + 64, "%s/in.bars", dirname);
+        error = bench_writeFile(path, bars, bars_size);
+    }
+    
+    if(!error) {
+        snprintf(path, dirname_length + 64, "%s/games.txt", dirname);
+        error = bench_writeConfig(path, dirname, params);
+    }
+    
+    free(bars);
+    free(path);
+    free(buf);
+    free(og_crcs);
+    
+    return error;
+}
+
+//Prints the result of one step, with the change to the baseline if there is one.
+void bench_printResult(const char* name, double time_ms, double baseline_ms) {
+    printf("%-12s %10.3f ms", name, time_ms);
+    if(baseline_ms > 0) printf("  baseline %10.3f ms  %+6.1f%%", baseline_ms, (time_ms / baseline_ms - 1) * 100);
+    printf("\n");
+}
+
+//Sorts times and returns the median.
+double bench_median(double* times, unsigned int count) {
+    for(unsigned int i=1; i < count; i++) {
+        for(unsigned int j=i; j > 0 && times[j-1] > times[j]; j--) {
+            double tmp = times[j];
+            times[j] = times[j-1];
+            times[j-1] = tmp;
+        }
+    }
+    return times[count / 2];
+}
+
+/*
+ * Times every step of a patch run on generated data.
+ * 
+ * results - Receives the median time of every step in milliseconds
+ * 
+ * Returns 0 on success, and 1 on errors.
+ * 
+ */
+bool bench_run(const char* dirname, const bench_params_t* params, unsigned int runs, double* results) {
+    size_t dirname_length = strlen(dirname);
+    char* og_dirname = (char*)malloc(dirname_length + 16);
+    char* mod_dirname = (char*)malloc(dirname_length + 16);
+    char* input_filename = (char*)malloc(dirname_length + 16);
+    char* output_filename = (char*)malloc(dirname_length + 16);
+    char* config_filename = (char*)malloc(dirname_length + 16);
+    double* times = (double*)malloc(runs * sizeof(double));
+    
+    barspatcher_bars_input_t input;
+    input.data = NULL;
+    unsigned char* pristine = NULL;
+    barspatcher_name_list_t list;
+    barspatcher_nameListInit(&list);
+    barspatcher_track_t* tracks = NULL;
+    uint64_t track_count = 0;
+    barspatcher_crc_index_t index;
+    memset(&index, 0, sizeof(index));
+    barspatcher_range_list_t ranges;
+    barspatcher_rangesInit(&ranges);
+    bars_config_storage_t config;
+    config_init(&config);
+    
+    bool error = (og_dirname == NULL || mod_dirname == NULL || input_filename == NULL || output_filename == NULL || config_filename == NULL || times == NULL);
+    if(error) printf("Could not allocate memory for the benchmark.\n");
+    else {
+        snprintf(og_dirname, dirname_length + 16, "%s/og", dirname);
+        snprintf(mod_dirname, dirname_length + 16, "%s/mod", dirname);
+        snprintf(input_filename, dirname_length + 16, "%s/in.bars", dirname);
+        snprintf(output_filename, dirname_length + 16, "%s/out.bars", dirname);
+        snprintf(config_filename, dirname_length + 16, "%s/games.txt", dirname);
+        
+        error = (barspatcher_inputOpen(&input, input_filename) != 0);
+    }
+    
+    //Keep an unpatched copy, so every patch run starts from the same data
+    if(!error) {
+        pristine = (unsigned char*)malloc(input.size);
+        if(pristine == NULL) {
+            printf("Could not allocate memory for the benchmark.\n");
+            error = 1;
+        }
+        else memcpy(pristine, input.data, input.size);
+    }
+    
+    //Directory listing
+    for(unsigned int r=0; r < runs && !error; r++) {
+        barspatcher_nameListClear(&list);
+        double start = bench_time_ms();
+        error = (barspatcher_listModDir(mod_dirname, &list) != 0);
+        times[r] = bench_time_ms() - start;
+    }
+    if(!error) results[0] = bench_median(times, runs);
+    
+    //Header loading
+    for(unsigned int r=0; r < runs && !error; r++) {
+        if(tracks != NULL) barspatcher_freeTracks(tracks, track_count);
+        tracks = NULL;
+        
+        uint64_t skipped = 0;
+        double start = bench_time_ms();
+        error = (barspatcher_loadTracksCached(og_dirname, mod_dirname, &list, &tracks, &track_count, &skipped, params->workers, NULL) != 0);
+        times[r] = bench_time_ms() - start;
+    }
+    if(!error) results[1] = bench_median(times, runs);
+    
+    //Locating by searching the whole file, and with the BARS track table.
+    //The table is last, so patching uses its locations without chance matches in the sample data.
+    for(unsigned int step=3; step >= 2 && !error; step--) {
+        for(unsigned int r=0; r < runs && !error; r++) {
+            double start = bench_time_ms();
+            
+            error = barspatcher_crcIndexReset(&index, track_count);
+            for(uint64_t t=0; t < track_count && !error; t++) barspatcher_crcIndexInsert(&index, tracks[t].crc_key);
+            
+            if(!error && step == 2) {
+                barspatcher_bars_info_t info;
+                error = (barspatcher_barsParse(&info, input.data, input.size) != 0);
+                if(!error) {
+                    error = barspatcher_barsIndexTracks(&info, &index);
+                    barspatcher_barsFree(&info);
+                }
+            }
+            else if(!error) error = barspatcher_scanParallel(&index, input.data, input.size, barspatcher_scanSelectKernel(index.count), barspatcher_workerCount(params->workers));
+            
+            times[r] = bench_time_ms() - start;
+        }
+        if(!error) results[step] = bench_median(times, runs);
+    }
+    
+    //Patching, the same way as barspatcher_run
+    for(unsigned int r=0; r < runs && !error; r++) {
+        memcpy(input.data, pristine, input.size);
+        barspatcher_rangesClear(&ranges);
+        
+        double start = bench_time_ms();
+        for(uint64_t t=0; t < track_count && !error; t++) {
+            int64_t slot = barspatcher_crcIndexFind(&index, tracks[t].crc_key);
+            uint32_t hit = (slot < 0 ? BARSPATCHER_CRC_INDEX_NONE : index.first_hit[slot]);
+            
+            for(; hit != BARSPATCHER_CRC_INDEX_NONE && !error; hit = index.hits[hit].next) {
+                uint64_t bars_pos = index.hits[hit].offset;
+                if(bars_pos < 0x08 || barspatcher_crcKey(input.data + bars_pos) != tracks[t].crc_key) continue;
+                if(input.size - (bars_pos - 0x08) < tracks[t].patch_length) continue;
+                
+                memcpy(input.data + bars_pos - 0x08, tracks[t].patch_data, tracks[t].patch_length);
+                error = barspatcher_rangesAdd(&ranges, bars_pos - 0x08, tracks[t].patch_length);
+            }
+        }
+        times[r] = bench_time_ms() - start;
+    }
+    if(!error) results[4] = bench_median(times, runs);
+    
+    if(!error && ranges.count != track_count) {
+        printf("%u locations were patched for %llu tracks, the benchmark data is not valid.\n", ranges.count, (unsigned long long)track_count);
+        error = 1;
+    }
+    
+    //Output writing
+    for(unsigned int r=0; r < runs && !error; r++) {
+        remove(output_filename);
+        
+        double start = bench_time_ms();
+        error = (barspatcher_outputWrite(input.data, input.size, input_filename, output_filename, &ranges) != 0);
+        times[r] = bench_time_ms() - start;
+    }
+    if(!error) results[5] = bench_median(times, runs);
+    
+    //Game config loading, and a lookup of every game ID like a batch run that selects all of them
+    for(unsigned int r=0; r < runs && !error; r++) {
+        double start = bench_time_ms();
+        error = (config_read_file(&config, config_filename, 0) != 0);
+        
+        for(uint32_t e=0; e < config.entries_loaded && !error; e++) {
+            const char* id = config.entries[e].id;
+            error = (config_find(&config, id, strlen(id)) != (int64_t)e);
+        }
+        times[r] = bench_time_ms() - start;
+        
+        if(error) printf("Could not load the game config file %s.\n", config_filename);
+    }
+    if(!error) results[6] = bench_median(times, runs);
+    
+    if(output_filename != NULL) remove(output_filename);
+    
+    if(input.data != NULL) barspatcher_inputClose(&input);
+    if(tracks != NULL) barspatcher_freeTracks(tracks, track_count);
+    barspatcher_nameListFree(&list);
+    barspatcher_crcIndexFree(&index);
+    barspatcher_rangesFree(&ranges);
+    config_free(&config);
+    free(pristine);
+    free(og_dirname);
+    free(mod_dirname);
+    free(input_filename);
+    free(output_filename);
+    free(config_filename);
+    free(times);
+    
+    return error;
+}
+
+/*
+ * Baseline file format, one line each:
+ * tracks channels big_endian bars_mb workers games
+ * step_name time_ms
+ * 
+ */
+
+//Reads a baseline file. Returns 0 on success, and 1 on errors.
+bool bench_readBaseline(const char* filename, const bench_params_t* params, double* baseline) {
+    FILE* file = fopen(filename, "r");
+    if(file == NULL) {
+        perror(filename);
+        return 1;
+    }
+    
+    //Baselines from before the config step have no game count
+    bench_params_t saved;
+    unsigned int channels, big_endian;
+    char line[256];
+    int fields = (fgets(line, sizeof(line), file) != NULL ? sscanf(line, "%u %u %u %u %u %u", &saved.tracks, &channels, &big_endian, &saved.bars_mb, &saved.workers, &saved.games) : 0);
+    bool error = (fields < 5);
+    if(fields == 5) saved.games = params->games;
+    
+    if(!error && (saved.tracks != params->tracks || channels != params->channels || (bool)big_endian != params->big_endian || saved.bars_mb != params->bars_mb || saved.workers != params->workers || saved.games != params->games)) {
+        printf("Warning: The baseline was made with different parameters (--tracks %u --channels %u%s --bars-size %u --workers %u --games %u).\n", saved.tracks, channels, (big_endian ? " --big-endian" : ""), saved.bars_mb, saved.workers, saved.games);
+    }
+    
+    char name[32];
+    double time_ms;
+    while(!error && fscanf(file, "%31s %lf", name, &time_ms) == 2) {
+        for(unsigned int s=0; s < BENCH_STEP_COUNT; s++) {
+            if(strcmp(name, bench_step_names[s]) == 0) baseline[s] = time_ms;
+        }
+    }
+    
+    if(error) printf("The baseline file %s is not valid.\n", filename);
+    fclose(file);
+    
+    return error;
+}
+
+//Writes a baseline file. Returns 0 on success, and 1 on errors.
+bool bench_writeBaseline(const char* filename, const bench_params_t* params, const double* results) {
+    FILE* file = fopen(filename, "w");
+    if(file == NULL) {
+        perror(filename);
+        return 1;
+    }
+    
+    fprintf(file, "%u %u %u %u %u %u\n", params->tracks, params->channels, params->big_endian, params->bars_mb, params->workers, params->games);
+    for(unsigned int s=0; s < BENCH_STEP_COUNT; s++) fprintf(file, "%s %.6f\n", bench_step_names[s], results[s]);
+    
+    bool error = (ferror(file) != 0);
+    if(fclose(file) != 0) error = 1;
+    if(error) perror(filename);
+    
+    return error;
+}
+
+int main(int argc, char** args) {
+    if(argc > 1 && (strcmp(args[1], "--help") == 0 || strcmp(args[1], "-h") == 0)) {
+        printf("Automatic BARS Patcher %s benchmark\n\nUsage: bars_patcher_benchmark [options...]\n\n", barspatcher_getVersionString());
+        printf("Options:\n--dir [directory path] - Directory for the generated data, bench-data by default\n--tracks [count] - Number of tracks, 1000 by default\n--channels [count] - Channels in every BWAV file, 2 by default\n--big-endian - Generate big endian files\n--bars-size [size in MB] - Fill the BARS file with sample data up to this size, no sample data by default\n--workers [count] - Number of threads used for reading BWAV files, one per CPU core by default\n--runs [count] - Number of times every step is timed, the median is shown, 5 by default\n--reuse - Use the data that was generated by the last run with the same --dir\n--baseline [file path] - Compare the results against a baseline file\n--save-baseline [file path] - Save the results as a baseline file\n--games [count] - Number of games in the generated game config file, 1000 by default\n");
+        
+        return 0;
+    }
+    
+    //Command line options
+    const char* opts[] = {"--dir","--tracks","--channels","--big-endian","--bars-size","--workers","--runs","--reuse","--baseline","--save-baseline","--games"};
+    const unsigned int optcount = 11;
+    const bool optrequiredarg[optcount] = {1,1,1,0,1,1,1,0,1,1,1};
+    bool  optused  [optcount] = {0};
+    char* optargstr[optcount];
+    
+    //Parse command line options
+    for(int a=1;a<argc;a++) {
+        int vOpt = -1;
+        for(unsigned int o=0;o<optcount;o++) {
+            if(strcmp(args[a], opts[o]) == 0) {
+                vOpt = o;
+                break;
+            }
+        }
+        if(vOpt < 0) {std::cerr << "Unknown option '" << args[a] << "'.\n"; return 1;}
+        optused[vOpt] = 1;
+        if(optrequiredarg[vOpt]) {
+            if(a+1 < argc) {
+                optargstr[vOpt] = args[++a];
+            } else {
+                std::cerr << "Option " << opts[vOpt] << " requires an argument.\n";
+                return 1;
+            }
+        }
+    }
+    
+    const char* dirname = (optused[0] ? optargstr[0] : "bench-data");
+    
+    bench_params_t params;
+    params.tracks = (optused[1] ? strtoul(optargstr[1], NULL, 10) : 1000);
+    params.channels = (optused[2] ? strtoul(optargstr[2], NULL, 10) : 2);
+    params.big_endian = optused[3];
+    params.bars_mb = (optused[4] ? strtoul(optargstr[4], NULL, 10) : 0);
+    params.workers = (optused[5] ? strtoul(optargstr[5], NULL, 10) : 0);
+    params.games = (optused[10] ? strtoul(optargstr[10], NULL, 10) : 1000);
+    unsigned int runs = (optused[6] ? strtoul(optargstr[6], NULL, 10) : 5);
+    
+    if(params.tracks == 0 || params.tracks > 999999 || params.channels == 0 || params.channels > 16 || runs == 0 || (optused[5] && params.workers == 0) || params.games > 999999) {
+        std::cerr << "Invalid benchmark parameters.\n";
+        return 1;
+    }
+    
+    //Read the baseline first, so a missing file doesn't waste a whole run
+    double baseline[BENCH_STEP_COUNT] = {0};
+    if(optused[8] && bench_readBaseline(optargstr[8], &params, baseline)) return 2;
+    
+    if(!optused[7]) {
+        printf("Generating %u tracks with %u channel%s (%s endian) in %s...\n", params.tracks, params.channels, (params.channels == 1 ? "" : "s"), (params.big_endian ? "big" : "little"), dirname);
+        
+        double start = bench_time_ms();
+        if(bench_generate(dirname, &params)) return 2;
+        printf("Generated in %.1f ms.\n\n", bench_time_ms() - start);
+    }
+    
+    double results[BENCH_STEP_COUNT] = {0};
+    if(bench_run(dirname, &params, runs, results)) {
+        printf("The benchmark failed.\n");
+        return 2;
+    }
+    
+    unsigned int workers = barspatcher_workerCount(params.workers);
+    printf("Median of %u run%s, %u worker%s:\n", runs, (runs == 1 ? "" : "s"), workers, (workers == 1 ? "" : "s"));
+    
+    double total = 0, baseline_total = 0;
+    for(unsigned int s=0; s < BENCH_STEP_COUNT; s++) {
+        bench_printResult(bench_step_names[s], results[s], baseline[s]);
+        
+        //A run only does one of the two locating steps, and only batch mode loads a game config
+        if(s == 3 || s == 6) continue;
+        total += results[s];
+        baseline_total += baseline[s];
+    }
+    bench_printResult("total", total, baseline_total);
+    
+    if(optused[9] && bench_writeBaseline(optargstr[9], &params, results)) return 2;
+    
+    return 0;
+}
@@ -0,0 +1 @@
+g++ -O2 -pipe benchmark.cpp -o bars_patcher_benchmark -Wall -Wextra -pthread && ./bars_patcher_benchmark "$@"
@@ -1 +1 @@
-g++ -O2 -pipe main.cpp -o auto_bars_patcher -Wall -Wextra
+g++ -O2 -pipe main.cpp -o auto_bars_patcher -Wall -Wextra -pthread
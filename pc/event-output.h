@@ -0,0 +1,117 @@
+//Track event output for the PC frontend of automatic BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Track events (see bars-patcher-core/events.h) are printed as text by the core. The frontend can instead print them
+//as JSON lines, one object per event, or not print them at all so that large batch runs only print their results.
+
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define EVENT_OUTPUT_TEXT 0
+#define EVENT_OUTPUT_JSON 1
+#define EVENT_OUTPUT_NONE 2
+
+//User data of the event callbacks
+struct event_output_t {
+    //Game ID added to every JSON line in batch mode, or NULL
+    const char* game_id;
+};
+
+//Returns the output format for a --events argument, or -1 if it is unknown.
+int event_output_format(const char* name) {
+    if(strcmp(name, "text") == 0) return EVENT_OUTPUT_TEXT;
+    if(strcmp(name, "json") == 0) return EVENT_OUTPUT_JSON;
+    if(strcmp(name, "none") == 0) return EVENT_OUTPUT_NONE;
+    return -1;
+}
+
+//Space kept free in a line after every string, for the numbers that follow it
+#define EVENT_OUTPUT_LINE_RESERVE 128
+
+//Adds formatted text to a line buffer, the line is cut off if it doesn't fit.
+void event_output_printf(char* line, size_t* length, size_t size, const char* format, ...) {
+    if(*length + 1 >= size) return;
+    
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(line + *length, size - *length, format, args);
+    va_end(args);
+    
+    if(written > 0) *length += written;
+    if(*length > size - 1) *length = size - 1;
+}
+
+//Adds a JSON string with quotes to a line buffer, long strings are cut off.
+void event_output_json_string(char* line, size_t* length, size_t size, const char* string) {
+    size_t end = *length;
+    line[end++] = '"';
+    
+    for(const unsigned char* c = (const unsigned char*)string; *c != '\0' && end + 7 + EVENT_OUTPUT_LINE_RESERVE < size; c++) {
+        if(*c == '"' || *c == '\\') {
+            line[end++] = '\\';
+            line[end++] = *c;
+        }
+        else if(*c < 0x20) end += snprintf(line + end, size - end, "\\u%04x", *c);
+        else line[end++] = *c;
+    }
+    
+    line[end++] = '"';
+    line[end] = '\0';
+    *length = end;
+}
+
+//Event callback that prints every event as a JSON line.
+void event_output_json(const barspatcher_event_t* event, void* user_data) {
+    const event_output_t* output = (const event_output_t*)user_data;
+    const char* type_names[] = {"patched", "skipped", "no_space", "crc_mismatch", "crc_fixed"};
+    
+    //The line is written at once, so lines of games patched at the same time don't mix
+    char line[2048];
+    size_t length = 0;
+    event_output_printf(line, &length, sizeof(line), "{\"event\":\"%s\",", (event->type < 5 ? type_names[event->type] : "unknown"));
+    
+    //Game IDs are short, file names get the rest of the line
+    if(output != NULL && output->game_id != NULL) {
+        event_output_printf(line, &length, sizeof(line), "\"game\":");
+        event_output_json_string(line, &length, sizeof(line) / 2, output->game_id);
+        event_output_printf(line, &length, sizeof(line), ",");
+    }
+    
+    event_output_printf(line, &length, sizeof(line), "\"name\":");
+    event_output_json_string(line, &length, sizeof(line), event->name);
+    
+    switch(event->type) {
+        case BARSPATCHER_EVENT_PATCHED:
+            event_output_printf(line, &length, sizeof(line), ",\"crc32\":\"0x%08X\",\"locations\":%u}\n", event->og_crc32, event->locations);
+            break;
+        case BARSPATCHER_EVENT_SKIPPED:
+            event_output_printf(line, &length, sizeof(line), ",\"reason\":\"%s\"", barspatcher_getSkipReasonString(event->reason));
+            if(event->og_crc32 != 0) event_output_printf(line, &length, sizeof(line), ",\"crc32\":\"0x%08X\"", event->og_crc32);
+            event_output_printf(line, &length, sizeof(line), "}\n");
+            break;
+        case BARSPATCHER_EVENT_CRC_MISMATCH:
+        case BARSPATCHER_EVENT_CRC_FIXED:
+            event_output_printf(line, &length, sizeof(line), ",\"mod_crc32\":\"0x%08X\",\"data_crc32\":\"0x%08X\"}\n", event->mod_crc32, event->data_crc32);
+            break;
+        default:
+            event_output_printf(line, &length, sizeof(line), ",\"crc32\":\"0x%08X\",\"offset\":%llu}\n", event->og_crc32, (unsigned long long)event->offset);
+            break;
+    }
+    
+    fwrite(line, 1, length, stdout);
+}
+
+//Event callback that ignores every event.
+void event_output_none(const barspatcher_event_t* event, void* user_data) {
+    (void)event; (void)user_data;
+}
+
+//Returns the event callback for an output format, NULL prints the events as text.
+barspatcher_event_callback_t event_output_callback(int format) {
+    if(format == EVENT_OUTPUT_JSON) return event_output_json;
+    if(format == EVENT_OUTPUT_NONE) return event_output_none;
+    return NULL;
+}
@@ -7,23 +7,58 @@
 
 #define BARSPATCHER_VERSION_PC
 #include "../bars-patcher-core/bars-patcher.h"
+//Batch mode
+#include "batch.h"
+//Watch mode
+#include "watch.h"
+//Track event output
+#include "event-output.h"
+
+//Prints run statistics as text, or as a single JSON object.
+void print_stats(const barspatcher_stats_t* stats, bool json) {
+    const char* phase_names[] = {"list", "load", "locate", "patch", "write", "total"};
+    const double phase_ms[] = {stats->list_ms, stats->load_ms, stats->locate_ms, stats->patch_ms, stats->write_ms, stats->total_ms};
+    const char* counter_names[] = {"files_opened", "bytes_read", "bytes_written", "scan_bytes", "matches_found", "tracks_patched", "tracks_skipped"};
+    const uint64_t counters[] = {stats->files_opened, stats->bytes_read, stats->bytes_written, stats->scan_bytes, stats->matches_found, stats->tracks_patched, stats->tracks_skipped};
+    
+    if(json) {
+        printf("{");
+        for(unsigned int i=0; i < 6; i++) printf("\"%s_ms\":%.3f,", phase_names[i], phase_ms[i]);
+        for(unsigned int i=0; i < 7; i++) printf("\"%s\":%llu%s", counter_names[i], (unsigned long long)counters[i], (i < 6 ? "," : ""));
+        printf("}\n");
+        return;
+    }
+    
+    printf("\nStatistics:\n");
+    for(unsigned int i=0; i < 6; i++) printf("%-15s %10.3f ms\n", phase_names[i], phase_ms[i]);
+    for(unsigned int i=0; i < 7; i++) printf("%-15s %10llu\n", counter_names[i], (unsigned long long)counters[i]);
+}
 
 int main(int argc, char** args) {
     if(argc < 2 || strcmp(args[1], "--help") == 0 || strcmp(args[1], "-h") == 0) {
         printf("Automatic BARS Patcher %s\nCopyright (C) 2020 I.C.\nThis program is free software, see the license file for more information.\n\nUsage: auto_bars_patcher [options...]\n\n", barspatcher_getVersionString());
-        printf("Options:\n--og-stream-dir [directory path] - Directory with original unmodified BWAV files\n--mod-stream-dir [directory path] - Directory with modified BWAV files\n--og-bars-file [file path] - Original unmodified BARS file\n--bars-output-file [file path] - Location for the patched BARS file\n\n-v - Verbose output\n");
+        printf("Options:\n--og-stream-dir [directory path] - Directory with original unmodified BWAV files\n--mod-stream-dir [directory path] - Directory with modified BWAV files\n--og-bars-file [file path] - Original unmodified BARS file\n--bars-output-file [file path] - Location for the patched BARS file\n--og-bars-file and --bars-output-file can be used more than once to patch several BARS files that use the same BWAV files, in one pass over the BWAV files\n\n--stream [window size in KB] - Streaming mode, read the BARS file in windows of this size instead of loading it at once\n--workers [count] - Number of threads used for reading BWAV files and searching big BARS files, one per CPU core by default\n--manifest [file path] - Cache of original BWAV file headers, created on the first run and reused on later runs\n--incremental - Keep a run state next to the output file and only apply the modded files that changed since the last incremental run\n-v - Verbose output\n\n--watch - Keep running and patch the output again every time the modded BWAV directory changes, only changed files are applied\n\n--stats [text or json] - Show the time of every phase and I/O counters after the run\n--events [text, json or none] - Print what happened to every track as text, as one JSON object per line, or not at all\n\n--config [file path] - Batch mode, patch every game in a game config file instead of using the path options\n--games [id,id,...] - Only patch these games from the config file\n--jobs [count] - Number of games patched at the same time in batch mode, one per CPU core by default\n--path-cache [file path] - Save the resolved '*' paths of the config file, and reuse them while their directories don't change\n\n--plan-output [file path] - Also save a patch plan file with every patched range of the BARS file\n--apply-plan [file path] - Patch the BARS file with a patch plan file instead of the BWAV files, only uses --og-bars-file and --bars-output-file\n--revert-plan [file path] - Restore the unpatched BARS file from a file that was patched with this patch plan file\n\n--crc-check [off, warn or fix] - Check the CRC32 hash in every modded BWAV file against its sample data, and warn about or fix hashes that don't match, off by default\n");
         
         return 0;
     }
     
     //Command line options
-    const char* opts[] = {"-og-stream-dir","-mod-stream-dir","-og-bars-file","-bars-output-file","-v"};
-    const char* opts_alt[] = {"--og-stream-dir","--mod-stream-dir","--og-bars-file","--bars-output-file","--verbose"};
-    const unsigned int optcount = 5;
-    const bool optrequiredarg[optcount] = {1,1,1,1,0};
-    bool  optused  [optcount];
+    const char* opts[] = {"-og-stream-dir","-mod-stream-dir","-og-bars-file","-bars-output-file","-v","-stream","-workers","-manifest","-incremental","-config","-games","-jobs","-watch","-stats","-events","-path-cache","-plan-output","-apply-plan","-revert-plan","-crc-check"};
+    const char* opts_alt[] = {"--og-stream-dir","--mod-stream-dir","--og-bars-file","--bars-output-file","--verbose","--stream","--workers","--manifest","--incremental","--config","--games","--jobs","--watch","--stats","--events","--path-cache","--plan-output","--apply-plan","--revert-plan","--crc-check"};
+    const unsigned int optcount = 20;
+    const bool optrequiredarg[optcount] = {1,1,1,1,0,1,1,1,0,1,1,1,0,1,1,1,1,1,1,1};
+    bool  optused  [optcount] = {0};
     char* optargstr[optcount];
     
+    //BARS input and output files can be given more than once for multi-archive mode
+    const char** bars_input_files = (const char**)malloc(argc * sizeof(char*));
+    const char** bars_output_files = (const char**)malloc(argc * sizeof(char*));
+    uint32_t bars_input_count = 0, bars_output_count = 0;
+    if(bars_input_files == NULL || bars_output_files == NULL) {
+        std::cerr << "Could not allocate memory for the command line options.\n";
+        return 1;
+    }
+    
     //Parse command line options
     for(int a=1;a<argc;a++) {
         int vOpt = -1;
@@ -43,6 +78,8 @@ int main(int argc, char** args) {
         if(optrequiredarg[vOpt]) {
             if(a+1 < argc) {
                 optargstr[vOpt] = args[++a];
+                if(vOpt == 2) bars_input_files[bars_input_count++] = optargstr[vOpt];
+                if(vOpt == 3) bars_output_files[bars_output_count++] = optargstr[vOpt];
             } else {
                 std::cerr << "Option " << opts[vOpt] << " requires an argument.\n";
                 return 1;
@@ -51,19 +88,195 @@ int main(int argc, char** args) {
     }
     
     //Check options
-    if(!(optused[0] && optused[1] && optused[2] && optused[3])) {
+    if(optused[17] || optused[18]) {
+        //Plan mode only uses the BARS files
+        for(unsigned int o=0; o < optcount; o++) {
+            if(optused[o] && o != 2 && o != 3 && o != 4 && o != 17 && o != 18) {
+                std::cerr << "Option " << opts_alt[o] << " can't be used with --apply-plan or --revert-plan.\n";
+                return 1;
+            }
+        }
+        if(optused[17] && optused[18]) {
+            std::cerr << "The --apply-plan and --revert-plan options can't be used together.\n";
+            return 1;
+        }
+        if(!(optused[2] && optused[3]) || bars_input_count > 1 || bars_output_count > 1) {
+            std::cerr << "One --og-bars-file and one --bars-output-file option must be used with a patch plan.\n";
+            return 1;
+        }
+        
+        bool revert = optused[18];
+        unsigned char plan_res = barspatcher_runPlan(optused[4], optargstr[revert ? 18 : 17], optargstr[2], optargstr[3], revert);
+        free(bars_input_files);
+        free(bars_output_files);
+        
+        if(plan_res != 0) {
+            printf("BARS patch error. (%d, %s)\n", plan_res, barspatcher_getErrorString(plan_res));
+            return 2;
+        }
+        return 0;
+    }
+    else if(optused[9]) {
+        if(optused[0] || optused[1] || optused[2] || optused[3]) {
+            std::cerr << "Directory and file path options can't be used in batch mode.\n";
+            return 1;
+        }
+        if(optused[7]) {
+            std::cerr << "Manifest files can't be used in batch mode.\n";
+            return 1;
+        }
+    }
+    else if(optused[10] || optused[11] || optused[15]) {
+        std::cerr << "The --games, --jobs and --path-cache options can only be used with --config.\n";
+        return 1;
+    }
+    else if(!(optused[0] && optused[1] && optused[2] && optused[3])) {
         std::cout << "All directory and file path options must be used.\n";
         return 1;
     }
     
+    //Multi-archive mode
+    bool multi_archive = (bars_input_count > 1 || bars_output_count > 1);
+    if(multi_archive) {
+        if(bars_input_count != bars_output_count) {
+            std::cerr << "Every --og-bars-file option needs its own --bars-output-file option.\n";
+            return 1;
+        }
+        if(optused[5] || optused[8] || optused[12] || optused[16]) {
+            std::cerr << "Several BARS files can't be patched in streaming, incremental or watch mode, or with a patch plan.\n";
+            return 1;
+        }
+    }
+    
+    //Streaming window size
+    uint64_t stream_window = 0;
+    if(optused[5]) {
+        stream_window = strtoull(optargstr[5], NULL, 10) * 1024;
+        if(stream_window == 0) {
+            std::cerr << "Invalid streaming window size '" << optargstr[5] << "'.\n";
+            return 1;
+        }
+    }
+    
+    //Worker thread count, 0 uses one thread per CPU core
+    unsigned int workers = 0;
+    if(optused[6]) {
+        workers = strtoul(optargstr[6], NULL, 10);
+        if(workers == 0) {
+            std::cerr << "Invalid worker count '" << optargstr[6] << "'.\n";
+            return 1;
+        }
+    }
+    
+    if(optused[5] && optused[8]) {
+        std::cerr << "Streaming mode can't be used in incremental mode.\n";
+        return 1;
+    }
+    
+    if(optused[12] && (optused[5] || optused[9])) {
+        std::cerr << "Watch mode can't be used in streaming or batch mode.\n";
+        return 1;
+    }
+    
+    if(optused[16] && (optused[5] || optused[9] || optused[12])) {
+        std::cerr << "Patch plans can't be saved in streaming, batch or watch mode.\n";
+        return 1;
+    }
+    
+    //Statistics format
+    bool stats_json = 0;
+    if(optused[13]) {
+        if(optused[5] || optused[9] || optused[12]) {
+            std::cerr << "Statistics can't be shown in streaming, batch or watch mode.\n";
+            return 1;
+        }
+        
+        stats_json = (strcmp(optargstr[13], "json") == 0);
+        if(!stats_json && strcmp(optargstr[13], "text") != 0) {
+            std::cerr << "Invalid statistics format '" << optargstr[13] << "'.\n";
+            return 1;
+        }
+    }
+    
+    //Track event output format
+    int events = EVENT_OUTPUT_TEXT;
+    if(optused[14]) {
+        events = event_output_format(optargstr[14]);
+        if(events < 0) {
+            std::cerr << "Invalid event output format '" << optargstr[14] << "'.\n";
+            return 1;
+        }
+    }
+    barspatcher_event_callback_t event_callback = event_output_callback(events);
+    
+    //CRC32 check of modded files
+    unsigned char crc_check = BARSPATCHER_CRC_CHECK_OFF;
+    if(optused[19]) {
+        if(strcmp(optargstr[19], "warn") == 0) crc_check = BARSPATCHER_CRC_CHECK_WARN;
+        else if(strcmp(optargstr[19], "fix") == 0) crc_check = BARSPATCHER_CRC_CHECK_FIX;
+        else if(strcmp(optargstr[19], "off") != 0) {
+            std::cerr << "Invalid CRC32 check mode '" << optargstr[19] << "'.\n";
+            return 1;
+        }
+        
+        if(crc_check != BARSPATCHER_CRC_CHECK_OFF && optused[5]) {
+            std::cerr << "CRC32 hashes can't be checked in streaming mode.\n";
+            return 1;
+        }
+    }
+    
+    //Batch mode
+    if(optused[9]) {
+        //Games patched at the same time, 0 uses one per CPU core
+        unsigned int jobs = 0;
+        if(optused[11]) {
+            jobs = strtoul(optargstr[11], NULL, 10);
+            if(jobs == 0) {
+                std::cerr << "Invalid job count '" << optargstr[11] << "'.\n";
+                return 1;
+            }
+        }
+        
+        batch_options_t batch_options;
+        batch_options.verbose = optused[4];
+        batch_options.stream_window = stream_window;
+        batch_options.incremental = optused[8];
+        batch_options.events = events;
+        batch_options.path_cache = (optused[15] ? optargstr[15] : NULL);
+        batch_options.crc_check = crc_check;
+        //Games already run in parallel, only use more threads for each game if there is a single job or it was requested
+        batch_options.workers = (optused[6] || jobs == 1 ? workers : 1);
+        
+        return batch_run(optargstr[9], (optused[10] ? optargstr[10] : NULL), &batch_options, jobs);
+    }
+    
+    //Original file manifest
+    const char* manifest_filename = (optused[7] ? optargstr[7] : NULL);
+    
+    //Watch mode, always incremental
+    if(optused[12]) return watch_run(optused[4], optargstr[0], optargstr[1], optargstr[2], optargstr[3], workers, manifest_filename, event_callback, NULL, crc_check);
+    
     unsigned char bars_res;
-    bars_res = barspatcher_run(optused[4] ,optargstr[0], optargstr[1], optargstr[2], optargstr[3]);
+    if(multi_archive) {
+        barspatcher_stats_t stats;
+        bars_res = barspatcher_runMulti(optused[4], optargstr[0], optargstr[1], bars_input_files, bars_output_files, bars_input_count, workers, manifest_filename, &stats, event_callback, NULL, crc_check);
+        if(optused[13]) print_stats(&stats, stats_json);
+    }
+    else if(optused[5]) bars_res = barspatcher_runStreaming(optused[4], optargstr[0], optargstr[1], optargstr[2], optargstr[3], stream_window, workers, manifest_filename, event_callback, NULL);
+    else {
+        barspatcher_stats_t stats;
+        bars_res = barspatcher_run(optused[4] ,optargstr[0], optargstr[1], optargstr[2], optargstr[3], workers, manifest_filename, optused[8], &stats, event_callback, NULL, (optused[16] ? optargstr[16] : NULL), crc_check);
+        if(optused[13]) print_stats(&stats, stats_json);
+    }
+    
+    free(bars_input_files);
+    free(bars_output_files);
     
     if(bars_res >= 100) {
         printf("BARS patch error. (%d, %s)\n", bars_res, barspatcher_getErrorString(bars_res));
         return 2;
     }
-    else if(bars_res > 0) {
+    else if(bars_res > 0 && event_callback == NULL) {
         printf("%d %stracks were skipped.\n", bars_res, (bars_res == 99 ? "or more " : ""));
     }
     
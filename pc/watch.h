@@ -0,0 +1,148 @@
+//Watch mode for the PC frontend of automatic BARS patcher
+//Copyright (C) 2020 I.C.
+
+//Watch mode patches the BARS file once and then keeps it in a patching context (see bars-patcher-core/context.h),
+//together with its track table and the headers of the original BWAV files. The modded BWAV directory is watched
+//with inotify, and after every burst of changes the output is patched again in incremental mode (see
+//bars-patcher-core/incremental.h), so only the modded files that changed are read and only the ranges that
+//changed are written into the output file.
+
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#define WATCH_SUPPORTED
+#endif
+
+//Time without new changes before the output is patched again, in milliseconds
+#define WATCH_DEBOUNCE_MS 50
+
+#if defined WATCH_SUPPORTED
+
+//Reads all pending inotify events.
+//Returns 0 if the directory is still watched, and 1 if the directory was removed or on errors.
+bool watch_read_events(int fd) {
+    //Buffer aligned for inotify_event
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool stopped = 0;
+    
+    while(1) {
+        ssize_t length = read(fd, buf, sizeof(buf));
+        if(length < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN) break;
+            perror("inotify");
+            return 1;
+        }
+        if(length == 0) break;
+        
+        for(char* ptr = buf; ptr < buf + length;) {
+            const struct inotify_event* event = (const struct inotify_event*)ptr;
+            if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) stopped = 1;
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    
+    return stopped;
+}
+
+//Patches the output in incremental mode and prints the result.
+void watch_patch(barspatcher_context_t* ctx, const char* mod_stream_dirname, const char* bars_output_filename) {
+    double start = barspatcher_timeMs();
+    
+    unsigned char res = barspatcher_contextApply(ctx, mod_stream_dirname, bars_output_filename);
+    if(res < 100) res = barspatcher_contextWrite(ctx, bars_output_filename);
+    
+    if(res >= 100) {
+        printf("BARS patch error. (%d, %s)\n", res, barspatcher_getErrorString(res));
+        return;
+    }
+    
+    uint64_t patched_files = ctx->patched_files, skipped_files = ctx->skipped_files;
+    printf("%llu track%s patched, %llu track%s skipped, %llu unchanged. (%.1f ms)\n", (unsigned long long)patched_files, (patched_files == 1 ? "" : "s"), (unsigned long long)skipped_files, (skipped_files == 1 ? "" : "s"), (unsigned long long)ctx->reused_count, barspatcher_timeMs() - start);
+}
+
+#endif
+
+/*
+ * Patches the output, then patches it again every time the modded BWAV directory changes.
+ * Only returns on errors.
+ * 
+ * Parameters are the same as for barspatcher_run.
+ * event_callback is set on the context once, and receives the events of every patch.
+ * 
+ * Returns 2 on errors.
+ * 
+ */
+int watch_run(bool verbose, const char* og_stream_dirname, const char* mod_stream_dirname, const char* bars_input_filename, const char* bars_output_filename, unsigned int workers, const char* manifest_filename, barspatcher_event_callback_t event_callback = NULL, void* event_user_data = NULL, unsigned char crc_check = BARSPATCHER_CRC_CHECK_OFF) {
+    #if defined WATCH_SUPPORTED
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd < 0) {
+        perror("inotify");
+        return 2;
+    }
+    
+    //Watch before the first patch, so changes made during it are not missed
+    if(inotify_add_watch(fd, mod_stream_dirname, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR) < 0) {
+        perror(mod_stream_dirname);
+        close(fd);
+        return 2;
+    }
+    
+    barspatcher_context_t ctx;
+    unsigned char open_res = barspatcher_contextOpen(&ctx, verbose, og_stream_dirname, bars_input_filename, workers, manifest_filename);
+    if(open_res != 0) {
+        printf("BARS patch error. (%d, %s)\n", open_res, barspatcher_getErrorString(open_res));
+        close(fd);
+        return 2;
+    }
+    
+    if(event_callback != NULL) barspatcher_contextSetEventCallback(&ctx, event_callback, event_user_data);
+    ctx.crc_check = crc_check;
+    
+    watch_patch(&ctx, mod_stream_dirname, bars_output_filename);
+    printf("Watching %s for changes.\n", mod_stream_dirname);
+    
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    
+    bool stopped = 0;
+    while(!stopped) {
+        //Wait for the first change
+        if(poll(&pfd, 1, -1) < 0) {
+            if(errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if(watch_read_events(fd)) break;
+        
+        //Wait until there were no changes for a while, editors often write a file in several steps
+        while(!stopped) {
+            int poll_res = poll(&pfd, 1, WATCH_DEBOUNCE_MS);
+            if(poll_res < 0 && errno == EINTR) continue;
+            if(poll_res <= 0) break;
+            stopped = watch_read_events(fd);
+        }
+        
+        if(!stopped) watch_patch(&ctx, mod_stream_dirname, bars_output_filename);
+    }
+    
+    printf("Stopped watching %s.\n", mod_stream_dirname);
+    
+    barspatcher_contextFree(&ctx);
+    close(fd);
+    
+    return 2;
+    #else
+    (void)verbose; (void)og_stream_dirname; (void)mod_stream_dirname; (void)bars_input_filename; (void)bars_output_filename; (void)workers; (void)manifest_filename; (void)event_callback; (void)event_user_data; (void)crc_check;
+    printf("Watch mode is not supported on this platform.\n");
+    return 2;
+    #endif
+}
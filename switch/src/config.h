@@ -3,7 +3,10 @@
 
 #pragma once
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
 
 //Default error message for memory allocation errors.
 const char* malloc_errstr = "\x1b[31mMemory allocation error. Please make sure you have enough free memory, and try launching this program from a title instead of the album.\x1b[0m\n";
@@ -17,6 +20,8 @@ const char* config_path = "/switch/auto-bars-patcher/game-config.txt";
 
 struct bars_game_config_t {
     //No newline characters allowed in any of these strings.
+    //Strings loaded from the config file point into the file data of the config storage,
+    //replace them with config_set_string.
     //Short string for identification. Use only a-z, 0-9
     char* id;
     //Full game title.
@@ -32,12 +37,22 @@ struct bars_game_config_t {
     char* output_bars_path;
 };
 
-//Limit of game entries in the configuration file.
-#define MAX_CONFIG_SIZE 128
+//Number of strings in a game entry.
+#define CONFIG_ENTRY_STRINGS 6
 
 struct bars_config_storage_t {
-    bars_game_config_t* entries [MAX_CONFIG_SIZE];
-    uint16_t entries_loaded;
+    //Game entries, in the order of the config file
+    bars_game_config_t* entries;
+    uint32_t entries_loaded;
+    uint32_t entries_capacity;
+    
+    //Contents of the config file with every line null terminated, loaded strings point into it
+    char* file_data;
+    size_t file_size;
+    
+    //Hash index of game IDs, each slot is an entry number + 1, or 0 if it is empty
+    uint32_t* id_index;
+    uint32_t id_index_size;
 };
 
 
@@ -45,98 +60,169 @@ struct bars_config_storage_t {
 
 //Initializes config storage.
 void config_init(bars_config_storage_t* config) {
-    config->entries_loaded = 0;
-    config_free(config);
+    memset(config, 0, sizeof(bars_config_storage_t));
 }
 
-//Frees a config entry.
-void config_free_entry(bars_game_config_t* (&entry)) {
-    free(entry->id);
-    free(entry->full_name);
-    free(entry->bars_path);
-    free(entry->stream_dir);
-    free(entry->mod_stream_dir);
-    free(entry->output_bars_path);
-    
-    free(entry);
-    entry = NULL;
+//Sets pointer addresses of all strings of an entry, in the order of the struct.
+void config_entry_strings(bars_game_config_t* entry, char** strings[CONFIG_ENTRY_STRINGS]) {
+    strings[0] = &entry->id;
+    strings[1] = &entry->full_name;
+    strings[2] = &entry->bars_path;
+    strings[3] = &entry->stream_dir;
+    strings[4] = &entry->mod_stream_dir;
+    strings[5] = &entry->output_bars_path;
 }
 
-//Frees all allocated config entries.
+//Returns 1 if a string was allocated by itself, and 0 if it points into the config file data.
+bool config_string_owned(const bars_config_storage_t* config, const char* str) {
+    if(config->file_data == NULL) return 1;
+    return !(str >= config->file_data && str <= config->file_data + config->file_size);
+}
+
+//Replaces a string of an entry, the old string is freed if it was allocated by itself.
+//value must be allocated with malloc or point into the config file data. Nothing is done if value is NULL.
+void config_set_string(bars_config_storage_t* config, char* (&str), char* value) {
+    if(value == NULL) return;
+    if(str != NULL && config_string_owned(config, str)) free(str);
+    str = value;
+}
+
+//Frees all config entries and the config file data.
 void config_free(bars_config_storage_t* config) {
-    uint16_t i;
-    
-    for(i = 0; i < config->entries_loaded && i < MAX_CONFIG_SIZE; i++) {
-        config_free_entry(config->entries[i]);
+    for(uint32_t e = 0; e < config->entries_loaded; e++) {
+        char** strings[CONFIG_ENTRY_STRINGS];
+        config_entry_strings(&config->entries[e], strings);
+        
+        for(uint16_t k = 0; k < CONFIG_ENTRY_STRINGS; k++) {
+            if(config_string_owned(config, *strings[k])) free(*strings[k]);
+        }
     }
     
-    //Wipe everything else with nullptr
-    for(; i < MAX_CONFIG_SIZE; i++) {
-        config->entries[i] = NULL;
+    free(config->entries);
+    free(config->file_data);
+    free(config->id_index);
+    
+    config_init(config);
+}
+
+//FNV-1a hash of a game ID.
+uint32_t config_id_hash(const char* id, size_t length) {
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)id[i]) * 16777619u;
+    return hash;
+}
+
+/*
+ * Finds a game entry by its ID.
+ * 
+ * id - Game ID, it doesn't have to be null terminated
+ * length - Length of the game ID
+ * 
+ * Returns the entry number, or -1 if there is no entry with this ID.
+ * 
+ */
+int64_t config_find(const bars_config_storage_t* config, const char* id, size_t length) {
+    if(config->id_index_size == 0) return -1;
+    
+    uint32_t mask = config->id_index_size - 1;
+    
+    for(uint32_t slot = config_id_hash(id, length) & mask; config->id_index[slot] != 0; slot = (slot + 1) & mask) {
+        const char* entry_id = config->entries[config->id_index[slot] - 1].id;
+        if(strncmp(entry_id, id, length) == 0 && entry_id[length] == '\0') return config->id_index[slot] - 1;
     }
     
-    config->entries_loaded = 0;
+    return -1;
 }
 
-//Allocates an entry and its strings with data.
+//Adds an entry number to the ID index, which must have a free slot.
+void config_index_insert(bars_config_storage_t* config, uint32_t entry) {
+    const char* id = config->entries[entry].id;
+    uint32_t mask = config->id_index_size - 1;
+    uint32_t slot = config_id_hash(id, strlen(id)) & mask;
+    
+    while(config->id_index[slot] != 0) slot = (slot + 1) & mask;
+    config->id_index[slot] = entry + 1;
+}
+
+//Makes space for one more entry, and keeps the ID index at most half full.
 //Returns 0 on success, and 1 on memory error.
-bool config_alloc_load_entry(bars_game_config_t* (&entry), const char* id, const char* full_name, const char* bars_path, const char* stream_dir, const char* mod_stream_dir, const char* output_bars_path) {
-    entry = (bars_game_config_t*)malloc(sizeof(bars_game_config_t));
-    if(entry == NULL) return 1;
+bool config_reserve_entry(bars_config_storage_t* config) {
+    if(config->entries_loaded >= config->entries_capacity) {
+        uint32_t capacity = (config->entries_capacity == 0 ? 16 : config->entries_capacity * 2);
+        
+        bars_game_config_t* entries = (bars_game_config_t*)realloc(config->entries, capacity * sizeof(bars_game_config_t));
+        if(entries == NULL) return 1;
+        
+        config->entries = entries;
+        config->entries_capacity = capacity;
+    }
+    
+    if((config->entries_loaded + 1) * 2 > config->id_index_size) {
+        uint32_t size = (config->id_index_size == 0 ? 32 : config->id_index_size * 2);
+        
+        uint32_t* id_index = (uint32_t*)calloc(size, sizeof(uint32_t));
+        if(id_index == NULL) return 1;
+        
+        free(config->id_index);
+        config->id_index = id_index;
+        config->id_index_size = size;
+        
+        for(uint32_t e = 0; e < config->entries_loaded; e++) config_index_insert(config, e);
+    }
     
-    entry->id = NULL;
-    entry->full_name = NULL;
-    entry->bars_path = NULL;
-    entry->stream_dir = NULL;
-    entry->mod_stream_dir = NULL;
-    entry->output_bars_path = NULL;
+    return 0;
+}
+
+//Adds an entry with copies of its strings. The ID must not be in the config yet.
+//Returns 0 on success, and 1 on memory error.
+bool config_add_entry(bars_config_storage_t* config, const char* id, const char* full_name, const char* bars_path, const char* stream_dir, const char* mod_stream_dir, const char* output_bars_path) {
+    if(config_reserve_entry(config)) return 1;
     
-    entry->id = (char*)malloc(strlen(id) + 1);
-    entry->full_name = (char*)malloc(strlen(full_name) + 1);
-    entry->bars_path = (char*)malloc(strlen(bars_path) + 1);
-    entry->stream_dir = (char*)malloc(strlen(stream_dir) + 1);
-    entry->mod_stream_dir = (char*)malloc(strlen(mod_stream_dir) + 1);
-    entry->output_bars_path = (char*)malloc(strlen(output_bars_path) + 1);
+    const char* values[CONFIG_ENTRY_STRINGS] = {id, full_name, bars_path, stream_dir, mod_stream_dir, output_bars_path};
+    char** strings[CONFIG_ENTRY_STRINGS];
+    config_entry_strings(&config->entries[config->entries_loaded], strings);
     
-    if(entry->id == NULL || entry->full_name == NULL || entry->bars_path == NULL || entry->stream_dir == NULL || entry->mod_stream_dir == NULL || entry->output_bars_path == NULL) {
-        config_free_entry(entry);
-        return 1;
+    for(uint16_t k = 0; k < CONFIG_ENTRY_STRINGS; k++) {
+        *strings[k] = (char*)malloc(strlen(values[k]) + 1);
+        
+        if(*strings[k] == NULL) {
+            for(uint16_t f = 0; f < k; f++) free(*strings[f]);
+            return 1;
+        }
+        
+        strcpy(*strings[k], values[k]);
     }
     
-    strcpy(entry->id, id);
-    strcpy(entry->full_name, full_name);
-    strcpy(entry->bars_path, bars_path);
-    strcpy(entry->stream_dir, stream_dir);
-    strcpy(entry->mod_stream_dir, mod_stream_dir);
-    strcpy(entry->output_bars_path, output_bars_path);
+    config_index_insert(config, config->entries_loaded);
+    config->entries_loaded++;
     
     return 0;
 }
 
 
-//Writes config to config file (config_path).
+//Writes config to a config file.
 //Returns 0 on success, and 1 on file errors.
-bool config_write(bars_config_storage_t* config) {
+bool config_write_file(bars_config_storage_t* config, const char* filename) {
     //Try opening file
     FILE* cfile;
-    cfile = fopen(config_path, "wb");
+    cfile = fopen(filename, "wb");
     if(cfile == NULL) return 1;
     
     
     //Write config data to file
-    for(uint16_t entry = 0; entry < config->entries_loaded; entry++) {
+    for(uint32_t entry = 0; entry < config->entries_loaded; entry++) {
         //Header for this game config
-        fprintf(cfile, "^%s\n", config->entries[entry]->id);
+        fprintf(cfile, "^%s\n", config->entries[entry].id);
         //Full game name
-        fprintf(cfile, "full_name=%s\n", config->entries[entry]->full_name);
+        fprintf(cfile, "full_name=%s\n", config->entries[entry].full_name);
         //BARS path
-        fprintf(cfile, "bars_path=%s\n", config->entries[entry]->bars_path);
+        fprintf(cfile, "bars_path=%s\n", config->entries[entry].bars_path);
         //Stream directory
-        fprintf(cfile, "stream_dir=%s\n", config->entries[entry]->stream_dir);
+        fprintf(cfile, "stream_dir=%s\n", config->entries[entry].stream_dir);
         //Modded stream directory
-        fprintf(cfile, "mod_stream_dir=%s\n", config->entries[entry]->mod_stream_dir);
+        fprintf(cfile, "mod_stream_dir=%s\n", config->entries[entry].mod_stream_dir);
         //Output BARS path
-        fprintf(cfile, "output_bars_path=%s\n\n", config->entries[entry]->output_bars_path);
+        fprintf(cfile, "output_bars_path=%s\n\n", config->entries[entry].output_bars_path);
     }
     
     
@@ -151,57 +237,75 @@ bool config_write(bars_config_storage_t* config) {
     return 0;
 }
 
-//Loads config from config file (config_path).
+//Writes config to config file (config_path).
+//Returns 0 on success, and 1 on file errors.
+bool config_write(bars_config_storage_t* config) {
+    return config_write_file(config, config_path);
+}
+
+//Loads config from a config file.
+//If load_default is set, the default config is loaded first as base, and it is written to the file if the file doesn't exist.
+//The file is kept in memory as a whole, and the strings of the entries point into it.
 //Returns 0 on success, and other codes on errors.
 /*
  * Error codes:
  * 1 - Memory error
  * 2 - File I/O error
  * 3 - File too big
- * 4 - Config has too many entries
  * 
  */
-unsigned char config_read(bars_config_storage_t* config) {
+unsigned char config_read_file(bars_config_storage_t* config, const char* filename, bool load_default) {
     config_free(config);
     
-    //Always load default config as base
-    bool cres = config_load_default(config);
-    if(cres) return 1;
+    if(load_default) {
+        bool cres = config_load_default(config);
+        if(cres) return 1;
+    }
     
     FILE* cfile;
     size_t fsize;
     char* fbuf;
-    cfile = fopen(config_path, "rb");
+    cfile = fopen(filename, "rb");
     
     if(cfile == NULL) {
         //Write default config if the file doesn't exist
-        if(errno == ENOENT) {
+        if(load_default && errno == ENOENT) {
             //This function can fail, the config_load function will most likely load the default config again on the next run.
-            config_write(config);
+            config_write_file(config, filename);
             
             return 0;
         }
         
         //Return with error otherwise
+        config_free(config);
         return 2;
     }
     else {
         //Read full file into memory
         fseek(cfile, 0, SEEK_END);
         
-        fsize = ftell(cfile);
+        long ftell_res = ftell(cfile);
         
         fseek(cfile, 0, SEEK_SET);
         
-        //Check if file size isn't too big (4MB)
-        if(fsize > 4000000) {
+        if(ftell_res < 0) {
+            fclose(cfile);
+            config_free(config);
+            return 2;
+        }
+        
+        //Entry numbers are 32-bit, which is enough for any file below 4 GB
+        fsize = ftell_res;
+        if((uint64_t)fsize > 0xFFFFFFFE) {
             fclose(cfile);
+            config_free(config);
             return 3;
         }
         
-        fbuf = (char*)malloc(fsize);
+        fbuf = (char*)malloc(fsize + 1);
         if(fbuf == NULL) {
             fclose(cfile);
+            config_free(config);
             return 1;
         }
         
@@ -209,50 +313,40 @@ unsigned char config_read(bars_config_storage_t* config) {
         if(bytes_read != fsize || ferror(cfile) != 0) {
             fclose(cfile);
             free(fbuf);
+            config_free(config);
             return 2;
         }
         
         fclose(cfile);
+        
+        fbuf[fsize] = '\0';
+        config->file_data = fbuf;
+        config->file_size = fsize;
     }
     
-    //Read line by line
-    uint32_t pos = 0;
-    
-    //Size of line buffer
-    const uint16_t lsize = 4096;
-    //Character space for null terminated string
-    uint16_t lsizen = lsize - 1;
-    //Length of string in buffer
-    uint16_t llen;
-    char line[lsize];
+    //Read line by line, every line is null terminated in place
+    size_t pos = 0;
     
     //Parsing state
-    int32_t entry_pos = -1;
+    int64_t entry_pos = -1;
     //String key storage, one array for key in config, and second for pointers to the write location.
-    const uint16_t key_array_size = 5;
+    //The keys are in the same order as the strings of an entry after the ID.
+    const uint16_t key_array_size = CONFIG_ENTRY_STRINGS - 1;
     const char* key_array[key_array_size] = {"full_name=", "bars_path=", "stream_dir=", "mod_stream_dir=", "output_bars_path="};
-    char** key_array_output[key_array_size] = {NULL, NULL, NULL, NULL, NULL};
-    
+    char** entry_strings[CONFIG_ENTRY_STRINGS];
+    uint16_t key_length[key_array_size];
+    for(uint16_t k=0; k < key_array_size; k++) key_length[k] = strlen(key_array[k]);
     
     while(pos < fsize) {
         //Read until newline
-        llen = 0;
-        while(pos < fsize && fbuf[pos] != '\n' && fbuf[pos] != '\r') {
-            line[llen++] = fbuf[pos++];
-            //Don't overflow line buffer while also reading until newline in fbuf.
-            //This part does not need to be efficient as this will rarely happen,
-            //in normal config files you would never have a line of config that is more than 4096 characters.
-            if(llen >= lsizen) llen--;
-        }
-        
-        //Terminate line
-        line[llen] = '\0';
+        char* line = fbuf + pos;
+        while(pos < fsize && fbuf[pos] != '\n' && fbuf[pos] != '\r') pos++;
         
-        //Make sure llen is correct
-        llen = strlen(line);
+        //Terminate line, and skip the rest of the LF or CR characters.
+        while(pos < fsize && (fbuf[pos] == '\n' || fbuf[pos] == '\r')) fbuf[pos++] = '\0';
         
-        //Increment position in fbuf until we are no longer on a LF or CR character.
-        while(pos < fsize && (fbuf[pos] == '\n' || fbuf[pos] == '\r')) pos++;
+        //A null character in the line ends it early
+        size_t llen = strlen(line);
         
         //Continue if the line is a comment, empty, etc.
         if(llen == 0) continue;
@@ -265,134 +359,49 @@ unsigned char config_read(bars_config_storage_t* config) {
         
         //New game header
         if(line[0] == '^') {
-            bool overwriting_entry = 0;
+            //Write data to previously loaded entry if found
+            entry_pos = config_find(config, line + 1, llen - 1);
             
-            //Compare GameID against all previously loaded entries
-            for(uint16_t e = 0; e < config->entries_loaded; e++) {
-                if(strcmp(line + 1, config->entries[e]->id) == 0) {
-                    //Write data to previously loaded entry if found
-                    entry_pos = e;
-                    overwriting_entry = 1;
-                    break;
+            if(entry_pos == -1) {
+                if(config_reserve_entry(config)) {
+                    config_free(config);
+                    return 1;
                 }
-            }
-            
-            if(overwriting_entry == 0) {
-                //New entry
+                
+                //New entry, all strings are empty until they are set
                 entry_pos = config->entries_loaded;
-            } else {
-                //Set pointer addresses in key array to the current entry
-                key_array_output[0] = &config->entries[entry_pos]->full_name;
-                key_array_output[1] = &config->entries[entry_pos]->bars_path;
-                key_array_output[2] = &config->entries[entry_pos]->stream_dir;
-                key_array_output[3] = &config->entries[entry_pos]->mod_stream_dir;
-                key_array_output[4] = &config->entries[entry_pos]->output_bars_path;
+                config_entry_strings(&config->entries[entry_pos], entry_strings);
+                for(uint16_t k=0; k < CONFIG_ENTRY_STRINGS; k++) *entry_strings[k] = line + llen;
                 
-                //Break now, we shouldn't reallocate anything
-                continue;
-            }
-            
-            //Give up if we reached the limit of game entries
-            if(entry_pos >= MAX_CONFIG_SIZE) {
-                free(fbuf);
-                config_free(config);
-                return 4;
-            }
-            
-            //Allocate the game entry
-            config->entries[entry_pos] = (bars_game_config_t*)malloc(sizeof(bars_game_config_t));
-            if(config->entries[entry_pos] == NULL) {
-                free(fbuf);
-                config_free(config);
-                return 1;
-            }
-            
-            //Write GameID
-            config->entries[entry_pos]->id = (char*)malloc(llen);
-            if(config->entries[entry_pos]->id == NULL) {
-                free(config->entries[entry_pos]);
-                free(fbuf);
-                config_free(config);
-                return 1;
-            }
-            
-            strcpy(config->entries[entry_pos]->id, line + 1);
-            
-            //Set pointer addresses in key array
-            key_array_output[0] = &config->entries[entry_pos]->full_name;
-            key_array_output[1] = &config->entries[entry_pos]->bars_path;
-            key_array_output[2] = &config->entries[entry_pos]->stream_dir;
-            key_array_output[3] = &config->entries[entry_pos]->mod_stream_dir;
-            key_array_output[4] = &config->entries[entry_pos]->output_bars_path;
-            
-            //Null and allocate all pointers with empty strings
-            for(uint16_t k=0; k < key_array_size; k++)
-                *key_array_output[k] = NULL;
-            
-            for(uint16_t k=0; k < key_array_size; k++)
-                *key_array_output[k] = (char*)malloc(1);
-            
-            bool malloc_error = 0;
-            for(uint16_t k=0; k < key_array_size; k++)
-                if(*key_array_output[k] == NULL) { malloc_error = 1; break; }
-            
-            if(malloc_error) {
-                //Free previously allocated things in this entry, free everything else allocated in this function, return with error
-                for(uint16_t k=0; k < key_array_size; k++)
-                    free(*key_array_output[k]);
+                config->entries[entry_pos].id = line + 1;
                 
-                free(config->entries[entry_pos]->id);
-                free(config->entries[entry_pos]);
-                free(fbuf);
-                config_free(config);
-                return 1;
+                config_index_insert(config, entry_pos);
+                config->entries_loaded++;
             }
             
-            //Null the allocated strings
-            for(uint16_t k=0; k < key_array_size; k++)
-                *key_array_output[k][0] = '\0';
-            
-            config->entries_loaded++;
+            //Set pointer addresses in key array to the current entry
+            config_entry_strings(&config->entries[entry_pos], entry_strings);
         }
         
         //Anything else, after game header
         else {
-            //Check if current line matches any keys
-            bool matched = 0;
-            uint16_t key;
-            
+            //Write the rest of the current line to matching key output
             for(uint16_t k=0; k < key_array_size; k++) {
-                if(strstr(line, key_array[k]) == line) {
-                    matched = 1;
-                    key = k;
+                if(strncmp(line, key_array[k], key_length[k]) == 0) {
+                    config_set_string(config, *entry_strings[k + 1], line + key_length[k]);
                     break;
                 }
             }
-            
-            //Write the rest of the current line to matching key output
-            if(matched) {
-                //Starting position in line of string to write
-                uint32_t start_pos = strlen(key_array[key]);
-                
-                char* tmpstr = (char*)malloc((llen + 1) - start_pos);
-                if(tmpstr == NULL) {
-                    free(fbuf);
-                    config_free(config);
-                    return 1;
-                }
-                
-                strcpy(tmpstr, line + start_pos);
-                
-                //Replace current string in config with newly loaded string
-                free(*key_array_output[key]);
-                *key_array_output[key] = tmpstr;
-            }
         }
-        
-    }
     
-    free(fbuf);
+    }
     
     return 0;
 }
 
+//Loads config from config file (config_path), with the default config as base.
+//Returns the same codes as config_read_file.
+unsigned char config_read(bars_config_storage_t* config) {
+    return config_read_file(config, config_path, 1);
+}
+
@@ -4,7 +4,7 @@
 //If you are here to add a new game configuration, look to the bottom of this file.
 
 void config_free(bars_config_storage_t*);
-bool config_alloc_load_entry(bars_game_config_t*(&), const char*, const char*, const char*, const char*, const char*, const char*);
+bool config_add_entry(bars_config_storage_t*, const char*, const char*, const char*, const char*, const char*, const char*);
 
 //Loads the permanent default configuration into config storage.
 //Returns 0 on success, and 1 on memory error.
@@ -21,11 +21,10 @@ bool config_load_default(bars_config_storage_t* config) {
     const char* acnh_mod_stream_dir = "/atmosphere/contents/01006F8002326000/romfs/Sound/Resource/Stream/";
     const char* acnh_output_bars_path = "/atmosphere/contents/01006F8002326000/romfs/Sound/Resource/Bgm_Base.bars";
     
-    res = config_alloc_load_entry(config->entries[config->entries_loaded],
+    res = config_add_entry(config,
         acnh_id, acnh_full_name, acnh_bars_path, acnh_stream_dir, acnh_mod_stream_dir, acnh_output_bars_path
     );
     if(res) { config_free(config); return 1; }
-    config->entries_loaded++;
     
     
     //Example configuration for new game
@@ -44,11 +43,10 @@ bool config_load_default(bars_config_storage_t* config) {
     const char* newgame_mod_stream_dir = "/atmosphere/contents/---/romfs/Sound/Resource/Stream";
     const char* newgame_output_bars_path = "/atmosphere/contents/---/romfs/Sound/Resource/Bgm_Base.bars";
     
-    res = config_alloc_load_entry(config->entries[config->entries_loaded],
+    res = config_add_entry(config,
         newgame_id, newgame_full_name, newgame_bars_path, newgame_stream_dir, newgame_mod_stream_dir, newgame_output_bars_path
     );
     if(res) { config_free(config); return 1; }
-    config->entries_loaded++;
     
     */
     
@@ -14,6 +14,9 @@
 #include "swkbd.h"
 #include "path-resolver.h"
 
+//Cache of resolved wildcard paths
+const char* path_cache_path = "/switch/auto-bars-patcher/path-cache.txt";
+
 int main(int argc, char** args) {
     //Initial libnx configuration
     consoleInit(NULL);
@@ -47,6 +50,12 @@ int main(int argc, char** args) {
     
     config_init(config_storage);
     
+    //Initialize path resolver, with the paths resolved on earlier runs.
+    //Errors only mean that the directories are scanned again.
+    path_resolver_t path_resolver;
+    path_resolver_init(&path_resolver);
+    path_resolver_load(&path_resolver, path_cache_path);
+    
     unsigned char config_res;
     config_res = config_read(config_storage);
     
@@ -55,7 +64,6 @@ int main(int argc, char** args) {
             case 1: printf("%s", malloc_errstr); break;
             case 2: printf("\x1b[31mThe config file could not be loaded. Please check the game-config.txt file.\x1b[0m\n"); break;
             case 3: printf("\x1b[31mThe config file is too big. Please check the game-config.txt file, or delete it to load the default configuration.\x1b[0m\n"); break;
-            case 4: printf("\x1b[31mThe config file has too many entries. Please check the game-config.txt file, or delete it to load the default configuration.\x1b[0m\n"); break;
             default: printf("\x1b[31mAn unknown error has occurred when loading the config file.\x1b[0m\n"); break;
         }
         
@@ -90,7 +98,7 @@ int main(int argc, char** args) {
     {
         //Stage 1: Game selection by user.
         printf("Games in config file: \x1b[32m%d\x1b[0m. Select a game!\n\x1b[33m( < > Select   (A) Confirm )\x1b[0m\n\n", config_storage->entries_loaded);
-        uint16_t selected_game = 0;
+        uint32_t selected_game = 0;
         bool text_refresh = 1;
         bool confirmed = 0;
         bool editing_paths = 0;
@@ -128,7 +136,7 @@ int main(int argc, char** args) {
                 printf("\r");
                 for(uint8_t i=0; i<6; i++) printf("          ");
                 
-                printf("\r(%d/%d) %s[ %s ]\x1b[0m", selected_game+1, config_storage->entries_loaded, (confirmed ? "\x1b[32m" : ""), config_storage->entries[selected_game]->full_name);
+                printf("\r(%d/%d) %s[ %s ]\x1b[0m", selected_game+1, config_storage->entries_loaded, (confirmed ? "\x1b[32m" : ""), config_storage->entries[selected_game].full_name);
                 
                 //Break on confirmed flag
                 if(confirmed) {
@@ -149,16 +157,17 @@ int main(int argc, char** args) {
             editing_paths = 0;
             
             //Resolve for * in all paths
-            path_resolve(config_storage->entries[selected_game]->bars_path);
-            path_resolve(config_storage->entries[selected_game]->stream_dir);
-            path_resolve(config_storage->entries[selected_game]->mod_stream_dir);
-            path_resolve(config_storage->entries[selected_game]->output_bars_path);
+            config_set_string(config_storage, config_storage->entries[selected_game].bars_path, path_resolver_resolve(&path_resolver, config_storage->entries[selected_game].bars_path));
+            config_set_string(config_storage, config_storage->entries[selected_game].stream_dir, path_resolver_resolve(&path_resolver, config_storage->entries[selected_game].stream_dir));
+            config_set_string(config_storage, config_storage->entries[selected_game].mod_stream_dir, path_resolver_resolve(&path_resolver, config_storage->entries[selected_game].mod_stream_dir));
+            config_set_string(config_storage, config_storage->entries[selected_game].output_bars_path, path_resolver_resolve(&path_resolver, config_storage->entries[selected_game].output_bars_path));
+            path_resolver_save(&path_resolver, path_cache_path);
             
             printf("\x1b[35mOriginal BARS file: \x1b[0m%s\n\n\x1b[35mOriginal BWAV folder: \x1b[0m%s\n\n\x1b[35mModded BWAV folder: \x1b[0m%s\n\n\x1b[35mPatched BARS output: \x1b[0m%s\n\n", 
-                   config_storage->entries[selected_game]->bars_path,
-                   config_storage->entries[selected_game]->stream_dir,
-                   config_storage->entries[selected_game]->mod_stream_dir,
-                   config_storage->entries[selected_game]->output_bars_path
+                   config_storage->entries[selected_game].bars_path,
+                   config_storage->entries[selected_game].stream_dir,
+                   config_storage->entries[selected_game].mod_stream_dir,
+                   config_storage->entries[selected_game].output_bars_path
             );
             
             printf("\x1b[36mAre these settings correct?\x1b[0m \x1b[33m( (A) Accept & Patch   (B) Edit )\x1b[0m\n");
@@ -230,20 +239,20 @@ int main(int argc, char** args) {
                     
                     //Edit path with system keyboard
                     if(selected_path == 1) {
-                        swkbd_edit_text(config_storage->entries[selected_game]->bars_path, "Original BARS file path");
-                        printf("\x1b[35mNew original BARS file: \x1b[0m%s\n\n", config_storage->entries[selected_game]->bars_path);
+                        config_set_string(config_storage, config_storage->entries[selected_game].bars_path, swkbd_edit_text(config_storage->entries[selected_game].bars_path, "Original BARS file path"));
+                        printf("\x1b[35mNew original BARS file: \x1b[0m%s\n\n", config_storage->entries[selected_game].bars_path);
                     }
                     else if(selected_path == 2) {
-                        swkbd_edit_text(config_storage->entries[selected_game]->stream_dir, "Original BWAV folder path");
-                        printf("\x1b[35mNew original BWAV folder: \x1b[0m%s\n\n", config_storage->entries[selected_game]->stream_dir);
+                        config_set_string(config_storage, config_storage->entries[selected_game].stream_dir, swkbd_edit_text(config_storage->entries[selected_game].stream_dir, "Original BWAV folder path"));
+                        printf("\x1b[35mNew original BWAV folder: \x1b[0m%s\n\n", config_storage->entries[selected_game].stream_dir);
                     }
                     else if(selected_path == 3) {
-                        swkbd_edit_text(config_storage->entries[selected_game]->mod_stream_dir, "Modded BWAV folder path");
-                        printf("\x1b[35mNew modded BWAV folder: \x1b[0m%s\n\n", config_storage->entries[selected_game]->mod_stream_dir);
+                        config_set_string(config_storage, config_storage->entries[selected_game].mod_stream_dir, swkbd_edit_text(config_storage->entries[selected_game].mod_stream_dir, "Modded BWAV folder path"));
+                        printf("\x1b[35mNew modded BWAV folder: \x1b[0m%s\n\n", config_storage->entries[selected_game].mod_stream_dir);
                     }
                     else if(selected_path == 4) {
-                        swkbd_edit_text(config_storage->entries[selected_game]->output_bars_path, "Patched BARS output path");
-                        printf("\x1b[35mNew patched BARS output: \x1b[0m%s\n\n", config_storage->entries[selected_game]->output_bars_path);
+                        config_set_string(config_storage, config_storage->entries[selected_game].output_bars_path, swkbd_edit_text(config_storage->entries[selected_game].output_bars_path, "Patched BARS output path"));
+                        printf("\x1b[35mNew patched BARS output: \x1b[0m%s\n\n", config_storage->entries[selected_game].output_bars_path);
                     }
                 }
                 
@@ -282,10 +291,10 @@ int main(int argc, char** args) {
         
         unsigned char bars_res;
         bars_res = barspatcher_run(0,
-            config_storage->entries[selected_game]->stream_dir,
-            config_storage->entries[selected_game]->mod_stream_dir,
-            config_storage->entries[selected_game]->bars_path,
-            config_storage->entries[selected_game]->output_bars_path
+            config_storage->entries[selected_game].stream_dir,
+            config_storage->entries[selected_game].mod_stream_dir,
+            config_storage->entries[selected_game].bars_path,
+            config_storage->entries[selected_game].output_bars_path
         );
         
         printf("\n");
@@ -319,6 +328,7 @@ int main(int argc, char** args) {
     
     main_exit:
     
+    path_resolver_free(&path_resolver);
     config_free(config_storage);
     free(config_storage);
     consoleExit(NULL);
@@ -1,100 +1,523 @@
 //Filesystem path resolver
 //Copyright (C) 2020 I.C.
 
+//Paths can have '*' wildcards in any of their directory or file names, and a name can have more than one.
+//A wildcard matches any characters except '/'. The first matching directory entry is used, and if a later
+//wildcard has no match under it, the next matching entry is tried.
+//
+//A resolver keeps the listing of every directory it reads, so paths that share a wildcard directory only list it once.
+//Resolved paths can be saved to a cache file, and they are used again on later runs as long as the modification
+//times of the directories that were listed for them stay the same and the resolved names still exist.
+
+#pragma once
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <dirent.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+//Space reserved for the directory entry name of every wildcard
+#define PATH_RESOLVER_NAME_MAX 1024
+
+//Listing of a directory
+struct path_resolver_dir_t {
+    char* path;
+    //Entry names one after another, each null terminated
+    char* names;
+    uint32_t names_length;
+};
+
+//Resolved path
+struct path_resolver_result_t {
+    char* pattern;
+    //NULL if the path could not be resolved
+    char* result;
+    //Modification times of the directories listed for every wildcard, see path_resolver_mtimes
+    char* mtimes;
+    uint32_t hash;
+    //Results from a cache file are checked against the directories once before they are used
+    bool checked;
+};
+
+struct path_resolver_t {
+    path_resolver_dir_t* dirs;
+    uint32_t dir_count;
+    uint32_t dir_capacity;
+    
+    path_resolver_result_t* results;
+    uint32_t result_count;
+    uint32_t result_capacity;
+    
+    //Set if results changed since the cache file was loaded
+    bool modified;
+};
+
+void path_resolver_init(path_resolver_t* resolver) {
+    memset(resolver, 0, sizeof(path_resolver_t));
+}
+
+void path_resolver_free_result(path_resolver_result_t* result) {
+    free(result->pattern);
+    free(result->result);
+    free(result->mtimes);
+}
 
-void path_resolve(char* (&path)) {
-    //Allocate temporary buffer
-    uint32_t input_len = strlen(path);
-    uint32_t buf_size = input_len * 4;
-    while(buf_size % 256 != 0) buf_size++;
-    char* res = (char*)malloc(buf_size);
+void path_resolver_free(path_resolver_t* resolver) {
+    for(uint32_t d=0; d < resolver->dir_count; d++) {
+        free(resolver->dirs[d].path);
+        free(resolver->dirs[d].names);
+    }
+    for(uint32_t r=0; r < resolver->result_count; r++) path_resolver_free_result(&resolver->results[r]);
     
-    //Return unmodified on malloc error
-    if(res == NULL) return;
+    free(resolver->dirs);
+    free(resolver->results);
+    path_resolver_init(resolver);
+}
+
+//Makes space for one more item in an array. Returns 0 on success, and 1 on memory error.
+bool path_resolver_grow(void** array, uint32_t* capacity, uint32_t count, size_t item_size) {
+    if(count < *capacity) return 0;
     
-    //Fill buffer with null
-    memset(res, 0, buf_size);
+    uint32_t new_capacity = (*capacity == 0 ? 16 : *capacity * 2);
+    void* new_array = realloc(*array, new_capacity * item_size);
+    if(new_array == NULL) return 1;
     
-    //Search for *
-    uint32_t input_star_pos = 0;
+    *array = new_array;
+    *capacity = new_capacity;
+    return 0;
+}
+
+//FNV-1a hash of a path.
+uint32_t path_resolver_hash(const char* path) {
+    uint32_t hash = 2166136261u;
+    for(; *path != '\0'; path++) hash = (hash ^ (unsigned char)*path) * 16777619u;
+    return hash;
+}
+
+//Returns 1 if a name matches a pattern of the given length, where '*' matches any characters.
+bool path_resolver_glob(const char* pattern, size_t length, const char* name) {
+    size_t p = 0, n = 0;
+    //Pattern position after the last '*', and the name position it is matched from
+    size_t star = SIZE_MAX, star_name = 0;
     
-    for(uint32_t i=0; i<input_len; i++) {
-        if(path[i] == '*') {
-            input_star_pos = i;
-            break;
+    while(name[n] != '\0') {
+        if(p < length && pattern[p] == '*') {
+            star = ++p;
+            star_name = n;
+        }
+        else if(p < length && pattern[p] == name[n]) {
+            p++;
+            n++;
         }
+        else if(star != SIZE_MAX) {
+            //Let the last '*' match one more character
+            p = star;
+            n = ++star_name;
+        }
+        else return 0;
     }
     
-    if(input_star_pos == 0) {
-        //Not found, return unmodified
-        free(res);
-        return;
+    while(p < length && pattern[p] == '*') p++;
+    return p == length;
+}
+
+//Returns the number of a directory listing, reading the directory if it wasn't read yet, or -1 on memory error.
+//Directories that can't be opened have no entries.
+int64_t path_resolver_list(path_resolver_t* resolver, const char* path) {
+    for(uint32_t d=0; d < resolver->dir_count; d++) {
+        if(strcmp(resolver->dirs[d].path, path) == 0) return d;
     }
     
-    //Read back from * to / into temporary buffer
-    uint32_t i_pos;
-    uint32_t tmpbuf_key_pos = buf_size - 1;
-    for(i_pos = input_star_pos - 1; i_pos > 0 && path[i_pos] != '/'; i_pos--) {
-        res[--tmpbuf_key_pos] = path[i_pos];
-    }
+    if(path_resolver_grow((void**)&resolver->dirs, &resolver->dir_capacity, resolver->dir_count, sizeof(path_resolver_dir_t))) return -1;
     
+    path_resolver_dir_t dir;
+    dir.path = strdup(path);
+    dir.names = NULL;
+    dir.names_length = 0;
+    if(dir.path == NULL) return -1;
     
-    //Read back the path before into beginning of temporary buffer
-    i_pos++;
-    for(uint32_t i=0; i < i_pos; i++) {
-        res[i] = path[i];
+    //Empty paths are relative to the working directory
+    DIR* dirp = opendir(path[0] == '\0' ? "." : path);
+    if(dirp != NULL) {
+        uint32_t names_capacity = 0;
+        bool error = 0;
+        dirent* dir_entry;
+        
+        while(!error && (dir_entry = readdir(dirp)) != NULL) {
+            if(strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0) continue;
+            
+            uint32_t name_length = strlen(dir_entry->d_name) + 1;
+            if(dir.names_length + name_length > names_capacity) {
+                names_capacity = (names_capacity == 0 ? 4096 : names_capacity * 2);
+                while(dir.names_length + name_length > names_capacity) names_capacity *= 2;
+                
+                char* names = (char*)realloc(dir.names, names_capacity);
+                if(names == NULL) {
+                    error = 1;
+                    break;
+                }
+                dir.names = names;
+            }
+            
+            memcpy(dir.names + dir.names_length, dir_entry->d_name, name_length);
+            dir.names_length += name_length;
+        }
+        
+        closedir(dirp);
+        
+        if(error) {
+            free(dir.path);
+            free(dir.names);
+            return -1;
+        }
     }
     
+    resolver->dirs[resolver->dir_count] = dir;
+    return resolver->dir_count++;
+}
+
+/*
+ * Resolves the wildcards in the rest of a path.
+ * 
+ * rest - Part of the path after the resolved part
+ * buf - Receives the resolved path, the first length bytes are the resolved part
+ * size - Size of buf
+ * 
+ * Returns 1 if every wildcard was resolved, and 0 otherwise.
+ * 
+ */
+bool path_resolver_match(path_resolver_t* resolver, const char* rest, char* buf, size_t length, size_t size) {
+    const char* star = strchr(rest, '*');
+    if(star == NULL) {
+        strcpy(buf + length, rest);
+        return 1;
+    }
+    
+    //Name with the wildcard
+    const char* name_start = star;
+    while(name_start > rest && name_start[-1] != '/') name_start--;
+    const char* name_end = strchr(star, '/');
+    if(name_end == NULL) name_end = star + strlen(star);
+    
+    //Directory that has the name, the listing can move when more directories are read so only its names are kept
+    memcpy(buf + length, rest, name_start - rest);
+    length += name_start - rest;
+    buf[length] = '\0';
     
-    //Open directory in beginning of path and take first entry matching search key
-    DIR* dir;
-    dirent* dir_entry;
-    dir = opendir(res);
+    int64_t d = path_resolver_list(resolver, buf);
+    if(d < 0) return 0;
+    const char* names = resolver->dirs[d].names;
+    uint32_t names_length = resolver->dirs[d].names_length;
+    size_t rest_length = strlen(name_end);
     
-    if(dir == NULL) {
-        //Give up and return unmodified
-        free(res);
-        return;
+    //After the last wildcard, prefer a match whose directories exist, the last name can be a file that is created later
+    bool last_wildcard = (strchr(name_end, '*') == NULL);
+    const char* rest_dir_end = strrchr(name_end, '/');
+    const char* fallback = NULL;
+    
+    for(uint32_t pos=0; pos < names_length; pos += strlen(names + pos) + 1) {
+        const char* name = names + pos;
+        size_t name_length = strlen(name);
+        if(length + name_length + rest_length >= size || !path_resolver_glob(name_start, name_end - name_start, name)) continue;
+        
+        memcpy(buf + length, name, name_length + 1);
+        if(!last_wildcard) {
+            if(path_resolver_match(resolver, name_end, buf, length + name_length, size)) return 1;
+            continue;
+        }
+        
+        struct stat st;
+        memcpy(buf + length + name_length, name_end, (rest_dir_end == NULL ? 0 : rest_dir_end - name_end));
+        buf[length + name_length + (rest_dir_end == NULL ? 0 : rest_dir_end - name_end)] = '\0';
+        if(stat(buf, &st) == 0) {
+            strcpy(buf + length + name_length, name_end);
+            return 1;
+        }
+        if(fallback == NULL) fallback = name;
+    }
+    
+    if(fallback != NULL) {
+        strcpy(buf + length, fallback);
+        strcat(buf, name_end);
+        return 1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Returns the modification times of the directories that were listed to resolve a path, separated by spaces,
+ * allocated with malloc. These are the parent directories of every name with a wildcard in the resolved path.
+ * 
+ * recent - Set to 1 if a directory was modified in the last second, its later changes might not change its time
+ * 
+ * Returns NULL if any of the directories or the last resolved name doesn't exist, or on memory error.
+ * 
+ */
+char* path_resolver_mtimes(const char* pattern, const char* result, bool* recent) {
+    size_t result_length = strlen(result);
+    char* path = (char*)malloc(result_length + 2);
+    char* mtimes = (char*)malloc(strlen(pattern) * 24 + 1);
+    if(path == NULL || mtimes == NULL) {
+        free(path);
+        free(mtimes);
+        return NULL;
     }
     
-    bool found = 0;
+    size_t mtimes_length = 0;
+    mtimes[0] = '\0';
+    *recent = 0;
+    time_t now = time(NULL);
     
-    while((dir_entry = readdir(dir)) != NULL) {
-        if(strstr(dir_entry->d_name, res + tmpbuf_key_pos) == dir_entry->d_name) {
-            found = 1;
-            strcat(res, dir_entry->d_name);
+    //Names of the pattern and the result are compared one by one, '*' never matches '/'
+    size_t p = 0, r = 0, last_end = 0;
+    bool valid = 1;
+    while(valid) {
+        size_t p_end = p, r_end = r;
+        bool wildcard = 0;
+        while(pattern[p_end] != '\0' && pattern[p_end] != '/') wildcard |= (pattern[p_end++] == '*');
+        while(result[r_end] != '\0' && result[r_end] != '/') r_end++;
+        
+        if(wildcard) {
+            memcpy(path, result, r);
+            path[r] = '\0';
+            
+            struct stat st;
+            valid = (stat(r == 0 ? "." : path, &st) == 0);
+            if(valid && st.st_mtime + 1 >= now) *recent = 1;
+            if(valid) mtimes_length += sprintf(mtimes + mtimes_length, "%s%lld", (mtimes_length > 0 ? " " : ""), (long long)st.st_mtime);
+            last_end = r_end;
+        }
+        
+        if(pattern[p_end] == '\0' || result[r_end] == '\0') {
+            valid &= (pattern[p_end] == result[r_end]);
             break;
         }
+        p = p_end + 1;
+        r = r_end + 1;
+    }
+    
+    //The last resolved name must still exist
+    if(valid) {
+        memcpy(path, result, last_end);
+        path[last_end] = '\0';
+        
+        struct stat st;
+        valid = (stat(path, &st) == 0);
+    }
+    
+    free(path);
+    if(!valid) {
+        free(mtimes);
+        return NULL;
+    }
+    
+    return mtimes;
+}
+
+//Returns the number of a result, or -1 if the path wasn't resolved yet.
+int64_t path_resolver_find(const path_resolver_t* resolver, const char* path, uint32_t hash) {
+    for(uint32_t r=0; r < resolver->result_count; r++) {
+        if(resolver->results[r].hash == hash && strcmp(resolver->results[r].pattern, path) == 0) return r;
+    }
+    return -1;
+}
+
+//Adds a result, the strings must be allocated with malloc and are freed on errors.
+//Returns the number of the result, or -1 on memory error.
+int64_t path_resolver_add(path_resolver_t* resolver, char* pattern, char* result, char* mtimes, bool checked) {
+    if(path_resolver_grow((void**)&resolver->results, &resolver->result_capacity, resolver->result_count, sizeof(path_resolver_result_t))) {
+        free(pattern);
+        free(result);
+        free(mtimes);
+        return -1;
+    }
+    
+    path_resolver_result_t* entry = &resolver->results[resolver->result_count];
+    entry->pattern = pattern;
+    entry->result = result;
+    entry->mtimes = mtimes;
+    entry->hash = path_resolver_hash(pattern);
+    entry->checked = checked;
+    
+    return resolver->result_count++;
+}
+
+//Resolves the wildcards in a path.
+//Returns the resolved path allocated with malloc, or NULL if the path has no '*' or could not be resolved.
+char* path_resolver_resolve(path_resolver_t* resolver, const char* path) {
+    if(strchr(path, '*') == NULL) return NULL;
+    
+    int64_t r = path_resolver_find(resolver, path, path_resolver_hash(path));
+    
+    //Results from the cache file are only used if the directories didn't change since they were saved
+    if(r >= 0 && !resolver->results[r].checked) {
+        path_resolver_result_t* cached = &resolver->results[r];
+        bool recent;
+        char* mtimes = path_resolver_mtimes(cached->pattern, cached->result, &recent);
+        
+        if(mtimes != NULL && strcmp(mtimes, cached->mtimes) == 0) cached->checked = 1;
+        else {
+            path_resolver_free_result(cached);
+            resolver->results[r] = resolver->results[--resolver->result_count];
+            resolver->modified = 1;
+            r = -1;
+        }
+        free(mtimes);
     }
     
-    closedir(dir);
+    if(r < 0) {
+        size_t path_length = strlen(path);
+        size_t wildcards = 0;
+        for(const char* c = path; *c != '\0'; c++) wildcards += (*c == '*');
+        
+        size_t size = path_length + wildcards * PATH_RESOLVER_NAME_MAX + 1;
+        char* buf = (char*)malloc(size);
+        if(buf == NULL) return NULL;
+        
+        char* result = NULL;
+        char* mtimes = NULL;
+        if(path_resolver_match(resolver, path, buf, 0, size)) {
+            result = strdup(buf);
+            bool recent;
+            if(result != NULL) mtimes = path_resolver_mtimes(path, result, &recent);
+            
+            //Directories that changed just now might change again within the same second, so the result is not saved
+            if(mtimes != NULL && recent) {
+                free(mtimes);
+                mtimes = NULL;
+            }
+        }
+        free(buf);
+        
+        char* pattern = strdup(path);
+        if(pattern == NULL) {
+            free(mtimes);
+            return result;
+        }
+        
+        //Failed paths are kept for this run only
+        if(mtimes != NULL) resolver->modified = 1;
+        r = path_resolver_add(resolver, pattern, result, mtimes, 1);
+        if(r < 0) return NULL;
+    }
     
-    if(!found) {
-        //Return unmodified
-        free(res);
-        return;
+    if(resolver->results[r].result == NULL) return NULL;
+    return strdup(resolver->results[r].result);
+}
+
+/*
+ * Cache file format, for every resolved path:
+ * ^pattern
+ * result=resolved path
+ * mtimes=modification times of the listed directories
+ * 
+ */
+
+//Adds a result loaded from a cache file, unless the path is already in the resolver.
+//Returns 0 on success, and 1 on memory error.
+bool path_resolver_load_entry(path_resolver_t* resolver, const char* pattern, const char* result, const char* mtimes) {
+    if(pattern == NULL || result == NULL || mtimes == NULL) return 0;
+    if(path_resolver_find(resolver, pattern, path_resolver_hash(pattern)) >= 0) return 0;
+    
+    char* pattern_copy = strdup(pattern);
+    char* result_copy = strdup(result);
+    char* mtimes_copy = strdup(mtimes);
+    if(pattern_copy == NULL || result_copy == NULL || mtimes_copy == NULL) {
+        free(pattern_copy);
+        free(result_copy);
+        free(mtimes_copy);
+        return 1;
     }
     
+    return path_resolver_add(resolver, pattern_copy, result_copy, mtimes_copy, 0) < 0;
+}
+
+//Loads resolved paths from a cache file. A missing file is not an error.
+//Returns 0 on success, and 1 on errors.
+bool path_resolver_load(path_resolver_t* resolver, const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if(file == NULL) return (errno != ENOENT);
+    
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
     
-    //Add the rest of the path into result
-    strcat(res, path + input_star_pos + 1);
+    char* data = (file_size >= 0 ? (char*)malloc(file_size + 1) : NULL);
+    bool error = (data == NULL || fread(data, 1, file_size, file) != (size_t)file_size);
+    fclose(file);
     
-    //Reallocate
-    char* res_tmp = (char*)realloc(res, strlen(res) + 1);
-    if(res_tmp == NULL) {
-        //Give up and return unmodified
-        free(res);
-        return;
+    if(error) {
+        free(data);
+        return 1;
     }
+    data[file_size] = '\0';
     
-    res = res_tmp;
+    //Read line by line, every line is null terminated in place
+    const char* pattern = NULL;
+    const char* result = NULL;
+    const char* mtimes = NULL;
+    char* line = data;
     
-    //Replace input data with result
-    free(path);
-    path = res;
+    while(!error) {
+        char* end = line + strcspn(line, "\r\n");
+        bool last = (*end == '\0');
+        *end = '\0';
+        
+        //A new entry completes the previous one
+        if(line[0] == '^') {
+            error = path_resolver_load_entry(resolver, pattern, result, mtimes);
+            pattern = line + 1;
+            result = NULL;
+            mtimes = NULL;
+        }
+        else if(strncmp(line, "result=", 7) == 0) result = line + 7;
+        else if(strncmp(line, "mtimes=", 7) == 0) mtimes = line + 7;
+        
+        if(last) break;
+        line = end + 1;
+    }
+    
+    if(!error) error = path_resolver_load_entry(resolver, pattern, result, mtimes);
+    
+    free(data);
+    return error;
 }
 
+//Saves the resolved paths to a cache file if they changed since it was loaded.
+//Returns 0 on success, and 1 on file errors.
+bool path_resolver_save(path_resolver_t* resolver, const char* filename) {
+    if(!resolver->modified) return 0;
+    
+    FILE* file = fopen(filename, "wb");
+    if(file == NULL) return 1;
+    
+    fprintf(file, "#Resolved wildcard paths, delete this file to scan the directories again\n");
+    for(uint32_t r=0; r < resolver->result_count; r++) {
+        const path_resolver_result_t* entry = &resolver->results[r];
+        if(entry->result == NULL || entry->mtimes == NULL) continue;
+        
+        fprintf(file, "^%s\nresult=%s\nmtimes=%s\n", entry->pattern, entry->result, entry->mtimes);
+    }
+    
+    bool error = (ferror(file) != 0);
+    if(fclose(file) != 0) error = 1;
+    if(!error) resolver->modified = 0;
+    
+    return error;
+}
+
+//Resolves the wildcards in a path without keeping any directory listings.
+//Returns the resolved path allocated with malloc, or NULL if the path has no '*' or could not be resolved.
+char* path_resolve(const char* path) {
+    path_resolver_t resolver;
+    path_resolver_init(&resolver);
+    
+    char* result = path_resolver_resolve(&resolver, path);
+    
+    path_resolver_free(&resolver);
+    return result;
+}
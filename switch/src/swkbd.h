@@ -4,7 +4,9 @@
 #include <stdlib.h>
 #include <switch.h>
 
-void swkbd_edit_text(char* (&str), const char* hint) {
+//Shows the system keyboard to edit a string.
+//Returns the edited string allocated with malloc, or NULL if the keyboard was cancelled or on errors.
+char* swkbd_edit_text(const char* str, const char* hint) {
     SwkbdConfig swkbd;
     
     uint32_t res;
@@ -14,13 +16,13 @@ void swkbd_edit_text(char* (&str), const char* hint) {
     if(res_str_bufsize < 500) res_str_bufsize = 500;
     while(res_str_bufsize % 256 != 0) res_str_bufsize++;
     char* res_str = (char*)malloc(res_str_bufsize);
-    if(res_str == NULL) return;
+    if(res_str == NULL) return NULL;
     
     //Allocate swkbd
     res = swkbdCreate(&swkbd, 0);
     if(res != 0) {
         free(res_str);
-        return;
+        return NULL;
     }
     
     //Set initial and hint text
@@ -42,19 +44,17 @@ void swkbd_edit_text(char* (&str), const char* hint) {
     
     if(res != 0) {
         free(res_str);
-        return;
+        return NULL;
     }
     
     //Realloc output buffer to size of string
     char* res_str_tmp = (char*)realloc(res_str, strlen(res_str) + 1);
     if(res_str_tmp == NULL) {
         free(res_str);
-        return;
+        return NULL;
     }
     
     res_str = res_str_tmp;
     
-    //Replace input data with result
-    free(str);
-    str = res_str;
+    return res_str;
 }